@@ -157,6 +157,8 @@ static struct avflt_inode_data *avflt_inode_data_alloc(void)
 		 return ERR_PTR(err);
 	}
 
+	/* Only cached scan results, they are rebuilt after a reclaim. */
+	data->rfs_data.flags |= REDIRFS_DATA_RECLAIM;
 	spin_lock_init(&data->lock);
 	return data;
 }
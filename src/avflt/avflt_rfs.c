@@ -335,11 +335,48 @@ static int avflt_add_path(struct redirfs_path_info *info)
 	return 0;
 }
 
+/*
+ * The batch does not return its paths, root data are attached to the roots
+ * of all the filter's paths, the ones which already have them are skipped.
+ */
+static int avflt_add_paths(struct redirfs_path_info **infos)
+{
+	struct avflt_root_data *data;
+	redirfs_path *paths;
+	redirfs_root root;
+	int rv;
+	int i;
+
+	rv = redirfs_add_paths(avflt, infos);
+	if (rv)
+		return rv;
+
+	paths = redirfs_get_paths(avflt);
+	if (IS_ERR(paths))
+		return PTR_ERR(paths);
+
+	for (i = 0; paths[i]; i++) {
+		root = redirfs_get_root_path(paths[i]);
+		if (!root)
+			continue;
+
+		data = avflt_attach_root_data(root);
+
+		redirfs_put_root(root);
+		avflt_put_root_data(data);
+	}
+
+	redirfs_put_paths(paths);
+
+	return 0;
+}
+
 redirfs_filter avflt;
 
 static struct redirfs_filter_operations avflt_ops = {
 	.activate = avflt_activate,
 	.add_path = avflt_add_path,
+	.add_paths = avflt_add_paths,
 	.post_rename = avflt_rename_to
 };
 
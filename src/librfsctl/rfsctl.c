@@ -18,6 +18,7 @@
 #include "rfsctl.h"
 
 static const char *rfsctl_dir = "/sys/fs/redirfs/filters";
+static const char *rfsctl_stats_dir = "/sys/fs/redirfs/stats";
 
 static struct rfsctl_path *rfsctl_get_path(const char *buf)
 {
@@ -452,6 +453,80 @@ int rfsctl_add_path(const char *name, const char *path, int type)
 	return 0;
 }
 
+/*
+ * Add a NULL terminated array of paths. The paths are written in batches
+ * which fit into one page, each batch is added by the kernel with a single
+ * dcache walk per file system. A failing batch is rolled back by the
+ * kernel, but the batches written before it stay registered.
+ */
+int rfsctl_add_paths(const char *name, struct rfsctl_path **paths)
+{
+	char *buf;
+	int size;
+	int len;
+	int i;
+	char t;
+	long page_size;
+
+	if (!name || !paths) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; paths[i]; i++) {
+		if (!paths[i]->name || (paths[i]->type != RFSCTL_PATH_INCLUDE &&
+		    paths[i]->type != RFSCTL_PATH_EXCLUDE)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0)
+		return -1;
+
+	buf = malloc(sizeof(char) * page_size);
+	if (!buf)
+		return -1;
+
+	size = 0;
+	for (i = 0; paths[i]; i++) {
+		if (paths[i]->type == RFSCTL_PATH_INCLUDE)
+			t = 'i';
+		else
+			t = 'e';
+
+		len = strlen(paths[i]->name) + 3;
+		if (len + 3 > page_size) {
+			free(buf);
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (size && size + len + 1 > page_size) {
+			if (rfsctl_write_data(name, "paths", buf,
+						size + 1) == -1) {
+				free(buf);
+				return -1;
+			}
+			size = 0;
+		}
+
+		if (!size)
+			size = sprintf(buf, "b\n");
+
+		size += sprintf(buf + size, "%c:%s\n", t, paths[i]->name);
+	}
+
+	if (size && rfsctl_write_data(name, "paths", buf, size + 1) == -1) {
+		free(buf);
+		return -1;
+	}
+
+	free(buf);
+	return 0;
+}
+
 int rfsctl_rem_path(const char *name, int id)
 {
 	char buf[256];
@@ -561,3 +636,142 @@ int rfsctl_deactivate(const char *name)
 	return 0;
 }
 
+static struct rfsctl_objs *rfsctl_get_obj(const char *buf, int type)
+{
+	struct rfsctl_objs *objs;
+	int off = 0;
+	int len;
+
+	objs = malloc(sizeof(struct rfsctl_objs));
+	if (!objs)
+		return NULL;
+
+	objs->chains = -1;
+	objs->data = -1;
+	objs->name = NULL;
+
+	if (sscanf(buf, "%ld:%ld:%ld:%ld%n", &objs->dentries, &objs->inodes,
+				&objs->files, &objs->infos, &off) != 4)
+		goto error;
+
+	if (type != RFSCTL_OBJS_ROOTS) {
+		if (sscanf(buf + off, ":%ld:%ld%n", &objs->chains,
+					&objs->data, &len) != 2)
+			goto error;
+
+		off += len;
+	}
+
+	if (type == RFSCTL_OBJS_TOTAL)
+		return objs;
+
+	if (buf[off] != ':')
+		goto error;
+
+	objs->name = strdup(buf + off + 1);
+	if (!objs->name)
+		goto error;
+
+	return objs;
+error:
+	free(objs);
+	return NULL;
+}
+
+struct rfsctl_objs **rfsctl_get_objs(int type)
+{
+	struct rfsctl_objs **objs = NULL;
+	struct rfsctl_objs **tmp;
+	struct rfsctl_objs *obj;
+	const char *filename;
+	char *fn = NULL;
+	char *buf = NULL;
+	long page_size;
+	int off = 0;
+	int i = 0;
+	int fd;
+	int rb;
+
+	if (type == RFSCTL_OBJS_TOTAL)
+		filename = "objects";
+	else if (type == RFSCTL_OBJS_ROOTS)
+		filename = "roots";
+	else if (type == RFSCTL_OBJS_FILTERS)
+		filename = "filters";
+	else {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0)
+		return NULL;
+
+	objs = malloc(sizeof(struct rfsctl_objs *));
+	if (!objs)
+		return NULL;
+
+	objs[0] = NULL;
+
+	fn = malloc(sizeof(char) * (strlen(rfsctl_stats_dir) +
+				strlen(filename) + 2));
+	buf = malloc(sizeof(char) * page_size);
+	if (!fn || !buf)
+		goto error;
+
+	sprintf(fn, "%s/%s", rfsctl_stats_dir, filename);
+
+	fd = open(fn, O_RDONLY);
+	if (fd == -1)
+		goto error;
+
+	memset(buf, 0, page_size);
+	rb = read(fd, buf, page_size - 1);
+	close(fd);
+	if (rb == -1)
+		goto error;
+
+	while (off < rb) {
+		obj = rfsctl_get_obj(buf + off, type);
+		if (!obj)
+			goto error;
+
+		tmp = realloc(objs, sizeof(struct rfsctl_objs *) * (i + 2));
+		if (!tmp) {
+			free(obj->name);
+			free(obj);
+			goto error;
+		}
+
+		objs = tmp;
+		objs[i++] = obj;
+		objs[i] = NULL;
+
+		off += strlen(buf + off) + 1;
+	}
+
+	free(buf);
+	free(fn);
+	return objs;
+error:
+	rfsctl_put_objs(objs);
+	free(buf);
+	free(fn);
+	return NULL;
+}
+
+void rfsctl_put_objs(struct rfsctl_objs **objs)
+{
+	int i = 0;
+
+	if (!objs)
+		return;
+
+	while (objs[i]) {
+		free(objs[i]->name);
+		free(objs[i]);
+		i++;
+	}
+
+	free(objs);
+}
@@ -17,6 +17,25 @@ struct rfsctl_path {
 	char *name;
 };
 
+#define RFSCTL_OBJS_TOTAL	1
+#define RFSCTL_OBJS_ROOTS	2
+#define RFSCTL_OBJS_FILTERS	3
+
+/*
+ * Numbers of live redirfs objects. The name is the root's path or the
+ * filter's name, NULL for the totals. Roots have no chains and data
+ * counts, they are set to -1.
+ */
+struct rfsctl_objs {
+	long dentries;
+	long inodes;
+	long files;
+	long infos;
+	long chains;
+	long data;
+	char *name;
+};
+
 struct rfsctl_filter {
 	struct rfsctl_path **paths;
 	char *name;
@@ -29,12 +48,15 @@ void rfsctl_put_filter(struct rfsctl_filter *filter);
 struct rfsctl_filter **rfsctl_get_filters(void);
 void rfsctl_put_filters(struct rfsctl_filter **filters);
 int rfsctl_add_path(const char *name, const char *path, int type);
+int rfsctl_add_paths(const char *name, struct rfsctl_path **paths);
 int rfsctl_rem_path(const char *name, int id);
 int rfsctl_rem_path_name(const char *name, const char *path);
 int rfsctl_del_paths(const char *name);
 int rfsctl_unregister(const char *name);
 int rfsctl_activate(const char *name);
 int rfsctl_deactivate(const char *name);
+struct rfsctl_objs **rfsctl_get_objs(int type);
+void rfsctl_put_objs(struct rfsctl_objs **objs);
 int rfsctl_read_data(const char *fltname, const char *filename, char *buf,
 		int size);
 int rfsctl_write_data(const char *fltname, const char *filename, char *buf,
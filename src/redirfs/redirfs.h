@@ -32,6 +32,7 @@
 #include <linux/kobject.h>
 #include <linux/types.h>
 #include <linux/aio.h>
+#include <linux/rcupdate.h>
 #include <linux/version.h>
 
 #define REDIRFS_VERSION "1.0.5"
@@ -39,6 +40,19 @@
 #define REDIRFS_PATH_INCLUDE		1
 #define REDIRFS_PATH_EXCLUDE		2
 
+/*
+ * Maximum number of filters included in one path. Adding a path for a filter
+ * which would exceed it fails with -ENOSPC.
+ */
+#define REDIRFS_PATH_FILTERS_MAX	BITS_PER_LONG
+
+/*
+ * Maximum number of registered filters. Each filter owns one private data
+ * slot in every object, redirfs_register_filter fails with -ENOSPC when all
+ * slots are taken.
+ */
+#define REDIRFS_FILTERS_MAX		32
+
 #define REDIRFS_FILTER_ATTRIBUTE(__name, __mode, __show, __store) \
 	__ATTR(__name, __mode, __show, __store)
 
@@ -109,6 +123,11 @@ enum redirfs_op_id {
 
 	REDIRFS_REG_IOP_PERMISSION,
 	REDIRFS_REG_IOP_SETATTR,
+	REDIRFS_REG_IOP_GETATTR,
+	REDIRFS_REG_IOP_GETXATTR,
+	REDIRFS_REG_IOP_SETXATTR,
+	REDIRFS_REG_IOP_LISTXATTR,
+	REDIRFS_REG_IOP_REMOVEXATTR,
 
 	REDIRFS_DIR_IOP_CREATE,
 	REDIRFS_DIR_IOP_LOOKUP,
@@ -121,77 +140,123 @@ enum redirfs_op_id {
 	REDIRFS_DIR_IOP_RENAME,
 	REDIRFS_DIR_IOP_PERMISSION,
 	REDIRFS_DIR_IOP_SETATTR,
+	REDIRFS_DIR_IOP_GETATTR,
+	REDIRFS_DIR_IOP_GETXATTR,
+	REDIRFS_DIR_IOP_SETXATTR,
+	REDIRFS_DIR_IOP_LISTXATTR,
+	REDIRFS_DIR_IOP_REMOVEXATTR,
 
 	REDIRFS_CHR_IOP_PERMISSION,
 	REDIRFS_CHR_IOP_SETATTR,
+	REDIRFS_CHR_IOP_GETATTR,
+	REDIRFS_CHR_IOP_GETXATTR,
+	REDIRFS_CHR_IOP_SETXATTR,
+	REDIRFS_CHR_IOP_LISTXATTR,
+	REDIRFS_CHR_IOP_REMOVEXATTR,
 
 	REDIRFS_BLK_IOP_PERMISSION,
 	REDIRFS_BLK_IOP_SETATTR,
+	REDIRFS_BLK_IOP_GETATTR,
+	REDIRFS_BLK_IOP_GETXATTR,
+	REDIRFS_BLK_IOP_SETXATTR,
+	REDIRFS_BLK_IOP_LISTXATTR,
+	REDIRFS_BLK_IOP_REMOVEXATTR,
 
 	REDIRFS_FIFO_IOP_PERMISSION,
 	REDIRFS_FIFO_IOP_SETATTR,
+	REDIRFS_FIFO_IOP_GETATTR,
+	REDIRFS_FIFO_IOP_GETXATTR,
+	REDIRFS_FIFO_IOP_SETXATTR,
+	REDIRFS_FIFO_IOP_LISTXATTR,
+	REDIRFS_FIFO_IOP_REMOVEXATTR,
 
 	REDIRFS_LNK_IOP_PERMISSION,
 	REDIRFS_LNK_IOP_SETATTR,
+	REDIRFS_LNK_IOP_GETATTR,
+	REDIRFS_LNK_IOP_GETXATTR,
+	REDIRFS_LNK_IOP_SETXATTR,
+	REDIRFS_LNK_IOP_LISTXATTR,
+	REDIRFS_LNK_IOP_REMOVEXATTR,
 
 	REDIRFS_SOCK_IOP_PERMISSION,
 	REDIRFS_SOCK_IOP_SETATTR,
+	REDIRFS_SOCK_IOP_GETATTR,
+	REDIRFS_SOCK_IOP_GETXATTR,
+	REDIRFS_SOCK_IOP_SETXATTR,
+	REDIRFS_SOCK_IOP_LISTXATTR,
+	REDIRFS_SOCK_IOP_REMOVEXATTR,
 
 	REDIRFS_REG_FOP_OPEN,
 	REDIRFS_REG_FOP_RELEASE,
-	/* REDIRFS_REG_FOP_LLSEEK, */
-	/* REDIRFS_REG_FOP_READ, */
-	/* REDIRFS_REG_FOP_WRITE, */
-	/* REDIRFS_REG_FOP_AIO_READ, */
-	/* REDIRFS_REG_FOP_AIO_WRITE, */
-	/* REDIRFS_REG_FOP_MMAP, */
-	/* REDIRFS_REG_FOP_FLUSH, */
+	REDIRFS_REG_FOP_LLSEEK,
+	REDIRFS_REG_FOP_READ,
+	REDIRFS_REG_FOP_WRITE,
+	REDIRFS_REG_FOP_AIO_READ,
+	REDIRFS_REG_FOP_AIO_WRITE,
+	REDIRFS_REG_FOP_MMAP,
+	REDIRFS_REG_FOP_FLUSH,
+	REDIRFS_REG_FOP_SPLICE_READ,
+	REDIRFS_REG_FOP_SPLICE_WRITE,
+	REDIRFS_REG_FOP_FSYNC,
 
 	REDIRFS_DIR_FOP_OPEN,
 	REDIRFS_DIR_FOP_RELEASE,
 	REDIRFS_DIR_FOP_READDIR,
-	/* REDIRFS_DIR_FOP_FLUSH, */
+	REDIRFS_DIR_FOP_FLUSH,
+	REDIRFS_DIR_FOP_FSYNC,
 
 	REDIRFS_CHR_FOP_OPEN,
 	REDIRFS_CHR_FOP_RELEASE,
-	/* REDIRFS_CHR_FOP_LLSEEK, */
-	/* REDIRFS_CHR_FOP_READ, */
-	/* REDIRFS_CHR_FOP_WRITE, */
-	/* REDIRFS_CHR_FOP_AIO_READ, */
-	/* REDIRFS_CHR_FOP_AIO_WRITE, */
-	/* REDIRFS_CHR_FOP_FLUSH, */
+	REDIRFS_CHR_FOP_LLSEEK,
+	REDIRFS_CHR_FOP_READ,
+	REDIRFS_CHR_FOP_WRITE,
+	REDIRFS_CHR_FOP_AIO_READ,
+	REDIRFS_CHR_FOP_AIO_WRITE,
+	REDIRFS_CHR_FOP_FLUSH,
+	REDIRFS_CHR_FOP_SPLICE_READ,
+	REDIRFS_CHR_FOP_SPLICE_WRITE,
+	REDIRFS_CHR_FOP_FSYNC,
 
 	REDIRFS_BLK_FOP_OPEN,
 	REDIRFS_BLK_FOP_RELEASE,
-	/* REDIRFS_BLK_FOP_LLSEEK, */
-	/* REDIRFS_BLK_FOP_READ, */
-	/* REDIRFS_BLK_FOP_WRITE, */
-	/* REDIRFS_BLK_FOP_AIO_READ, */
-	/* REDIRFS_BLK_FOP_AIO_WRITE, */
-	/* REDIRFS_BLK_FOP_FLUSH, */
+	REDIRFS_BLK_FOP_LLSEEK,
+	REDIRFS_BLK_FOP_READ,
+	REDIRFS_BLK_FOP_WRITE,
+	REDIRFS_BLK_FOP_AIO_READ,
+	REDIRFS_BLK_FOP_AIO_WRITE,
+	REDIRFS_BLK_FOP_FLUSH,
+	REDIRFS_BLK_FOP_SPLICE_READ,
+	REDIRFS_BLK_FOP_SPLICE_WRITE,
+	REDIRFS_BLK_FOP_FSYNC,
 
 	REDIRFS_FIFO_FOP_OPEN,
 	REDIRFS_FIFO_FOP_RELEASE,
-	/* REDIRFS_FIFO_FOP_LLSEEK, */
-	/* REDIRFS_FIFO_FOP_READ, */
-	/* REDIRFS_FIFO_FOP_WRITE, */
-	/* REDIRFS_FIFO_FOP_AIO_READ, */
-	/* REDIRFS_FIFO_FOP_AIO_WRITE, */
-	/* REDIRFS_FIFO_FOP_FLUSH, */
+	REDIRFS_FIFO_FOP_LLSEEK,
+	REDIRFS_FIFO_FOP_READ,
+	REDIRFS_FIFO_FOP_WRITE,
+	REDIRFS_FIFO_FOP_AIO_READ,
+	REDIRFS_FIFO_FOP_AIO_WRITE,
+	REDIRFS_FIFO_FOP_FLUSH,
+	REDIRFS_FIFO_FOP_SPLICE_READ,
+	REDIRFS_FIFO_FOP_SPLICE_WRITE,
+	REDIRFS_FIFO_FOP_FSYNC,
 
 	REDIRFS_LNK_FOP_OPEN,
 	REDIRFS_LNK_FOP_RELEASE,
-	/* REDIRFS_LNK_FOP_LLSEEK, */
-	/* REDIRFS_LNK_FOP_READ, */
-	/* REDIRFS_LNK_FOP_WRITE, */
-	/* REDIRFS_LNK_FOP_AIO_READ, */
-	/* REDIRFS_LNK_FOP_AIO_WRITE, */
-	/* REDIRFS_LNK_FOP_FLUSH, */
-
-	/* REDIRFS_REG_AOP_READPAGE, */
-	/* REDIRFS_REG_AOP_WRITEPAGE, */
-	/* REDIRFS_REG_AOP_READPAGES, */
-	/* REDIRFS_REG_AOP_WRITEPAGES, */
+	REDIRFS_LNK_FOP_LLSEEK,
+	REDIRFS_LNK_FOP_READ,
+	REDIRFS_LNK_FOP_WRITE,
+	REDIRFS_LNK_FOP_AIO_READ,
+	REDIRFS_LNK_FOP_AIO_WRITE,
+	REDIRFS_LNK_FOP_FLUSH,
+	REDIRFS_LNK_FOP_SPLICE_READ,
+	REDIRFS_LNK_FOP_SPLICE_WRITE,
+	REDIRFS_LNK_FOP_FSYNC,
+
+	REDIRFS_REG_AOP_READPAGE,
+	REDIRFS_REG_AOP_WRITEPAGE,
+	REDIRFS_REG_AOP_READPAGES,
+	REDIRFS_REG_AOP_WRITEPAGES,
 	/* REDIRFS_REG_AOP_SYNC_PAGE, */
 	/* REDIRFS_REG_AOP_SET_PAGE_DIRTY, */
 	/* REDIRFS_REG_AOP_PREPARE_WRITE, */
@@ -204,6 +269,9 @@ enum redirfs_op_id {
 	/* REDIRFS_REG_AOP_MIGRATEPAGE, */
 	/* REDIRFS_REG_AOP_LAUNDER_PAGE, */
 
+	REDIRFS_REG_VMOP_FAULT,
+	REDIRFS_REG_VMOP_PAGE_MKWRITE,
+
 	REDIRFS_OP_END
 };
 
@@ -363,6 +431,38 @@ union redirfs_op_args {
 		struct iattr *iattr;
 	} i_setattr;
 
+	struct {
+		struct vfsmount *mnt;
+		struct dentry *dentry;
+		struct kstat *stat;
+	} i_getattr;
+
+	struct {
+		struct dentry *dentry;
+		const char *name;
+		void *buffer;
+		size_t size;
+	} i_getxattr;
+
+	struct {
+		struct dentry *dentry;
+		const char *name;
+		const void *value;
+		size_t size;
+		int flags;
+	} i_setxattr;
+
+	struct {
+		struct dentry *dentry;
+		char *list;
+		size_t size;
+	} i_listxattr;
+
+	struct {
+		struct dentry *dentry;
+		const char *name;
+	} i_removexattr;
+
 	struct {
 		struct inode *inode;
 		struct file *file;
@@ -373,19 +473,35 @@ union redirfs_op_args {
 		struct file *file;
 	} f_release;
 
-	/*
 	struct {
 		struct file *file;
 		fl_owner_t id;
 	} f_flush;
-	*/
 
-	/*
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
+	struct {
+		struct file *file;
+		struct dentry *dentry;
+		int datasync;
+	} f_fsync;
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0)
+	struct {
+		struct file *file;
+		int datasync;
+	} f_fsync;
+#else
+	struct {
+		struct file *file;
+		loff_t start;
+		loff_t end;
+		int datasync;
+	} f_fsync;
+#endif
+
 	struct {
 		struct file *file;
 		struct vm_area_struct *vma;
 	} f_mmap;
-	*/
 
 	struct {
 		struct file *file;
@@ -393,79 +509,87 @@ union redirfs_op_args {
 		filldir_t filldir;
 	} f_readdir;
 
-	/*
 	struct {
-                struct file *file;
-                loff_t offset;
-                int origin;
+		struct file *file;
+		loff_t offset;
+		int origin;
 	} f_llseek;
-	*/
 
-	/*
 	struct {
 		struct file *file;
 		char __user *buf;
 		size_t count;
 		loff_t *pos;
 	} f_read;
-	*/
 
-	/*
 	struct {
 		struct file *file;
 		const char __user *buf;
 		size_t count;
 		loff_t *pos;
 	} f_write;
-	*/
 
-	/*
 	struct {
 		struct kiocb *iocb;
 		const struct iovec *iov;
 		unsigned long nr_segs;
 		loff_t pos;
 	} f_aio_read;
-	*/
 
-	/*
 	struct {
 		struct kiocb *iocb;
 		const struct iovec *iov;
 		unsigned long nr_segs;
 		loff_t pos;
 	} f_aio_write;
-	*/
 
-	/*
+	struct {
+		struct file *file;
+		loff_t *pos;
+		struct pipe_inode_info *pipe;
+		size_t len;
+		unsigned int flags;
+	} f_splice_read;
+
+	struct {
+		struct pipe_inode_info *pipe;
+		struct file *file;
+		loff_t *pos;
+		size_t len;
+		unsigned int flags;
+	} f_splice_write;
+
 	struct {
 		struct file *file;
 		struct page *page;
 	} a_readpage;
-	*/
 
-	/*
 	struct {
 		struct page *page;
 		struct writeback_control *wbc;
 	} a_writepage;
-	*/
 
-	/*
 	struct {
 		struct file *file;
 		struct address_space *mapping;
 		struct list_head *pages;
 		unsigned nr_pages;
 	} a_readpages;
-	*/
 
-	/*
 	struct {
 		struct address_space *mapping;
 		struct writeback_control *wbc;
 	} a_writepages;
-	*/
+
+	struct {
+		struct vm_area_struct *vma;
+		struct vm_fault *vmf;
+	} v_fault;
+
+	struct {
+		struct vm_area_struct *vma;
+		struct vm_fault *vmf;
+	} v_page_mkwrite;
 
 	/*
 	struct {
@@ -568,10 +692,18 @@ struct redirfs_path_info {
 	int flags;
 };
 
+/*
+ * Run the post callback from the redirfs workqueue after the VFS operation
+ * returned. Only operations whose arguments can be pinned are supported,
+ * see doc/redirfs/deferred_post.txt.
+ */
+#define REDIRFS_OP_DEFER_POST	0x01
+
 struct redirfs_op_info {
 	enum redirfs_op_id op_id;
 	enum redirfs_rv (*pre_cb)(redirfs_context, struct redirfs_args *);
 	enum redirfs_rv (*post_cb)(redirfs_context, struct redirfs_args *);
+	int flags;
 };
 
 struct redirfs_filter_operations {
@@ -587,6 +719,7 @@ struct redirfs_filter_operations {
 	int (*inode_moved)(redirfs_root, redirfs_root, struct inode *);
 	enum redirfs_rv (*pre_rename)(redirfs_context, struct redirfs_args *);
 	enum redirfs_rv (*post_rename)(redirfs_context, struct redirfs_args *);
+	int (*add_paths)(struct redirfs_path_info **);
 };
 
 struct redirfs_filter_info {
@@ -606,12 +739,27 @@ struct redirfs_filter_attribute {
 			size_t count);
 };
 
+/*
+ * Dentry and inode data with REDIRFS_DATA_RECLAIM set may be detached by
+ * redirfs under memory pressure once the dentry is unused. The flag has to
+ * be set before the data are attached.
+ */
+#define REDIRFS_DATA_RECLAIM	0x0001
+
+/*
+ * Maximum size of the per-inode blob a filter can keep in its
+ * trusted.redirfs.<filter name> extended attribute.
+ */
+#define REDIRFS_XATTR_DATA_MAX	256
+
 struct redirfs_data {
 	struct list_head list;
+	struct rcu_head rcu;
 	atomic_t cnt;
 	redirfs_filter filter;
 	void (*free)(struct redirfs_data *);
 	void (*detach)(struct redirfs_data *);
+	unsigned int flags;
 };
 
 int redirfs_create_attribute(redirfs_filter filter,
@@ -621,6 +769,8 @@ int redirfs_remove_attribute(redirfs_filter filter,
 struct kobject *redirfs_filter_kobject(redirfs_filter filter);
 redirfs_path redirfs_add_path(redirfs_filter filter,
 		struct redirfs_path_info *info);
+int redirfs_add_paths(redirfs_filter filter,
+		struct redirfs_path_info **infos);
 int redirfs_rem_path(redirfs_filter filter, redirfs_path path);
 int redirfs_get_id_path(redirfs_path path);
 redirfs_path redirfs_get_path_id(int id);
@@ -683,5 +833,10 @@ struct redirfs_data *redirfs_detach_data_root(redirfs_filter filter,
 		redirfs_root root);
 struct redirfs_data *redirfs_get_data_root(redirfs_filter filter,
 		redirfs_root root);
+int redirfs_get_xattr_data(redirfs_filter filter, struct dentry *dentry,
+		void *buf, size_t size);
+int redirfs_set_xattr_data(redirfs_filter filter, struct dentry *dentry,
+		const void *buf, size_t size);
+int redirfs_remove_xattr_data(redirfs_filter filter, struct dentry *dentry);
 #endif
 
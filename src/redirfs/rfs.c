@@ -23,35 +23,113 @@
 
 #include "rfs.h"
 
+#define CREATE_TRACE_POINTS
+#include "rfs_trace.h"
+
 struct rfs_info *rfs_info_none;
 
+int rfs_lazy_attach;
+module_param_named(lazy_attach, rfs_lazy_attach, int, 0444);
+MODULE_PARM_DESC(lazy_attach, "Attach to child dentries on lookup and scan "
+		"the dcache on the first readdir of a directory only, on local "
+		"file systems which create dentries through lookup only");
+
+int rfs_walk_threads = 4;
+module_param_named(walk_threads, rfs_walk_threads, int, 0444);
+MODULE_PARM_DESC(walk_threads, "Maximum number of concurrent works used to "
+		"walk the dcache when a path is added or removed");
+
+int rfs_hash_bits;
+module_param_named(hash_bits, rfs_hash_bits, int, 0444);
+MODULE_PARM_DESC(hash_bits, "Size of the dentry, inode and file hash tables "
+		"in bits, 0 sizes them from the amount of memory");
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32))
+atomic_t rfs_trace_users = ATOMIC_INIT(0);
+
+void rfs_trace_reg(void)
+{
+	atomic_inc(&rfs_trace_users);
+}
+
+void rfs_trace_unreg(void)
+{
+	atomic_dec(&rfs_trace_users);
+}
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29))
+#define rfs_fls(mask) __fls(mask)
+#else
+#define rfs_fls(mask) (fls_long(mask) - 1)
+#endif
+
+enum redirfs_rv rfs_flt_call(struct rfs_flt *rflt,
+		enum redirfs_rv (*rop)(redirfs_context, struct redirfs_args *),
+		struct rfs_context *rcont, struct redirfs_args *rargs)
+{
+	enum redirfs_rv rv;
+	ktime_t start;
+	s64 ns;
+
+	if (likely(!rflt->stats && !rfs_trace_on()))
+		return rop(rcont, rargs);
+
+	start = ktime_get();
+	rv = rop(rcont, rargs);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (rflt->stats)
+		rfs_stats_record(rflt, rargs->type.id, rargs->type.call, ns);
+
+	trace_redirfs_flt_call(rflt, rargs, rv, ns);
+
+	return rv;
+}
+
+/*
+ * Mask of the filters starting at idx. Shifting by BITS_PER_LONG is
+ * undefined, so a start past the last filter gives an empty mask.
+ */
+static inline unsigned long rfs_flts_mask_from(int idx)
+{
+	if (idx >= BITS_PER_LONG)
+		return 0;
+
+	return ~0UL << idx;
+}
+
 int rfs_precall_flts(struct rfs_chain *rchain, struct rfs_context *rcont,
 		struct redirfs_args *rargs)
 {
 	enum redirfs_rv (*rop)(redirfs_context, struct redirfs_args *);
 	enum redirfs_rv rv;
+	struct rfs_flt *rflt;
+	unsigned long mask;
 
 	if (!rchain)
 		return 0;
 
 	rargs->type.call = REDIRFS_PRECALL;
 
-	rcont->idx = rcont->idx_start;
+	mask = rchain->pre_mask[rargs->type.id] &
+		rfs_flts_mask_from(rcont->idx_start);
 
-	for (; rcont->idx < rchain->rflts_nr; rcont->idx++) {
-		if (!atomic_read(&rchain->rflts[rcont->idx]->active))
-			continue;
+	while (mask) {
+		rcont->idx = __ffs(mask);
+		mask &= mask - 1;
 
-		rop = rchain->rflts[rcont->idx]->cbs[rargs->type.id].pre_cb;
+		rflt = rchain->rflts[rcont->idx];
+		rop = rflt->cbs[rargs->type.id].pre_cb;
 		if (!rop)
 			continue;
 
-		rv = rop(rcont, rargs);
+		rv = rfs_flt_call(rflt, rop, rcont, rargs);
 		if (rv == REDIRFS_STOP)
 			return -1;
 	}
 
-	rcont->idx--;
+	rcont->idx = rchain->rflts_nr - 1;
 
 	return 0;
 }
@@ -60,22 +138,39 @@ void rfs_postcall_flts(struct rfs_chain *rchain, struct rfs_context *rcont,
 		struct redirfs_args *rargs)
 {
 	enum redirfs_rv (*rop)(redirfs_context, struct redirfs_args *);
+	struct rfs_flt *rflt;
+	unsigned long mask;
 
 	if (!rchain)
 		return;
 
 	rargs->type.call = REDIRFS_POSTCALL;
 
-	for (; rcont->idx >= rcont->idx_start; rcont->idx--) {
-		if (!atomic_read(&rchain->rflts[rcont->idx]->active))
+	mask = rchain->post_mask[rargs->type.id] &
+		rfs_flts_mask_from(rcont->idx_start);
+	if (rcont->idx < rcont->idx_start)
+		mask = 0;
+	else if (rcont->idx < BITS_PER_LONG - 1)
+		mask &= (2UL << rcont->idx) - 1;
+
+	while (mask) {
+		rcont->idx = rfs_fls(mask);
+		mask &= ~(1UL << rcont->idx);
+
+		rflt = rchain->rflts[rcont->idx];
+		rop = rflt->cbs[rargs->type.id].post_cb;
+		if (!rop)
 			continue;
 
-		rop = rchain->rflts[rcont->idx]->cbs[rargs->type.id].post_cb;
-		if (rop) 
-			rop(rcont, rargs);
+		if (rflt->cbs[rargs->type.id].flags & REDIRFS_OP_DEFER_POST) {
+			if (!rfs_defer_post(rflt, rop, rcont, rargs))
+				continue;
+		}
+
+		rfs_flt_call(rflt, rop, rcont, rargs);
 	}
 
-	rcont->idx++;
+	rcont->idx = rcont->idx_start;
 }
 
 static int __init rfs_init(void)
@@ -86,6 +181,12 @@ static int __init rfs_init(void)
 	if (IS_ERR(rfs_info_none))
 		return PTR_ERR(rfs_info_none);
 
+	rfs_ref_percpu(&rfs_info_none->ref);
+
+	rv = rfs_optbl_cache_create();
+	if (rv)
+		goto err_optbl_cache;
+
 	rv = rfs_dentry_cache_create();
 	if (rv)
 		goto err_dentry_cache;
@@ -98,6 +199,22 @@ static int __init rfs_init(void)
 	if (rv)
 		goto err_file_cache;
 
+	rv = rfs_data_shrinker_create();
+	if (rv)
+		goto err_shrinker;
+
+	rv = rfs_defer_create();
+	if (rv)
+		goto err_defer;
+
+	rv = rfs_dcache_walk_create();
+	if (rv)
+		goto err_walk;
+
+	rv = rfs_async_create();
+	if (rv)
+		goto err_async;
+
 	rv = rfs_sysfs_create();
 	if (rv)
 		goto err_sysfs;
@@ -108,13 +225,26 @@ static int __init rfs_init(void)
 	return 0;
 
 err_sysfs:
+	rfs_async_destroy();
+err_async:
+	rfs_dcache_walk_destroy();
+err_walk:
+	rfs_defer_destroy();
+err_defer:
+	rfs_data_shrinker_destroy();
+err_shrinker:
 	rfs_file_cache_destory();
 err_file_cache:
 	rfs_inode_cache_destroy();
 err_inode_cache:
 	rfs_dentry_cache_destory();
 err_dentry_cache:
+	rfs_optbl_cache_destroy();
+err_optbl_cache:
+	rfs_path_destroy();
+	rfs_ref_atomic(&rfs_info_none->ref);
 	rfs_info_put(rfs_info_none);
+	rcu_barrier();
 	return rv;
 }
 
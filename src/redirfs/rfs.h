@@ -29,6 +29,14 @@
 #include <linux/sched.h>
 #include <linux/quotaops.h>
 #include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/hash.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/xattr.h>
+#include <linux/mm.h>
 #include "redirfs.h"
 
 #define RFS_ADD_OP(ops_new, op) \
@@ -43,31 +51,63 @@
 	 	RFS_REM_OP(ops_new, ops_old, op) \
 	)
 
-#define RFS_SET_FOP(rf, id, op) \
+/*
+ * The operations are built in a local copy (ops_new) which is then replaced
+ * by a shared table, see rfs_optbl.c.
+ */
+#define RFS_SET_FOP(rf, ops_new, id, op) \
 	(rf->rdentry->rinfo->rops ? \
-		RFS_SET_OP(rf->rdentry->rinfo->rops->arr, id, rf->op_new, \
+		RFS_SET_OP(rf->rdentry->rinfo->rops->arr, id, (*ops_new), \
 			rf->op_old, op) : \
-	 	RFS_REM_OP(rf->op_new, rf->op_old, op) \
+	 	RFS_REM_OP((*ops_new), rf->op_old, op) \
 	)
 
-#define RFS_SET_DOP(rd, id, op) \
+/*
+ * Used for the data path operations. The wrapper is installed only if the
+ * original table has the operation, so the VFS keeps its default behaviour
+ * for the missing ones.
+ */
+#define RFS_SET_FOP_OLD(rf, ops_new, id, op) \
+	do { \
+		if (rf->op_old && rf->op_old->op) \
+			RFS_SET_FOP(rf, ops_new, id, op); \
+	} while (0)
+
+#define RFS_SET_DOP(rd, ops_new, id, op) \
 	(rd->rinfo->rops ? \
-		RFS_SET_OP(rd->rinfo->rops->arr, id, rd->op_new,\
+		RFS_SET_OP(rd->rinfo->rops->arr, id, (*ops_new),\
 			rd->op_old, op) : \
-	 	RFS_REM_OP(rd->op_new, rd->op_old, op) \
+	 	RFS_REM_OP((*ops_new), rd->op_old, op) \
 	)
 
-#define RFS_SET_IOP_MGT(ri, op) \
+#define RFS_SET_IOP_MGT(ri, ops_new, op) \
 	(ri->rinfo->rops ? \
-	 	RFS_ADD_OP(ri->op_new, op) : \
-	 	RFS_REM_OP(ri->op_new, ri->op_old, op) \
+	 	RFS_ADD_OP((*ops_new), op) : \
+	 	RFS_REM_OP((*ops_new), ri->op_old, op) \
 	)
 
-#define RFS_SET_IOP(ri, id, op) \
+#define RFS_SET_IOP(ri, ops_new, id, op) \
 	(ri->rinfo->rops ? \
-	 	RFS_SET_OP(ri->rinfo->rops->arr, id, ri->op_new, \
+	 	RFS_SET_OP(ri->rinfo->rops->arr, id, (*ops_new), \
 			ri->op_old, op) : \
-	 	RFS_REM_OP(ri->op_new, ri->op_old, op) \
+	 	RFS_REM_OP((*ops_new), ri->op_old, op) \
+	)
+
+#define RFS_SET_IOP_OLD(ri, ops_new, id, op) \
+	do { \
+		if (ri->op_old && ri->op_old->op) \
+			RFS_SET_IOP(ri, ops_new, id, op); \
+	} while (0)
+
+/*
+ * The address space operations are redirected only if the file system
+ * provides them, otherwise the VFS would not use its generic fallbacks.
+ */
+#define RFS_SET_AOP(ri, ops_new, id, op) \
+	((ri->rinfo->rops && ri->aop_old && ri->aop_old->op) ? \
+	 	RFS_SET_OP(ri->rinfo->rops->arr, id, (*ops_new), \
+			ri->aop_old, op) : \
+	 	RFS_REM_OP((*ops_new), ri->aop_old, op) \
 	)
 
 struct rfs_file;
@@ -110,22 +150,258 @@ inline static void rfs_inode_mutex_unlock(struct inode *inode)
 #define rfs_kmem_cache_t struct kmem_cache
 #endif
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33))
+#ifndef __percpu
+#define __percpu
+#endif
+#define rfs_this_cpu_inc(ptr) ((*per_cpu_ptr(ptr, smp_processor_id()))++)
+#define rfs_this_cpu_dec(ptr) ((*per_cpu_ptr(ptr, smp_processor_id()))--)
+#else
+#define rfs_this_cpu_inc(ptr) this_cpu_inc(*(ptr))
+#define rfs_this_cpu_dec(ptr) this_cpu_dec(*(ptr))
+#endif
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,34))
+#define rfs_rcu_dereference_sched(p) rcu_dereference(p)
+#else
+#define rfs_rcu_dereference_sched(p) rcu_dereference_sched(p)
+#endif
+
+#define RFS_REF_BIAS (1 << 30)
+
+/*
+ * The per-cpu counters are used with preemption disabled and retired with
+ * synchronize_sched, hence the sched flavour of rcu_dereference.
+ */
+struct rfs_ref {
+	long __percpu *pcpu;
+	atomic_t count;
+};
+
+static inline void rfs_ref_init(struct rfs_ref *ref)
+{
+	ref->pcpu = NULL;
+	atomic_set(&ref->count, 1);
+}
+
+static inline int rfs_ref_is_percpu(struct rfs_ref *ref)
+{
+	return ref->pcpu != NULL;
+}
+
+static inline int rfs_ref_read(struct rfs_ref *ref)
+{
+	return atomic_read(&ref->count);
+}
+
+static inline void rfs_ref_get(struct rfs_ref *ref)
+{
+	long __percpu *pcpu;
+
+	preempt_disable();
+	pcpu = rfs_rcu_dereference_sched(ref->pcpu);
+	if (pcpu)
+		rfs_this_cpu_inc(pcpu);
+	else {
+		BUG_ON(!atomic_read(&ref->count));
+		atomic_inc(&ref->count);
+	}
+	preempt_enable();
+}
+
+static inline int rfs_ref_get_not_zero(struct rfs_ref *ref)
+{
+	long __percpu *pcpu;
+	int rv = 1;
+
+	preempt_disable();
+	pcpu = rfs_rcu_dereference_sched(ref->pcpu);
+	if (pcpu)
+		rfs_this_cpu_inc(pcpu);
+	else
+		rv = atomic_inc_not_zero(&ref->count);
+	preempt_enable();
+
+	return rv;
+}
+
+static inline int rfs_ref_put(struct rfs_ref *ref)
+{
+	long __percpu *pcpu;
+	int rv = 0;
+
+	preempt_disable();
+	pcpu = rfs_rcu_dereference_sched(ref->pcpu);
+	if (pcpu)
+		rfs_this_cpu_dec(pcpu);
+	else {
+		BUG_ON(!atomic_read(&ref->count));
+		rv = atomic_dec_and_test(&ref->count);
+	}
+	preempt_enable();
+
+	return rv;
+}
+
+void rfs_ref_percpu(struct rfs_ref *ref);
+void rfs_ref_atomic(struct rfs_ref *ref);
+long __percpu *rfs_ref_atomic_begin(struct rfs_ref *ref);
+void rfs_ref_atomic_end(struct rfs_ref *ref, long __percpu *pcpu);
+
+/*
+ * Maps VFS objects to the rfs objects attached to them. Lookups are lockless,
+ * entries have to be freed after a grace period. Adding and deleting take
+ * the lock of the key's bucket only.
+ */
+struct rfs_hash_bucket {
+	struct hlist_head head;
+	spinlock_t lock;
+};
+
+struct rfs_hash {
+	struct rfs_hash_bucket *buckets;
+	unsigned int bits;
+};
+
+#define rfs_hash_bucket(hash, key) \
+	(&(hash)->buckets[hash_ptr((void *)(key), (hash)->bits)])
+
+#define rfs_hash_for_each_rcu(pos, hash, key) \
+	for (pos = rcu_dereference(rfs_hash_bucket(hash, key)->head.first); \
+			pos; pos = rcu_dereference(pos->next))
+
+static inline void rfs_hash_add(struct rfs_hash *hash, struct hlist_node *node,
+		const void *key)
+{
+	struct rfs_hash_bucket *bucket = rfs_hash_bucket(hash, key);
+
+	spin_lock(&bucket->lock);
+	hlist_add_head_rcu(node, &bucket->head);
+	spin_unlock(&bucket->lock);
+}
+
+static inline void rfs_hash_del(struct rfs_hash *hash, struct hlist_node *node,
+		const void *key)
+{
+	struct rfs_hash_bucket *bucket = rfs_hash_bucket(hash, key);
+
+	spin_lock(&bucket->lock);
+	hlist_del_rcu(node);
+	spin_unlock(&bucket->lock);
+}
+
+/*
+ * Same as rfs_hash_del, but hlist_unhashed tells the object was deleted.
+ */
+static inline void rfs_hash_del_init(struct rfs_hash *hash,
+		struct hlist_node *node, const void *key)
+{
+	struct rfs_hash_bucket *bucket = rfs_hash_bucket(hash, key);
+
+	spin_lock(&bucket->lock);
+	hlist_del_rcu(node);
+	node->pprev = NULL;
+	spin_unlock(&bucket->lock);
+}
+
+int rfs_hash_init(struct rfs_hash *hash, unsigned int scale);
+void rfs_hash_free(struct rfs_hash *hash);
+
+/*
+ * Operation tables shared by all objects with the same original operations
+ * and the same set of redirected operations.
+ */
+struct rfs_optbl_type {
+	const char *name;
+	size_t size;
+	rfs_kmem_cache_t *cache;
+	struct hlist_head *hash;
+	spinlock_t lock;
+	int pinned; /* tables are never freed */
+};
+
+struct rfs_optbl {
+	struct hlist_node list;
+	struct rcu_head rcu;
+	struct rfs_optbl_type *type;
+	const void *op_old;
+	u32 key;
+	atomic_t count;
+	unsigned long ops[0];
+};
+
+#define rfs_optbl_ops(optbl) ((void *)(optbl)->ops)
+#define rfs_optbl_from_ops(op) \
+	((struct rfs_optbl *)((char *)(op) - offsetof(struct rfs_optbl, ops)))
+
+extern struct rfs_optbl_type rfs_optbl_dops;
+extern struct rfs_optbl_type rfs_optbl_iops;
+extern struct rfs_optbl_type rfs_optbl_fops;
+extern struct rfs_optbl_type rfs_optbl_aops;
+extern struct rfs_optbl_type rfs_optbl_vmops;
+
+struct rfs_optbl *rfs_optbl_add(struct rfs_optbl_type *type,
+		const void *op_old, const void *ops);
+struct rfs_optbl *rfs_optbl_get(struct rfs_optbl *optbl);
+void rfs_optbl_put(struct rfs_optbl *optbl);
+int rfs_optbl_cache_create(void);
+void rfs_optbl_cache_destroy(void);
+
 struct rfs_op_info {
 	enum redirfs_rv (*pre_cb)(redirfs_context, struct redirfs_args *);
 	enum redirfs_rv (*post_cb)(redirfs_context, struct redirfs_args *);
+	int flags;
+};
+
+#define RFS_STATS_BUCKETS 32
+
+struct rfs_op_stats {
+	unsigned long calls[2];
+	unsigned long hist[2][RFS_STATS_BUCKETS];
+};
+
+struct rfs_flt_stats {
+	struct rfs_op_stats *ops[REDIRFS_OP_END];
 };
 
+#define RFS_DATA_SLOTS REDIRFS_FILTERS_MAX
+#define RFS_DATA_INLINE 2
+
+/*
+ * Filter's private data indexed by the filter's slot. The first slots are
+ * inline, the rest is allocated on demand.
+ */
+struct rfs_data_slots {
+	struct redirfs_data *inl[RFS_DATA_INLINE];
+	struct redirfs_data **ext;
+	int reclaim;
+};
+
+void rfs_data_slots_init(struct rfs_data_slots *slots, int reclaim);
+void rfs_data_slots_remove(struct rfs_data_slots *slots);
+int rfs_data_slots_reclaim(struct rfs_data_slots *slots,
+		struct redirfs_data **datas);
+void rfs_data_reclaimed(struct redirfs_data **datas, int nr);
+int rfs_data_shrinker_create(void);
+void rfs_data_shrinker_destroy(void);
+
 struct rfs_flt {
 	struct list_head list;
 	struct rfs_op_info cbs[REDIRFS_OP_END];
+	struct rfs_flt_stats *stats;
+	DECLARE_BITMAP(stats_files, REDIRFS_OP_END);
+	int stats_group;
 	struct module *owner;
 	struct kobject kobj;
 	char *name;
 	int priority;
 	int paths_nr;
+	int slot;
 	spinlock_t lock;
 	atomic_t active;
-	atomic_t count;
+	atomic_long_t reclaimed;
+	atomic_long_t data_nr;
+	struct rfs_ref ref;
 	struct redirfs_filter_operations *ops;
 };
 
@@ -133,8 +409,18 @@ void rfs_flt_put(struct rfs_flt *rflt);
 struct rfs_flt *rfs_flt_get(struct rfs_flt *rflt);
 void rfs_flt_release(struct kobject *kobj);
 
+int rfs_stats_enable(struct rfs_flt *rflt);
+void rfs_stats_disable(struct rfs_flt *rflt);
+void rfs_stats_reset(struct rfs_flt *rflt);
+int rfs_stats_update(struct rfs_flt *rflt, struct redirfs_op_info ops[]);
+void rfs_stats_free(struct rfs_flt_stats *stats);
+void rfs_stats_record(struct rfs_flt *rflt, enum redirfs_op_id id,
+		enum redirfs_op_call call, s64 ns);
+int rfs_stats_get_info(struct rfs_flt *rflt, enum redirfs_op_id id,
+		char *buf, int size);
+
 struct rfs_path {
-	struct list_head list;
+	struct hlist_node hash;
 	struct list_head rfst_list;
 	struct list_head rroot_list;
 	struct rfs_root *rroot;
@@ -143,6 +429,7 @@ struct rfs_path {
 	struct vfsmount *mnt;
 	struct dentry *dentry;
 	atomic_t count;
+	int reserved; /* rfs_path_mutex */
 	int id;
 };
 
@@ -153,14 +440,18 @@ void rfs_path_put(struct rfs_path *rpath);
 struct rfs_path *rfs_path_find(struct vfsmount *mnt, struct dentry *dentry);
 struct rfs_path *rfs_path_find_id(int id);
 int rfs_path_get_info(struct rfs_flt *rflt, char *buf, int size);
+struct rfs_path *rfs_path_reserve(struct vfsmount *mnt, struct dentry *dentry);
+void rfs_path_release(struct rfs_path *rpath);
+void rfs_path_destroy(void);
 int rfs_fsrename(struct inode *old_dir, struct dentry *old_dentry,
 		struct inode *new_dir, struct dentry *new_dentry);
 
 struct rfs_root {
 	struct list_head list;
+	struct hlist_node hash;
 	struct list_head walk_list;
 	struct list_head rpaths;
-	struct list_head data;
+	struct rfs_data_slots data;
 	struct rfs_chain *rinch;
 	struct rfs_chain *rexch;
 	struct rfs_info *rinfo;
@@ -194,16 +485,34 @@ struct rfs_ops {
 	int flags;
 };
 
+const char *rfs_op_name(enum redirfs_op_id id);
 struct rfs_ops *rfs_ops_alloc(void);
 struct rfs_ops *rfs_ops_get(struct rfs_ops *rops);
 void rfs_ops_put(struct rfs_ops *rops);
 
+#define RFS_CHAIN_MAX REDIRFS_PATH_FILTERS_MAX
+
 struct rfs_chain {
+	struct list_head list;
+	struct hlist_node hash;
 	struct rfs_flt **rflts;
+	unsigned long pre_mask[REDIRFS_OP_END];
+	unsigned long post_mask[REDIRFS_OP_END];
 	int rflts_nr;
+	u32 key;
 	atomic_t count;
 };
 
+static inline int rfs_chain_idle(struct rfs_chain *rchain,
+		enum redirfs_op_id id)
+{
+	if (!rchain)
+		return 1;
+
+	return !(rchain->pre_mask[id] | rchain->post_mask[id]);
+}
+
+long rfs_chain_count(struct rfs_flt *rflt);
 struct rfs_chain *rfs_chain_get(struct rfs_chain *rchain);
 void rfs_chain_put(struct rfs_chain *rchain);
 int rfs_chain_find(struct rfs_chain *rchain, struct rfs_flt *rflt);
@@ -215,20 +524,85 @@ struct rfs_chain *rfs_chain_join(struct rfs_chain *rch1,
 		struct rfs_chain *rch2);
 struct rfs_chain *rfs_chain_diff(struct rfs_chain *rch1,
 		struct rfs_chain *rch2);
+void rfs_chain_update_flt(struct rfs_flt *rflt);
+
+enum rfs_obj_type {
+	RFS_OBJ_DENTRY,
+	RFS_OBJ_INODE,
+	RFS_OBJ_FILE,
+	RFS_OBJ_INFO,
+	RFS_OBJ_CHAIN,
+	RFS_OBJ_DATA,
+	RFS_OBJ_END
+};
+
+/*
+ * Per-cpu object counters, summed when they are read. Infos use only the
+ * first RFS_OBJ_INFO of them.
+ */
+struct rfs_objs_pcpu {
+	long nr[RFS_OBJ_END];
+};
+
+DECLARE_PER_CPU(struct rfs_objs_pcpu, rfs_objs);
+
+static inline void rfs_obj_add(enum rfs_obj_type type, long nr)
+{
+	get_cpu_var(rfs_objs).nr[type] += nr;
+	put_cpu_var(rfs_objs);
+}
+
+int rfs_objs_get_info(char *buf, int size);
+int rfs_objs_get_roots_info(char *buf, int size);
+int rfs_objs_get_flt_info(struct rfs_flt *rflt, char *buf, int size);
+int rfs_flt_get_objs_info(char *buf, int size);
 
 struct rfs_info {
+	struct list_head list;
 	struct rfs_chain *rchain;
 	struct rfs_ops *rops;
 	struct rfs_root *rroot;
-	atomic_t count;
+	struct hlist_node join;
+	struct rcu_head rcu;
+	struct rfs_ref ref;
+	/* waiting for the switch to atomic mode after replaced in a root */
+	struct list_head retired;
+	long __percpu *retired_pcpu;
+	/* dentries, inodes and files using the info */
+	struct rfs_objs_pcpu *objs;
 };
 
+static inline void rfs_info_obj_add(struct rfs_info *rinfo,
+		enum rfs_obj_type type, long nr)
+{
+	struct rfs_objs_pcpu *objs;
+
+	if (!rinfo || !nr)
+		return;
+
+	objs = per_cpu_ptr(rinfo->objs, get_cpu());
+	objs->nr[type] += nr;
+	put_cpu();
+}
+
+void rfs_info_objs_sum(struct rfs_info *rinfo, long *objs);
+void rfs_info_objs(struct rfs_flt *rflt, long *objs);
+
 extern struct rfs_info *rfs_info_none;
+extern int rfs_lazy_attach;
+int rfs_dentry_lazy(struct super_block *sb);
+extern int rfs_walk_threads;
+extern int rfs_hash_bits;
 
 struct rfs_info *rfs_info_alloc(struct rfs_root *rroot,
 		struct rfs_chain *rchain);
 struct rfs_info *rfs_info_get(struct rfs_info *rinfo);
+struct rfs_info *rfs_info_join(struct rfs_chain *rchain);
+void rfs_info_join_flush(struct rfs_flt *rflt);
+struct rfs_info *rfs_info_get_rcu(struct rfs_info **prinfo);
 void rfs_info_put(struct rfs_info *rinfo);
+void rfs_info_retire(struct rfs_info *rinfo);
+void rfs_info_retire_flush(void);
 struct rfs_info *rfs_info_parent(struct dentry *dentry);
 int rfs_info_add_include(struct rfs_root *rroot, struct rfs_flt *rflt);
 int rfs_info_add_exclude(struct rfs_root *rroot, struct rfs_flt *rflt);
@@ -245,26 +619,28 @@ int rfs_info_reset(struct dentry *dentry, struct rfs_info *rinfo);
 struct rfs_dentry {
 	struct list_head rinode_list;
 	struct list_head rfiles;
-	struct list_head data;
+	struct rfs_data_slots data;
 	struct dentry *dentry;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30))
 	const struct dentry_operations *op_old;
 #else
 	struct dentry_operations *op_old;
 #endif
-	struct dentry_operations op_new;
+	struct rfs_optbl *optbl;
+	struct hlist_node hash;
 	struct rfs_inode *rinode;
 	struct rfs_info *rinfo;
+	struct rcu_head rcu;
 	spinlock_t lock;
 	atomic_t count;
+	unsigned long flags;
 };
 
-#define rfs_dentry_find(dentry) \
-	(dentry && dentry->d_op && dentry->d_op->d_iput == rfs_d_iput ? \
-	 rfs_dentry_get(container_of(dentry->d_op, struct rfs_dentry, op_new)) : \
-	 NULL)
+/* cached children were attached by a readdir in the lazy mode */
+#define RFS_DENTRY_SUBS_WALKED 0
 
 void rfs_d_iput(struct dentry *dentry, struct inode *inode);
+struct rfs_dentry *rfs_dentry_find(const struct dentry *dentry);
 struct rfs_dentry *rfs_dentry_get(struct rfs_dentry *rdentry);
 void rfs_dentry_put(struct rfs_dentry *rdentry);
 struct rfs_dentry *rfs_dentry_add(struct dentry *dentry,
@@ -277,16 +653,23 @@ void rfs_dentry_set_rinfo(struct rfs_dentry *rdentry, struct rfs_info *rinfo);
 void rfs_dentry_add_rfile(struct rfs_dentry *rdentry, struct rfs_file *rfile);
 void rfs_dentry_rem_rfile(struct rfs_file *rfile);
 void rfs_dentry_rem_rfiles(struct rfs_dentry *rdentry);
-void rfs_dentry_set_ops(struct rfs_dentry *dentry);
+int rfs_dentry_set_ops(struct rfs_dentry *dentry);
 int rfs_dentry_cache_create(void);
 void rfs_dentry_cache_destory(void);
+unsigned long rfs_dentry_reclaim(unsigned long nr);
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38))
+#define rfs_dentry_count(dentry) atomic_read(&(dentry)->d_count)
+#else
+#define rfs_dentry_count(dentry) ((dentry)->d_count)
+#endif
 void rfs_dentry_rem_data(struct dentry *dentry, struct rfs_flt *rflt);
 int rfs_dentry_move(struct dentry *dentry, struct rfs_flt *rflt,
 		struct rfs_root *src, struct rfs_root *dst);
 
 struct rfs_inode {
 	struct list_head rdentries; /* mutex */
-	struct list_head data;
+	struct rfs_data_slots data;
 	struct inode *inode;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17))
 	const struct inode_operations *op_old;
@@ -295,9 +678,20 @@ struct rfs_inode {
 	struct inode_operations *op_old;
 	struct file_operations *fop_old;
 #endif
-	struct inode_operations op_new;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18))
+	const struct address_space_operations *aop_old;
+#else
+	struct address_space_operations *aop_old;
+#endif
+	struct rfs_optbl *optbl;
+	struct rfs_optbl *aoptbl; /* NULL while aop_old is used */
+	struct list_head xattrs; /* lock */
+	unsigned long xattrs_gen; /* lock */
+	int xattrs_used; /* lock */
+	struct hlist_node hash;
 	struct rfs_info *rinfo;
 	struct rfs_mutex_t mutex;
+	struct rcu_head rcu;
 	spinlock_t lock;
 	atomic_t count;
 	atomic_t nlink;
@@ -306,6 +700,7 @@ struct rfs_inode {
 
 int rfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 		struct inode *new_dir, struct dentry *new_dentry);
+struct rfs_inode *rfs_inode_find(struct inode *inode);
 struct rfs_inode *rfs_inode_get(struct rfs_inode *rinode);
 void rfs_inode_put(struct rfs_inode *rinode);
 struct rfs_inode *rfs_inode_add(struct inode *inode, struct rfs_info *rinfo);
@@ -317,31 +712,19 @@ void rfs_inode_rem_rdentry(struct rfs_inode *rinode,
 struct rfs_info *rfs_inode_get_rinfo(struct rfs_inode *rinode);
 int rfs_inode_set_rinfo(struct rfs_inode *rinode);
 void rfs_inode_set_ops(struct rfs_inode *rinode);
+void rfs_inode_set_ops_xattrs(struct rfs_inode *rinode);
 int rfs_inode_cache_create(void);
 void rfs_inode_cache_destroy(void);
 
+#define RFS_XATTR_PREFIX XATTR_TRUSTED_PREFIX "redirfs."
+#define RFS_XATTR_PREFIX_LEN (sizeof(RFS_XATTR_PREFIX) - 1)
 
-#define rfs_inode_find_locked(inode) \
-	(inode && inode->i_op && inode->i_op->rename == rfs_rename ? \
-	 rfs_inode_get(container_of(inode->i_op, struct rfs_inode, op_new)) : \
-	 NULL)
-
-static inline struct rfs_inode *rfs_inode_find(struct inode *inode)
-{
-	struct rfs_inode *rinode = NULL;
-	if (inode) {
-		spin_lock(&inode->i_lock);
-		/* Hold i_lock so rinode->count, rinode->nlink and inode->i_op are
-		 * consistent */
-		rinode = rfs_inode_find_locked(inode);
-		spin_unlock(&inode->i_lock);
-	}
-	return rinode;
-}
+void rfs_xattr_invalidate(struct rfs_inode *rinode, const char *name);
+void rfs_xattr_free(struct rfs_inode *rinode);
 
 struct rfs_file {
 	struct list_head rdentry_list;
-	struct list_head data;
+	struct rfs_data_slots data;
 	struct file *file;
 	struct rfs_dentry *rdentry;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17))
@@ -349,25 +732,26 @@ struct rfs_file {
 #else
 	struct file_operations *op_old;
 #endif
-	struct file_operations op_new;
+	struct rfs_optbl *optbl;
+	struct hlist_node hash;
+	struct rcu_head rcu;
 	spinlock_t lock;
 	atomic_t count;
 };
 
-#define rfs_file_find(file) \
-	(file && file->f_op && file->f_op->open == rfs_open ? \
-	 rfs_file_get(container_of(file->f_op, struct rfs_file, op_new)) : \
-	 NULL)
-	 
 extern struct file_operations rfs_file_ops;
 
 int rfs_open(struct inode *inode, struct file *file);
+struct rfs_file *rfs_file_find(struct file *file);
 struct rfs_file *rfs_file_get(struct rfs_file *rfile);
 void rfs_file_put(struct rfs_file *rfile);
-void rfs_file_set_ops(struct rfs_file *rfile);
+int rfs_file_set_ops(struct rfs_file *rfile);
 int rfs_file_cache_create(void);
 void rfs_file_cache_destory(void);
 
+int rfs_vma_redirected(struct rfs_info *rinfo);
+void rfs_vma_set_ops(struct vm_area_struct *vma, struct rfs_info *rinfo);
+
 struct rfs_dcache_data {
 	struct rfs_info *rinfo;
 	struct rfs_flt *rflt;
@@ -383,8 +767,14 @@ struct rfs_dcache_entry {
 	struct dentry *dentry;
 };
 
+struct rfs_dcache_progress {
+	atomic_long_t dentries;
+};
+
 int rfs_dcache_walk(struct dentry *root, int (*cb)(struct dentry *, void *),
 		void *data);
+int rfs_dcache_walk_create(void);
+void rfs_dcache_walk_destroy(void);
 int rfs_dcache_add_dir(struct dentry *dentry, void *data);
 int rfs_dcache_add(struct dentry *dentry, void *data);
 int rfs_dcache_rem(struct dentry *dentry, void *data);
@@ -403,6 +793,28 @@ struct rfs_context {
 
 void rfs_context_init(struct rfs_context *rcont, int start);
 void rfs_context_deinit(struct rfs_context *rcont);
+void rfs_context_move_data(struct rfs_context *dst, struct rfs_context *src,
+		struct rfs_flt *rflt);
+
+enum redirfs_rv rfs_flt_call(struct rfs_flt *rflt,
+		enum redirfs_rv (*rop)(redirfs_context, struct redirfs_args *),
+		struct rfs_context *rcont, struct redirfs_args *rargs);
+
+int rfs_defer_create(void);
+void rfs_defer_destroy(void);
+void rfs_defer_flush(void);
+int rfs_defer_supported(enum redirfs_op_id id);
+int rfs_defer_post(struct rfs_flt *rflt,
+		enum redirfs_rv (*rop)(redirfs_context, struct redirfs_args *),
+		struct rfs_context *rcont, struct redirfs_args *rargs);
+
+int rfs_async_create(void);
+void rfs_async_destroy(void);
+void rfs_async_flush(struct rfs_flt *rflt);
+int rfs_async_add_path(struct rfs_flt *rflt, struct redirfs_path_info *info);
+int rfs_async_get_info(struct rfs_flt *rflt, char *buf, int size);
+int rfs_async_cancel(struct rfs_flt *rflt, int id);
+struct rfs_dcache_progress *rfs_async_progress(void);
 
 int rfs_precall_flts(struct rfs_chain *rchain, struct rfs_context *rcont,
 		struct redirfs_args *rargs);
@@ -412,11 +824,14 @@ void rfs_postcall_flts(struct rfs_chain *rchain, struct rfs_context *rcont,
 #define rfs_kobj_to_rflt(__kobj) container_of(__kobj, struct rfs_flt, kobj)
 int rfs_flt_sysfs_init(struct rfs_flt *rflt);
 void rfs_flt_sysfs_exit(struct rfs_flt *rflt);
+void rfs_flt_sysfs_stats_update(struct rfs_flt *rflt);
+void rfs_flt_sysfs_stats_exit(struct rfs_flt *rflt);
 void rfs_kobject_init(struct kobject *kobj);
 
 int rfs_sysfs_create(void);
 
 void rfs_data_remove(struct list_head *head);
+void rfs_data_free_flush(void);
 
 
 
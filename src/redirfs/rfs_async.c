@@ -0,0 +1,334 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rfs.h"
+
+enum rfs_async_state {
+	RFS_ASYNC_QUEUED,
+	RFS_ASYNC_RUNNING,
+	RFS_ASYNC_DONE,
+	RFS_ASYNC_FAILED,
+	RFS_ASYNC_CANCELLED
+};
+
+static const char *rfs_async_states[] = {
+	"queued",
+	"running",
+	"done",
+	"failed",
+	"cancelled"
+};
+
+struct rfs_async {
+	struct list_head list;
+	struct work_struct work;
+	struct rfs_flt *rflt;
+	struct rfs_path *rpath;
+	struct task_struct *task;
+	struct rfs_dcache_progress progress;
+	enum rfs_async_state state;
+	int flags;
+	int id;
+	int rv;
+};
+
+static LIST_HEAD(rfs_async_list);
+static DEFINE_SPINLOCK(rfs_async_lock);
+static struct workqueue_struct *rfs_async_wq;
+
+/*
+ * Jobs run one at a time on a single threaded workqueue. The dcache walk
+ * started by the job's thread reports its progress to the job.
+ */
+static struct rfs_async *rfs_async_running;
+
+struct rfs_dcache_progress *rfs_async_progress(void)
+{
+	struct rfs_dcache_progress *progress = NULL;
+
+	spin_lock(&rfs_async_lock);
+	if (rfs_async_running && rfs_async_running->task == current)
+		progress = &rfs_async_running->progress;
+	spin_unlock(&rfs_async_lock);
+
+	return progress;
+}
+
+static void rfs_async_set_state(struct rfs_async *rasync,
+		enum rfs_async_state state, struct task_struct *task)
+{
+	spin_lock(&rfs_async_lock);
+	rasync->state = state;
+	rasync->task = task;
+	rfs_async_running = task ? rasync : NULL;
+	spin_unlock(&rfs_async_lock);
+}
+
+/*
+ * A cancelled job is skipped. Once the job is running it is not
+ * interrupted, a dcache walk stopped in the middle would leave only a part
+ * of the subtree redirected.
+ */
+static int rfs_async_start(struct rfs_async *rasync)
+{
+	int rv = 0;
+
+	spin_lock(&rfs_async_lock);
+	if (rasync->state == RFS_ASYNC_CANCELLED)
+		rv = -ECANCELED;
+	else {
+		rasync->state = RFS_ASYNC_RUNNING;
+		rasync->task = current;
+		rfs_async_running = rasync;
+	}
+	spin_unlock(&rfs_async_lock);
+
+	return rv;
+}
+
+static void rfs_async_run(struct rfs_async *rasync)
+{
+	struct redirfs_path_info info;
+	struct rfs_flt *rflt = rasync->rflt;
+	struct rfs_path *rpath;
+	int rv;
+
+	if (rfs_async_start(rasync))
+		goto exit;
+
+	info.mnt = rasync->rpath->mnt;
+	info.dentry = rasync->rpath->dentry;
+	info.flags = rasync->flags;
+
+	if (!rflt->ops || !rflt->ops->add_path) {
+		rpath = redirfs_add_path(rflt, &info);
+		rv = IS_ERR(rpath) ? PTR_ERR(rpath) : 0;
+		rfs_path_put(rpath);
+
+	} else
+		rv = rflt->ops->add_path(&info);
+
+	rasync->rv = rv;
+	rfs_async_set_state(rasync, rv ? RFS_ASYNC_FAILED : RFS_ASYNC_DONE,
+			NULL);
+exit:
+	/*
+	 * The filter pointer is kept only to match the job in
+	 * rfs_async_get_info, rfs_async_flush forgets the job before the
+	 * filter goes away.
+	 */
+	rfs_path_release(rasync->rpath);
+	rasync->rpath = NULL;
+	rfs_flt_put(rflt);
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+
+static void rfs_async_work(void *data)
+{
+	rfs_async_run(data);
+}
+
+#define rfs_async_init_work(rasync) \
+	INIT_WORK(&(rasync)->work, rfs_async_work, rasync)
+
+#else
+
+static void rfs_async_work(struct work_struct *work)
+{
+	rfs_async_run(container_of(work, struct rfs_async, work));
+}
+
+#define rfs_async_init_work(rasync) \
+	INIT_WORK(&(rasync)->work, rfs_async_work)
+
+#endif
+
+/*
+ * Reserve the path, so its id is known right away, and queue the
+ * registration.
+ */
+int rfs_async_add_path(struct rfs_flt *rflt, struct redirfs_path_info *info)
+{
+	struct rfs_async *rasync;
+	struct rfs_async *tmp;
+	struct rfs_path *rpath;
+
+	if (!info->mnt || !info->dentry || !info->flags)
+		return -EINVAL;
+
+	rasync = kzalloc(sizeof(struct rfs_async), GFP_KERNEL);
+	if (!rasync)
+		return -ENOMEM;
+
+	rpath = rfs_path_reserve(info->mnt, info->dentry);
+	if (IS_ERR(rpath)) {
+		kfree(rasync);
+		return PTR_ERR(rpath);
+	}
+
+	INIT_LIST_HEAD(&rasync->list);
+	rasync->rpath = rpath;
+	rasync->rflt = rfs_flt_get(rflt);
+	rasync->flags = info->flags;
+	rasync->id = rpath->id;
+	rasync->state = RFS_ASYNC_QUEUED;
+	atomic_long_set(&rasync->progress.dentries, 0);
+
+	spin_lock(&rfs_async_lock);
+	list_for_each_entry(tmp, &rfs_async_list, list) {
+		if (tmp->rflt != rflt || tmp->id != rasync->id)
+			continue;
+
+		if (tmp->state < RFS_ASYNC_DONE)
+			continue;
+
+		list_del(&tmp->list);
+		kfree(tmp);
+		break;
+	}
+	list_add_tail(&rasync->list, &rfs_async_list);
+	spin_unlock(&rfs_async_lock);
+
+	rfs_async_init_work(rasync);
+	queue_work(rfs_async_wq, &rasync->work);
+
+	return 0;
+}
+
+/*
+ * Finished jobs are reported once and forgotten, so the list holds only the
+ * queued and running jobs and the ones not read yet.
+ */
+int rfs_async_get_info(struct rfs_flt *rflt, char *buf, int size)
+{
+	struct rfs_async *rasync;
+	struct rfs_async *tmp;
+	int len = 0;
+	int rv;
+
+	spin_lock(&rfs_async_lock);
+
+	list_for_each_entry_safe(rasync, tmp, &rfs_async_list, list) {
+		if (rasync->rflt != rflt)
+			continue;
+
+		rv = snprintf(buf + len, size - len, "%d:%s:%ld:%d",
+				rasync->id, rfs_async_states[rasync->state],
+				atomic_long_read(&rasync->progress.dentries),
+				rasync->rv) + 1;
+
+		if (len + rv >= size) {
+			len = size;
+			break;
+		}
+
+		len += rv;
+
+		if (rasync->state < RFS_ASYNC_DONE)
+			continue;
+
+		list_del(&rasync->list);
+		kfree(rasync);
+	}
+
+	spin_unlock(&rfs_async_lock);
+
+	return len;
+}
+
+/*
+ * Cancel a queued registration, see rfs_async_start.
+ */
+int rfs_async_cancel(struct rfs_flt *rflt, int id)
+{
+	struct rfs_async *rasync;
+	int rv = -ENOENT;
+
+	spin_lock(&rfs_async_lock);
+
+	list_for_each_entry(rasync, &rfs_async_list, list) {
+		if (rasync->rflt != rflt || rasync->id != id)
+			continue;
+
+		if (rasync->state != RFS_ASYNC_QUEUED) {
+			rv = -EBUSY;
+			continue;
+		}
+
+		rasync->state = RFS_ASYNC_CANCELLED;
+		rv = 0;
+		break;
+	}
+
+	spin_unlock(&rfs_async_lock);
+
+	return rv;
+}
+
+/*
+ * Cancel the queued registrations, wait for the running one and forget the
+ * filter's jobs. All jobs are forgotten if rflt is NULL.
+ */
+void rfs_async_flush(struct rfs_flt *rflt)
+{
+	struct rfs_async *rasync;
+	struct rfs_async *tmp;
+
+	spin_lock(&rfs_async_lock);
+	list_for_each_entry(rasync, &rfs_async_list, list) {
+		if (rflt && rasync->rflt != rflt)
+			continue;
+
+		if (rasync->state == RFS_ASYNC_QUEUED)
+			rasync->state = RFS_ASYNC_CANCELLED;
+	}
+	spin_unlock(&rfs_async_lock);
+
+	flush_workqueue(rfs_async_wq);
+
+	spin_lock(&rfs_async_lock);
+	list_for_each_entry_safe(rasync, tmp, &rfs_async_list, list) {
+		if (rflt && rasync->rflt != rflt)
+			continue;
+
+		list_del(&rasync->list);
+		kfree(rasync);
+	}
+	spin_unlock(&rfs_async_lock);
+}
+
+int rfs_async_create(void)
+{
+	rfs_async_wq = create_singlethread_workqueue("redirfs_async");
+	if (!rfs_async_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void rfs_async_destroy(void)
+{
+	rfs_async_flush(NULL);
+	destroy_workqueue(rfs_async_wq);
+}
@@ -21,13 +21,47 @@
  * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <linux/jhash.h>
 #include "rfs.h"
 
+#define RFS_CHAIN_HASH_BITS 8
+#define RFS_CHAIN_MEMO_BITS 6
+
+/*
+ * Chains are interned, there is at most one chain for each ordered list of
+ * filters. All lists are protected by rfs_chain_list_lock.
+ */
+static LIST_HEAD(rfs_chain_list);
+static struct hlist_head rfs_chain_hash[1 << RFS_CHAIN_HASH_BITS];
+static DEFINE_SPINLOCK(rfs_chain_list_lock);
+
+enum rfs_chain_memo_op {
+	RFS_CHAIN_MEMO_NONE,
+	RFS_CHAIN_MEMO_JOIN,
+	RFS_CHAIN_MEMO_DIFF
+};
+
+/*
+ * Direct mapped cache of join and diff results. Entries do not hold chain
+ * references, they are dropped when any of their chains is freed.
+ */
+struct rfs_chain_memo {
+	struct rfs_chain *rch1;
+	struct rfs_chain *rch2;
+	struct rfs_chain *rch;
+	enum rfs_chain_memo_op op;
+};
+
+static struct rfs_chain_memo rfs_chain_memo[1 << RFS_CHAIN_MEMO_BITS];
+
 static struct rfs_chain *rfs_chain_alloc(int size, int type)
 {
 	struct rfs_chain *rchain;
 	struct rfs_flt **rflts;
 
+	if (size > RFS_CHAIN_MAX)
+		return ERR_PTR(-ENOSPC);
+
 	rchain = kzalloc(sizeof(struct rfs_chain), type);
 	rflts = kzalloc(sizeof(struct rfs_flt*) * size, type);
 	if (!rchain || !rflts) {
@@ -36,13 +70,204 @@ static struct rfs_chain *rfs_chain_alloc(int size, int type)
 		return ERR_PTR(-ENOMEM);
 	}
 
+	INIT_LIST_HEAD(&rchain->list);
+	INIT_HLIST_NODE(&rchain->hash);
 	rchain->rflts = rflts;
 	rchain->rflts_nr = size;
 	atomic_set(&rchain->count, 1);
+	rfs_obj_add(RFS_OBJ_CHAIN, 1);
 
 	return rchain;
 }
 
+static void rfs_chain_free(struct rfs_chain *rchain)
+{
+	int i;
+
+	for (i = 0; i < rchain->rflts_nr; i++)
+		rfs_flt_put(rchain->rflts[i]);
+
+	kfree(rchain->rflts);
+	kfree(rchain);
+	rfs_obj_add(RFS_OBJ_CHAIN, -1);
+}
+
+static void rfs_chain_build(struct rfs_chain *rchain)
+{
+	struct rfs_flt *rflt;
+	unsigned long pre;
+	unsigned long post;
+	int i, j;
+
+	for (j = 0; j < REDIRFS_OP_END; j++) {
+		pre = post = 0;
+
+		for (i = 0; i < rchain->rflts_nr; i++) {
+			rflt = rchain->rflts[i];
+			if (!atomic_read(&rflt->active))
+				continue;
+
+			if (rflt->cbs[j].pre_cb)
+				pre |= 1UL << i;
+
+			if (rflt->cbs[j].post_cb)
+				post |= 1UL << i;
+		}
+
+		rchain->pre_mask[j] = pre;
+		rchain->post_mask[j] = post;
+	}
+}
+
+static u32 rfs_chain_key(struct rfs_flt **rflts, int nr)
+{
+	return jhash(rflts, sizeof(struct rfs_flt *) * nr, nr);
+}
+
+static struct hlist_head *rfs_chain_head(u32 key)
+{
+	return &rfs_chain_hash[hash_long(key, RFS_CHAIN_HASH_BITS)];
+}
+
+static struct rfs_chain *rfs_chain_lookup(struct rfs_flt **rflts, int nr,
+		u32 key)
+{
+	struct rfs_chain *rchain;
+	struct hlist_node *pos;
+
+	for (pos = rfs_chain_head(key)->first; pos; pos = pos->next) {
+		rchain = hlist_entry(pos, struct rfs_chain, hash);
+		if (rchain->key != key || rchain->rflts_nr != nr)
+			continue;
+
+		if (!memcmp(rchain->rflts, rflts, sizeof(struct rfs_flt *) * nr))
+			return rfs_chain_get(rchain);
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the shared chain for the ordered list of filters. A new chain is
+ * allocated only if there is none yet.
+ */
+static struct rfs_chain *rfs_chain_intern(struct rfs_flt **rflts, int nr)
+{
+	struct rfs_chain *rchain;
+	struct rfs_chain *found;
+	u32 key;
+	int i;
+
+	if (!nr)
+		return NULL;
+
+	key = rfs_chain_key(rflts, nr);
+
+	spin_lock(&rfs_chain_list_lock);
+	found = rfs_chain_lookup(rflts, nr, key);
+	spin_unlock(&rfs_chain_list_lock);
+	if (found)
+		return found;
+
+	rchain = rfs_chain_alloc(nr, GFP_KERNEL);
+	if (IS_ERR(rchain))
+		return rchain;
+
+	for (i = 0; i < nr; i++)
+		rchain->rflts[i] = rfs_flt_get(rflts[i]);
+
+	rchain->key = key;
+
+	spin_lock(&rfs_chain_list_lock);
+	found = rfs_chain_lookup(rflts, nr, key);
+	if (!found) {
+		rfs_chain_build(rchain);
+		list_add_tail(&rchain->list, &rfs_chain_list);
+		hlist_add_head(&rchain->hash, rfs_chain_head(key));
+	}
+	spin_unlock(&rfs_chain_list_lock);
+
+	if (!found)
+		return rchain;
+
+	rfs_chain_free(rchain);
+	return found;
+}
+
+static struct rfs_chain_memo *rfs_chain_memo_entry(struct rfs_chain *rch1,
+		struct rfs_chain *rch2, enum rfs_chain_memo_op op)
+{
+	unsigned long val;
+
+	val = (unsigned long)rch1 ^ ((unsigned long)rch2 >> 4) ^ op;
+
+	return &rfs_chain_memo[hash_long(val, RFS_CHAIN_MEMO_BITS)];
+}
+
+static int rfs_chain_memo_find(struct rfs_chain *rch1, struct rfs_chain *rch2,
+		enum rfs_chain_memo_op op, struct rfs_chain **rch)
+{
+	struct rfs_chain_memo *memo;
+	int found = 0;
+
+	spin_lock(&rfs_chain_list_lock);
+	memo = rfs_chain_memo_entry(rch1, rch2, op);
+	if (memo->op == op && memo->rch1 == rch1 && memo->rch2 == rch2) {
+		*rch = rfs_chain_get(memo->rch);
+		found = 1;
+	}
+	spin_unlock(&rfs_chain_list_lock);
+
+	return found;
+}
+
+static void rfs_chain_memo_add(struct rfs_chain *rch1, struct rfs_chain *rch2,
+		enum rfs_chain_memo_op op, struct rfs_chain *rch)
+{
+	struct rfs_chain_memo *memo;
+
+	if (IS_ERR(rch))
+		return;
+
+	spin_lock(&rfs_chain_list_lock);
+	memo = rfs_chain_memo_entry(rch1, rch2, op);
+	memo->rch1 = rch1;
+	memo->rch2 = rch2;
+	memo->rch = rch;
+	memo->op = op;
+	spin_unlock(&rfs_chain_list_lock);
+}
+
+/* Called with rfs_chain_list_lock held. */
+static void rfs_chain_memo_forget(struct rfs_chain *rchain)
+{
+	struct rfs_chain_memo *memo;
+	int i;
+
+	for (i = 0; i < (1 << RFS_CHAIN_MEMO_BITS); i++) {
+		memo = &rfs_chain_memo[i];
+		if (memo->rch1 != rchain && memo->rch2 != rchain &&
+		    memo->rch != rchain)
+			continue;
+
+		memset(memo, 0, sizeof(struct rfs_chain_memo));
+	}
+}
+
+void rfs_chain_update_flt(struct rfs_flt *rflt)
+{
+	struct rfs_chain *rchain;
+
+	spin_lock(&rfs_chain_list_lock);
+
+	list_for_each_entry(rchain, &rfs_chain_list, list) {
+		if (rfs_chain_find(rchain, rflt) != -1)
+			rfs_chain_build(rchain);
+	}
+
+	spin_unlock(&rfs_chain_list_lock);
+}
+
 struct rfs_chain *rfs_chain_get(struct rfs_chain *rchain)
 {
 	if (!rchain || IS_ERR(rchain))
@@ -56,20 +281,19 @@ struct rfs_chain *rfs_chain_get(struct rfs_chain *rchain)
 
 void rfs_chain_put(struct rfs_chain *rchain)
 {
-	int i;
-
 	if (!rchain || IS_ERR(rchain))
 		return;
 
 	BUG_ON(!atomic_read(&rchain->count));
-	if (!atomic_dec_and_test(&rchain->count))
+	if (!atomic_dec_and_lock(&rchain->count, &rfs_chain_list_lock))
 		return;
 
-	for (i = 0; i < rchain->rflts_nr; i++)
-		rfs_flt_put(rchain->rflts[i]);
+	list_del(&rchain->list);
+	hlist_del(&rchain->hash);
+	rfs_chain_memo_forget(rchain);
+	spin_unlock(&rfs_chain_list_lock);
 
-	kfree(rchain->rflts);
-	kfree(rchain);
+	rfs_chain_free(rchain);
 }
 
 int rfs_chain_find(struct rfs_chain *rchain, struct rfs_flt *rflt)
@@ -87,66 +311,67 @@ int rfs_chain_find(struct rfs_chain *rchain, struct rfs_flt *rflt)
 	return -1;
 }
 
+/*
+ * Number of chains with the filter.
+ */
+long rfs_chain_count(struct rfs_flt *rflt)
+{
+	struct rfs_chain *rchain;
+	long nr = 0;
+
+	spin_lock(&rfs_chain_list_lock);
+	list_for_each_entry(rchain, &rfs_chain_list, list) {
+		if (rfs_chain_find(rchain, rflt) != -1)
+			nr++;
+	}
+	spin_unlock(&rfs_chain_list_lock);
+
+	return nr;
+}
+
 struct rfs_chain *rfs_chain_add(struct rfs_chain *rchain, struct rfs_flt *rflt)
 {
-	struct rfs_chain *rchain_new;
-	int size;
+	struct rfs_flt *rflts[RFS_CHAIN_MAX];
 	int i = 0;
 	int j = 0;
 
 	if (rfs_chain_find(rchain, rflt) != -1)
 		return rfs_chain_get(rchain);
 
-	if (!rchain) 
-		size = 1;
-	else
-		size = rchain->rflts_nr + 1;
-
-	rchain_new = rfs_chain_alloc(size, GFP_KERNEL);
-	if (IS_ERR(rchain_new))
-		return rchain_new;
-
 	if (!rchain) {
-		rchain_new->rflts[0] = rfs_flt_get(rflt);
-		return rchain_new;
+		rflts[0] = rflt;
+		return rfs_chain_intern(rflts, 1);
 	}
 
-	while (rchain->rflts[i]->priority < rflt->priority) {
-		rchain_new->rflts[j++] = rfs_flt_get(rchain->rflts[i++]);
-		if (i == rchain->rflts_nr)
-			break;
-	}
+	if (rchain->rflts_nr == RFS_CHAIN_MAX)
+		return ERR_PTR(-ENOSPC);
 
-	rchain_new->rflts[j++] = rfs_flt_get(rflt);
+	while (i < rchain->rflts_nr &&
+	       rchain->rflts[i]->priority < rflt->priority)
+		rflts[j++] = rchain->rflts[i++];
 
-	while (j < rchain_new->rflts_nr) {
-		rchain_new->rflts[j++] = rfs_flt_get(rchain->rflts[i++]);
-	}
+	rflts[j++] = rflt;
 
-	return rchain_new;
+	while (i < rchain->rflts_nr)
+		rflts[j++] = rchain->rflts[i++];
+
+	return rfs_chain_intern(rflts, j);
 }
 
 struct rfs_chain *rfs_chain_rem(struct rfs_chain *rchain, struct rfs_flt *rflt)
 {
-	struct rfs_chain *rchain_new;
+	struct rfs_flt *rflts[RFS_CHAIN_MAX];
 	int i, j;
 
 	if (rfs_chain_find(rchain, rflt) == -1)
 		return rfs_chain_get(rchain);
 
-	if (rchain->rflts_nr == 1)
-		return NULL;
-
-	rchain_new = rfs_chain_alloc(rchain->rflts_nr - 1, GFP_KERNEL);
-	if (IS_ERR(rchain_new))
-		return rchain_new;
-
 	for (i = 0, j = 0; i < rchain->rflts_nr; i++) {
 		if (rchain->rflts[i] != rflt)
-			rchain_new->rflts[j++] = rfs_flt_get(rchain->rflts[i]);
+			rflts[j++] = rchain->rflts[i];
 	}
 
-	return rchain_new;
+	return rfs_chain_intern(rflts, j);
 }
 
 void rfs_chain_ops(struct rfs_chain *rchain, struct rfs_ops *rops)
@@ -166,29 +391,17 @@ void rfs_chain_ops(struct rfs_chain *rchain, struct rfs_ops *rops)
 	}
 }
 
+/*
+ * Chains are interned, equal chains are the same object.
+ */
 int rfs_chain_cmp(struct rfs_chain *rch1, struct rfs_chain *rch2)
 {
-	int i;
-
-	if (!rch1 && !rch2)
-		return 0;
-
-	if (!rch1 || !rch2)
-		return -1;
-
-	if (rch1->rflts_nr != rch2->rflts_nr)
-		return -1;
-
-	for (i = 0; i < rch1->rflts_nr; i++) {
-		if (rch1->rflts[i] != rch2->rflts[i])
-			return -1;
-	}
-
-	return 0;
+	return rch1 == rch2 ? 0 : -1;
 }
 
 struct rfs_chain *rfs_chain_join(struct rfs_chain *rch1, struct rfs_chain *rch2)
 {
+	struct rfs_flt *rflts[RFS_CHAIN_MAX];
 	struct rfs_chain *rch;
 	int size;
 	int i,k,l;
@@ -205,6 +418,9 @@ struct rfs_chain *rfs_chain_join(struct rfs_chain *rch1, struct rfs_chain *rch2)
 	if (!rfs_chain_cmp(rch1, rch2))
 		return rfs_chain_get(rch1);
 
+	if (rfs_chain_memo_find(rch1, rch2, RFS_CHAIN_MEMO_JOIN, &rch))
+		return rch;
+
 	size = rch1->rflts_nr;
 
 	for (i = 0; i < rch2->rflts_nr; i++) {
@@ -212,34 +428,36 @@ struct rfs_chain *rfs_chain_join(struct rfs_chain *rch1, struct rfs_chain *rch2)
 			size++;
 	}
 
-	rch = rfs_chain_alloc(size, GFP_KERNEL);
-	if (IS_ERR(rch))
-		return rch;
+	if (size > RFS_CHAIN_MAX)
+		return ERR_PTR(-ENOSPC);
 
 	i = k = l = 0;
 	while (k != rch1->rflts_nr && l != rch2->rflts_nr) {
 		if (rch1->rflts[k]->priority == rch2->rflts[l]->priority) {
-			rch->rflts[i++] = rfs_flt_get(rch1->rflts[k++]);
+			rflts[i++] = rch1->rflts[k++];
 			l++;
 		} else if (rch1->rflts[k]->priority < rch2->rflts[l]->priority) {
-			rch->rflts[i++] = rfs_flt_get(rch1->rflts[k++]);
+			rflts[i++] = rch1->rflts[k++];
 		} else
-			rch->rflts[i++] = rfs_flt_get(rch2->rflts[l++]);
+			rflts[i++] = rch2->rflts[l++];
 	}
 
 	while (k != rch1->rflts_nr)
-		rch->rflts[i++] = rfs_flt_get(rch1->rflts[k++]);
+		rflts[i++] = rch1->rflts[k++];
 
 	while (l != rch2->rflts_nr)
-		rch->rflts[i++] = rfs_flt_get(rch2->rflts[l++]);
+		rflts[i++] = rch2->rflts[l++];
+
+	rch = rfs_chain_intern(rflts, i);
+	rfs_chain_memo_add(rch1, rch2, RFS_CHAIN_MEMO_JOIN, rch);
 
 	return rch;
 }
 
 struct rfs_chain *rfs_chain_diff(struct rfs_chain *rch1, struct rfs_chain *rch2)
 {
+	struct rfs_flt *rflts[RFS_CHAIN_MAX];
 	struct rfs_chain *rch;
-	int size;
 	int i,j;
 
 	if (!rch1)
@@ -248,30 +466,20 @@ struct rfs_chain *rfs_chain_diff(struct rfs_chain *rch1, struct rfs_chain *rch2)
 	if (!rch2)
 		return rfs_chain_get(rch1);
 
-	size = rch1->rflts_nr;
-
-	for (i = 0; i < rch1->rflts_nr; i++) {
-		if (rfs_chain_find(rch2, rch1->rflts[i]) != -1)
-			size--;
-	}
-
-	if (!size)
-		return NULL;
-
-	if (size == rch1->rflts_nr)
-		return rfs_chain_get(rch1);
-
-	rch = rfs_chain_alloc(size, GFP_KERNEL);
-	if (IS_ERR(rch))
+	if (rfs_chain_memo_find(rch1, rch2, RFS_CHAIN_MEMO_DIFF, &rch))
 		return rch;
 
 	for (i = 0, j = 0; i < rch1->rflts_nr; i++) {
 		if (rfs_chain_find(rch2, rch1->rflts[i]) == -1)
-			rch->rflts[j++] = rfs_flt_get(rch1->rflts[i]);
+			rflts[j++] = rch1->rflts[i];
 	}
 
-	BUG_ON(j != size);
+	if (j == rch1->rflts_nr)
+		rch = rfs_chain_get(rch1);
+	else
+		rch = rfs_chain_intern(rflts, j);
+
+	rfs_chain_memo_add(rch1, rch2, RFS_CHAIN_MEMO_DIFF, rch);
 
 	return rch;
 }
-
@@ -21,8 +21,29 @@
  * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <linux/mm.h>
 #include "rfs.h"
 
+/* Reclaimable data attached to dentries and inodes. */
+static atomic_long_t rfs_data_reclaim_nr = ATOMIC_LONG_INIT(0);
+
+/* Data past their grace period, freed from a work. */
+static LIST_HEAD(rfs_data_free_list);
+static DEFINE_SPINLOCK(rfs_data_free_lock);
+static RFS_DEFINE_MUTEX(rfs_data_free_mutex);
+
+static void rfs_data_account(struct rfs_data_slots *slots,
+		struct redirfs_data *data, long nr)
+{
+	struct rfs_flt *rflt = data->filter;
+
+	rfs_obj_add(RFS_OBJ_DATA, nr);
+	atomic_long_add(nr, &rflt->data_nr);
+
+	if (slots->reclaim && data->flags & REDIRFS_DATA_RECLAIM)
+		atomic_long_add(nr, &rfs_data_reclaim_nr);
+}
+
 void rfs_data_remove(struct list_head *head)
 {
 	struct redirfs_data *data;
@@ -36,6 +57,189 @@ void rfs_data_remove(struct list_head *head)
 	}
 }
 
+void rfs_data_slots_init(struct rfs_data_slots *slots, int reclaim)
+{
+	memset(slots, 0, sizeof(struct rfs_data_slots));
+	slots->reclaim = reclaim;
+}
+
+/*
+ * Returns the slot of the filter or NULL if the overflow array was not
+ * allocated yet. Called with the lock protecting the slots held.
+ */
+static struct redirfs_data **rfs_data_slot(struct rfs_data_slots *slots,
+		int slot)
+{
+	if (slot < RFS_DATA_INLINE)
+		return &slots->inl[slot];
+
+	if (!slots->ext)
+		return NULL;
+
+	return &slots->ext[slot - RFS_DATA_INLINE];
+}
+
+static struct redirfs_data **rfs_data_slot_alloc(struct rfs_data_slots *slots,
+		int slot)
+{
+	struct redirfs_data **ext;
+
+	if (slot < RFS_DATA_INLINE || slots->ext)
+		return rfs_data_slot(slots, slot);
+
+	ext = kzalloc(sizeof(struct redirfs_data *) *
+			(RFS_DATA_SLOTS - RFS_DATA_INLINE), GFP_ATOMIC);
+	if (!ext)
+		return NULL;
+
+	rcu_assign_pointer(slots->ext, ext);
+
+	return rfs_data_slot(slots, slot);
+}
+
+void rfs_data_slots_remove(struct rfs_data_slots *slots)
+{
+	struct redirfs_data **slot;
+	struct redirfs_data *data;
+	int i;
+
+	for (i = 0; i < RFS_DATA_SLOTS; i++) {
+		slot = rfs_data_slot(slots, i);
+		if (!slot || !*slot)
+			continue;
+
+		data = *slot;
+		*slot = NULL;
+		rfs_data_account(slots, data, -1);
+		if (data->detach)
+			data->detach(data);
+		redirfs_put_data(data);
+	}
+
+	kfree(slots->ext);
+	slots->ext = NULL;
+}
+
+/*
+ * Take the reclaimable data out of the slots. Called with the lock
+ * protecting the slots held, the data are released by rfs_data_reclaimed
+ * after the lock is dropped.
+ */
+int rfs_data_slots_reclaim(struct rfs_data_slots *slots,
+		struct redirfs_data **datas)
+{
+	struct redirfs_data **slot;
+	int nr = 0;
+	int i;
+
+	if (!slots->reclaim)
+		return 0;
+
+	for (i = 0; i < RFS_DATA_SLOTS; i++) {
+		slot = rfs_data_slot(slots, i);
+		if (!slot)
+			break;
+
+		if (!*slot || !((*slot)->flags & REDIRFS_DATA_RECLAIM))
+			continue;
+
+		datas[nr++] = *slot;
+		rfs_data_account(slots, *slot, -1);
+		rcu_assign_pointer(*slot, NULL);
+	}
+
+	return nr;
+}
+
+void rfs_data_reclaimed(struct redirfs_data **datas, int nr)
+{
+	struct rfs_flt *rflt;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		rflt = datas[i]->filter;
+		atomic_long_inc(&rflt->reclaimed);
+		if (datas[i]->detach)
+			datas[i]->detach(datas[i]);
+		redirfs_put_data(datas[i]);
+	}
+}
+
+static struct redirfs_data *rfs_data_slots_attach(struct rfs_data_slots *slots,
+		struct rfs_flt *rflt, struct redirfs_data *data)
+{
+	struct redirfs_data **slot;
+
+	slot = rfs_data_slot_alloc(slots, rflt->slot);
+	if (!slot)
+		return NULL;
+
+	if (*slot)
+		return redirfs_get_data(*slot);
+
+	redirfs_get_data(data);
+	rcu_assign_pointer(*slot, data);
+	rfs_data_account(slots, data, 1);
+
+	return redirfs_get_data(data);
+}
+
+/*
+ * The reference held by the slot is passed to the caller.
+ */
+static struct redirfs_data *rfs_data_slots_detach(struct rfs_data_slots *slots,
+		struct rfs_flt *rflt)
+{
+	struct redirfs_data **slot;
+	struct redirfs_data *data;
+
+	slot = rfs_data_slot(slots, rflt->slot);
+	if (!slot || !*slot)
+		return NULL;
+
+	data = *slot;
+	rcu_assign_pointer(*slot, NULL);
+	rfs_data_account(slots, data, -1);
+
+	return data;
+}
+
+/*
+ * Lockless lookup, the data are freed after a grace period so the reference
+ * can be taken as long as it did not drop to zero.
+ */
+static struct redirfs_data *rfs_data_slots_get(struct rfs_data_slots *slots,
+		struct rfs_flt *rflt)
+{
+	struct redirfs_data **ext;
+	struct redirfs_data *data = NULL;
+	int slot = rflt->slot;
+
+	rcu_read_lock();
+
+	if (slot < RFS_DATA_INLINE)
+		data = rcu_dereference(slots->inl[slot]);
+	else {
+		ext = rcu_dereference(slots->ext);
+		if (ext)
+			data = rcu_dereference(ext[slot - RFS_DATA_INLINE]);
+	}
+
+	/*
+	 * The slot may have been reused by a filter registered after the
+	 * data's filter went away.
+	 */
+	if (data && data->filter != rflt)
+		data = NULL;
+
+	if (data && !atomic_inc_not_zero(&data->cnt))
+		data = NULL;
+
+	rcu_read_unlock();
+
+	return data;
+}
+
 int redirfs_init_data(struct redirfs_data *data, redirfs_filter filter,
 		void (*free)(struct redirfs_data *),
 		void (*detach)(struct redirfs_data *))
@@ -45,6 +249,7 @@ int redirfs_init_data(struct redirfs_data *data, redirfs_filter filter,
 
 	INIT_LIST_HEAD(&data->list);
 	atomic_set(&data->cnt, 1);
+	data->flags = 0;
 	data->free = free;
 	data->detach = detach;
 	data->filter = rfs_flt_get(filter);
@@ -64,6 +269,70 @@ struct redirfs_data *redirfs_get_data(struct redirfs_data *data)
 	return data;
 }
 
+/*
+ * The free callbacks and the filter puts can sleep, so they run from a work
+ * and not from the RCU callback.
+ */
+void rfs_data_free_flush(void)
+{
+	struct redirfs_data *data;
+	struct redirfs_data *tmp;
+	struct rfs_flt *rflt;
+	LIST_HEAD(list);
+
+	rfs_mutex_lock(&rfs_data_free_mutex);
+
+	spin_lock_bh(&rfs_data_free_lock);
+	list_splice_init(&rfs_data_free_list, &list);
+	spin_unlock_bh(&rfs_data_free_lock);
+
+	list_for_each_entry_safe(data, tmp, &list, list) {
+		list_del_init(&data->list);
+		rflt = data->filter;
+		data->free(data);
+		rfs_flt_put(rflt);
+	}
+
+	rfs_mutex_unlock(&rfs_data_free_mutex);
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+
+static void rfs_data_free_work(void *data)
+{
+	rfs_data_free_flush();
+}
+
+static DECLARE_WORK(rfs_data_free_wq, rfs_data_free_work, NULL);
+
+#else
+
+static void rfs_data_free_work(struct work_struct *work)
+{
+	rfs_data_free_flush();
+}
+
+static DECLARE_WORK(rfs_data_free_wq, rfs_data_free_work);
+
+#endif
+
+/*
+ * The last reference is gone, so the data are not on any list and the list
+ * head can be reused.
+ */
+static void rfs_data_free_rcu(struct rcu_head *head)
+{
+	struct redirfs_data *data;
+
+	data = container_of(head, struct redirfs_data, rcu);
+
+	spin_lock(&rfs_data_free_lock);
+	list_add_tail(&data->list, &rfs_data_free_list);
+	spin_unlock(&rfs_data_free_lock);
+
+	schedule_work(&rfs_data_free_wq);
+}
+
 void redirfs_put_data(struct redirfs_data *data)
 {
 	if (!data || IS_ERR(data))
@@ -74,8 +343,7 @@ void redirfs_put_data(struct redirfs_data *data)
 	if (!atomic_dec_and_test(&data->cnt))
 		return;
 
-	rfs_flt_put(data->filter);
-	data->free(data);
+	call_rcu(&data->rcu, rfs_data_free_rcu);
 }
 
 static struct redirfs_data *rfs_find_data(struct list_head *head,
@@ -110,13 +378,7 @@ struct redirfs_data *redirfs_attach_data_file(redirfs_filter filter,
 	if (rfs_chain_find(rfile->rdentry->rinfo->rchain, filter) == -1)
 		goto exit;
 
-	rv = rfs_find_data(&rfile->data, filter);
-	if (rv)
-		goto exit;
-
-	list_add_tail(&data->list, &rfile->data); 
-	redirfs_get_data(data);
-	rv = redirfs_get_data(data);
+	rv = rfs_data_slots_attach(&rfile->data, filter, data);
 exit:
 	spin_unlock(&rfile->lock);
 	spin_unlock(&rfile->rdentry->lock);
@@ -138,13 +400,9 @@ struct redirfs_data *redirfs_detach_data_file(redirfs_filter filter,
 		return NULL;
 
 	spin_lock(&rfile->lock);
-
-	data = rfs_find_data(&rfile->data, filter);
-	if (data)
-		list_del(&data->list);
-
+	data = rfs_data_slots_detach(&rfile->data, filter);
 	spin_unlock(&rfile->lock);
-	redirfs_put_data(data);
+
 	rfs_file_put(rfile);
 	return data;
 }
@@ -162,11 +420,8 @@ struct redirfs_data *redirfs_get_data_file(redirfs_filter filter,
 	if (!rfile)
 		return NULL;
 
-	spin_lock(&rfile->lock);
-
-	data = rfs_find_data(&rfile->data, filter);
+	data = rfs_data_slots_get(&rfile->data, filter);
 
-	spin_unlock(&rfile->lock);
 	rfs_file_put(rfile);
 	return data;
 }
@@ -189,13 +444,7 @@ struct redirfs_data *redirfs_attach_data_dentry(redirfs_filter filter,
 	if (rfs_chain_find(rdentry->rinfo->rchain, filter) == -1)
 		goto exit;
 
-	rv = rfs_find_data(&rdentry->data, filter);
-	if (rv)
-		goto exit;
-
-	list_add_tail(&data->list, &rdentry->data); 
-	redirfs_get_data(data);
-	rv = redirfs_get_data(data);
+	rv = rfs_data_slots_attach(&rdentry->data, filter, data);
 exit:
 	spin_unlock(&rdentry->lock);
 	rfs_dentry_put(rdentry);
@@ -216,13 +465,9 @@ struct redirfs_data *redirfs_detach_data_dentry(redirfs_filter filter,
 		return NULL;
 
 	spin_lock(&rdentry->lock);
-
-	data = rfs_find_data(&rdentry->data, filter);
-	if (data)
-		list_del(&data->list);
-
+	data = rfs_data_slots_detach(&rdentry->data, filter);
 	spin_unlock(&rdentry->lock);
-	redirfs_put_data(data);
+
 	rfs_dentry_put(rdentry);
 	return data;
 }
@@ -240,11 +485,8 @@ struct redirfs_data *redirfs_get_data_dentry(redirfs_filter filter,
 	if (!rdentry)
 		return NULL;
 
-	spin_lock(&rdentry->lock);
-
-	data = rfs_find_data(&rdentry->data, filter);
+	data = rfs_data_slots_get(&rdentry->data, filter);
 
-	spin_unlock(&rdentry->lock);
 	rfs_dentry_put(rdentry);
 	return data;
 }
@@ -267,13 +509,7 @@ struct redirfs_data *redirfs_attach_data_inode(redirfs_filter filter,
 	if (rfs_chain_find(rinode->rinfo->rchain, filter) == -1)
 		goto exit;
 
-	rv = rfs_find_data(&rinode->data, filter);
-	if (rv)
-		goto exit;
-
-	list_add_tail(&data->list, &rinode->data); 
-	redirfs_get_data(data);
-	rv = redirfs_get_data(data);
+	rv = rfs_data_slots_attach(&rinode->data, filter, data);
 exit:
 	spin_unlock(&rinode->lock);
 	rfs_inode_put(rinode);
@@ -294,13 +530,9 @@ struct redirfs_data *redirfs_detach_data_inode(redirfs_filter filter,
 		return NULL;
 
 	spin_lock(&rinode->lock);
-
-	data = rfs_find_data(&rinode->data, filter);
-	if (data)
-		list_del(&data->list);
-
+	data = rfs_data_slots_detach(&rinode->data, filter);
 	spin_unlock(&rinode->lock);
-	redirfs_put_data(data);
+
 	rfs_inode_put(rinode);
 	return data;
 }
@@ -318,11 +550,8 @@ struct redirfs_data *redirfs_get_data_inode(redirfs_filter filter,
 	if (!rinode)
 		return NULL;
 
-	spin_lock(&rinode->lock);
-
-	data = rfs_find_data(&rinode->data, filter);
+	data = rfs_data_slots_get(&rinode->data, filter);
 
-	spin_unlock(&rinode->lock);
 	rfs_inode_put(rinode);
 	return data;
 }
@@ -339,6 +568,19 @@ void rfs_context_deinit(struct rfs_context *rcont)
 	rfs_data_remove(&rcont->data);
 }
 
+void rfs_context_move_data(struct rfs_context *dst, struct rfs_context *src,
+		struct rfs_flt *rflt)
+{
+	struct redirfs_data *data;
+
+	data = rfs_find_data(&src->data, rflt);
+	if (!data)
+		return;
+
+	list_move_tail(&data->list, &dst->data);
+	redirfs_put_data(data);
+}
+
 struct redirfs_data *redirfs_attach_data_context(redirfs_filter filter,
 		redirfs_context context, struct redirfs_data *data)
 {
@@ -410,13 +652,7 @@ struct redirfs_data *redirfs_attach_data_root(redirfs_filter filter,
 	if (!found)
 		goto exit;
 
-	rv = rfs_find_data(&rroot->data, filter);
-	if (rv)
-		goto exit;
-
-	list_add_tail(&data->list, &rroot->data); 
-	redirfs_get_data(data);
-	rv = redirfs_get_data(data);
+	rv = rfs_data_slots_attach(&rroot->data, filter, data);
 exit:
 	spin_unlock(&rroot->lock);
 	return rv;
@@ -432,13 +668,8 @@ struct redirfs_data *redirfs_detach_data_root(redirfs_filter filter,
 		return NULL;
 
 	spin_lock(&rroot->lock);
-
-	data = rfs_find_data(&rroot->data, filter);
-	if (data)
-		list_del(&data->list);
-
+	data = rfs_data_slots_detach(&rroot->data, filter);
 	spin_unlock(&rroot->lock);
-	redirfs_put_data(data);
 
 	return data;
 }
@@ -447,20 +678,103 @@ struct redirfs_data *redirfs_get_data_root(redirfs_filter filter,
 		redirfs_root root)
 {
 	struct rfs_root *rroot = (struct rfs_root *)root;
-	struct redirfs_data *data;
 
 	if (!filter || IS_ERR(filter) || !root)
 		return NULL;
 
-	spin_lock(&rroot->lock);
+	return rfs_data_slots_get(&rroot->data, filter);
+}
 
-	data = rfs_find_data(&rroot->data, filter);
+/*
+ * The shrinker scans the rdentries and detaches reclaimable data of unused
+ * dentries and of their inodes. The rdentries and rinodes themselves go
+ * away with the dentries when the dcache is shrunk.
+ */
+static unsigned long rfs_data_shrink_count(void)
+{
+	long nr = atomic_long_read(&rfs_data_reclaim_nr);
 
-	spin_unlock(&rroot->lock);
+	return nr > 0 ? nr : 0;
+}
 
-	return data;
+static long rfs_data_shrink_scan(unsigned long nr, gfp_t gfp_mask)
+{
+	if (!(gfp_mask & __GFP_FS))
+		return -1;
+
+	return rfs_dentry_reclaim(nr);
+}
+
+static int rfs_data_shrink_old(int nr, gfp_t gfp_mask)
+{
+	if (nr && rfs_data_shrink_scan(nr, gfp_mask) < 0)
+		return -1;
+
+	return min_t(unsigned long, rfs_data_shrink_count(), INT_MAX);
 }
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23))
+
+static struct shrinker *rfs_data_shrinker;
+
+int rfs_data_shrinker_create(void)
+{
+	rfs_data_shrinker = set_shrinker(DEFAULT_SEEKS, rfs_data_shrink_old);
+	if (!rfs_data_shrinker)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void rfs_data_shrinker_destroy(void)
+{
+	remove_shrinker(rfs_data_shrinker);
+}
+
+#else
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35))
+
+static int rfs_data_shrink(int nr, gfp_t gfp_mask)
+{
+	return rfs_data_shrink_old(nr, gfp_mask);
+}
+
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(3,0,0))
+
+static int rfs_data_shrink(struct shrinker *shrinker, int nr, gfp_t gfp_mask)
+{
+	return rfs_data_shrink_old(nr, gfp_mask);
+}
+
+#else
+
+static int rfs_data_shrink(struct shrinker *shrinker,
+		struct shrink_control *sc)
+{
+	return rfs_data_shrink_old(sc->nr_to_scan, sc->gfp_mask);
+}
+
+#endif
+
+static struct shrinker rfs_data_shrinker = {
+	.shrink = rfs_data_shrink,
+	.seeks = DEFAULT_SEEKS
+};
+
+int rfs_data_shrinker_create(void)
+{
+	register_shrinker(&rfs_data_shrinker);
+	return 0;
+}
+
+void rfs_data_shrinker_destroy(void)
+{
+	unregister_shrinker(&rfs_data_shrinker);
+}
+
+#endif
+
 EXPORT_SYMBOL(redirfs_init_data);
 EXPORT_SYMBOL(redirfs_get_data);
 EXPORT_SYMBOL(redirfs_put_data);
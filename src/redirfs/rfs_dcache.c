@@ -22,6 +22,13 @@
  */
 
 #include "rfs.h"
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26))
+#include <asm/semaphore.h>
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36))
+#include <linux/semaphore.h>
+#include <linux/cpu.h>
+#endif
+#include "rfs_trace.h"
 
 struct rfs_dcache_data *rfs_dcache_data_alloc(struct dentry *dentry,
 		struct rfs_info *rinfo, struct rfs_flt *rflt)
@@ -218,78 +225,369 @@ static int rfs_dcache_get_subs_mutex(struct dentry *dir, struct list_head *sibs)
 	return rv;
 }
 
-static int rfs_dcache_get_dirs(struct list_head *dirs, struct list_head *sibs)
+#define RFS_DCACHE_WALK_CHUNK 1024
+#define RFS_DCACHE_WALK_REPORT 1024
+
+static struct workqueue_struct *rfs_dcache_wq;
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36))
+/*
+ * create_workqueue runs one worker per CPU, the walk_threads bound is
+ * applied by the works themselves.
+ */
+static struct semaphore rfs_dcache_sem;
+
+#define rfs_dcache_work_begin() down(&rfs_dcache_sem)
+#define rfs_dcache_work_end() up(&rfs_dcache_sem)
+#else
+#define rfs_dcache_work_begin() do { } while (0)
+#define rfs_dcache_work_end() do { } while (0)
+#endif
+
+struct rfs_dcache_walk {
+	int (*cb)(struct dentry *, void *);
+	void *data;
+	struct dentry *root;
+	spinlock_t lock;
+	int rv;
+	atomic_t pending;
+	atomic_long_t dirs;
+	atomic_long_t dentries;
+	struct rfs_dcache_progress *progress;
+	struct completion done;
+};
+
+struct rfs_dcache_work {
+	struct work_struct work;
+	struct rfs_dcache_walk *walk;
+	struct dentry *dentry;
+	struct list_head sibs;
+};
+
+static void rfs_dcache_walk_error(struct rfs_dcache_walk *walk, int rv)
+{
+	spin_lock(&walk->lock);
+	if (!walk->rv)
+		walk->rv = rv;
+	spin_unlock(&walk->lock);
+}
+
+static int rfs_dcache_walk_failed(struct rfs_dcache_walk *walk)
+{
+	int rv;
+
+	spin_lock(&walk->lock);
+	rv = walk->rv;
+	spin_unlock(&walk->lock);
+
+	return rv;
+}
+
+/*
+ * Walks started by an asynchronous registration report their progress. The
+ * walk runs with the rename lock and rfs_path_mutex held, so it must not be
+ * slowed down on purpose.
+ */
+static void rfs_dcache_walk_progress(struct rfs_dcache_walk *walk)
+{
+	if (!walk->progress)
+		return;
+
+	atomic_long_inc(&walk->progress->dentries);
+}
+
+static void rfs_dcache_walk_dentry(struct rfs_dcache_walk *walk)
+{
+	atomic_long_inc(&walk->dentries);
+	rfs_dcache_walk_progress(walk);
+}
+
+static void rfs_dcache_walk_dir(struct rfs_dcache_walk *walk)
+{
+	long dirs;
+
+	rfs_dcache_walk_progress(walk);
+
+	dirs = atomic_long_inc_return(&walk->dirs);
+	if (!rfs_trace_on() || dirs % RFS_DCACHE_WALK_REPORT)
+		return;
+
+	trace_redirfs_dcache_walk_progress(walk->root, dirs,
+			atomic_long_read(&walk->dentries));
+}
+
+static void rfs_dcache_work_run(struct rfs_dcache_work *rwork);
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+
+static void rfs_dcache_work_fn(void *data)
+{
+	rfs_dcache_work_run(data);
+}
+
+#define rfs_dcache_init_work(rwork) \
+	INIT_WORK(&(rwork)->work, rfs_dcache_work_fn, rwork)
+
+#else
+
+static void rfs_dcache_work_fn(struct work_struct *work)
+{
+	rfs_dcache_work_run(container_of(work, struct rfs_dcache_work, work));
+}
+
+#define rfs_dcache_init_work(rwork) \
+	INIT_WORK(&(rwork)->work, rfs_dcache_work_fn)
+
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)) && \
+	(LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36))
+
+/*
+ * queue_work puts the work on the queuing CPU's worker, so the whole walk
+ * would run on the CPU which started it. Spread the works round-robin over
+ * the online CPUs instead, the hotplug lock keeps the chosen CPU online.
+ */
+static DEFINE_SPINLOCK(rfs_dcache_cpu_lock);
+static int rfs_dcache_cpu = -1;
+
+static void rfs_dcache_queue(struct rfs_dcache_work *rwork)
+{
+	int cpu;
+
+	get_online_cpus();
+
+	spin_lock(&rfs_dcache_cpu_lock);
+	cpu = cpumask_next(rfs_dcache_cpu, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first(cpu_online_mask);
+	rfs_dcache_cpu = cpu;
+	spin_unlock(&rfs_dcache_cpu_lock);
+
+	queue_work_on(cpu, rfs_dcache_wq, &rwork->work);
+
+	put_online_cpus();
+}
+
+#else
+
+/*
+ * Before 2.6.28 there is no queue_work_on and the works stay on the CPU
+ * which queued them. The unbound workqueue used since 2.6.36 spreads them
+ * by itself.
+ */
+static void rfs_dcache_queue(struct rfs_dcache_work *rwork)
+{
+	queue_work(rfs_dcache_wq, &rwork->work);
+}
+
+#endif
+
+/*
+ * Queue either one directory or a chunk of non-directory siblings. Every
+ * queued work holds a pending reference to the walk.
+ */
+static int rfs_dcache_walk_queue(struct rfs_dcache_walk *walk,
+		struct dentry *dentry, struct list_head *sibs)
+{
+	struct rfs_dcache_work *rwork;
+
+	rwork = kzalloc(sizeof(struct rfs_dcache_work), GFP_KERNEL);
+	if (!rwork)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&rwork->sibs);
+	rwork->walk = walk;
+	rwork->dentry = dget(dentry);
+	if (sibs)
+		list_splice_init(sibs, &rwork->sibs);
+
+	atomic_inc(&walk->pending);
+	rfs_dcache_init_work(rwork);
+	rfs_dcache_queue(rwork);
+
+	return 0;
+}
+
+static int rfs_dcache_walk_sibs(struct rfs_dcache_walk *walk,
+		struct list_head *sibs)
 {
+	struct rfs_dcache_entry *sib;
+	int rv;
+
+	list_for_each_entry(sib, sibs, list) {
+		if (rfs_dcache_walk_failed(walk))
+			return 0;
+
+		rv = walk->cb(sib->dentry, walk->data);
+		if (rv < 0)
+			return rv;
+
+		rfs_dcache_walk_dentry(walk);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/*
+ * Subdirectories are queued as separate works, the remaining siblings are
+ * split into chunks of RFS_DCACHE_WALK_CHUNK dentries. The last chunk is
+ * processed by the current worker.
+ */
+static int rfs_dcache_walk_subs(struct rfs_dcache_walk *walk,
+		struct list_head *sibs)
+{
+	LIST_HEAD(chunk);
 	struct rfs_dcache_entry *entry;
-	struct rfs_dcache_entry *dir;
 	struct rfs_dcache_entry *tmp;
+	unsigned int count = 0;
+	int rv;
 
 	list_for_each_entry_safe(entry, tmp, sibs, list) {
-		if (!entry->dentry->d_inode)
+		if (entry->dentry->d_inode &&
+		    S_ISDIR(entry->dentry->d_inode->i_mode)) {
+			rv = rfs_dcache_walk_queue(walk, entry->dentry, NULL);
+			if (rv)
+				goto exit;
+
+			rfs_dcache_entry_free(entry);
 			continue;
+		}
 
-		if (!S_ISDIR(entry->dentry->d_inode->i_mode))
+		list_move_tail(&entry->list, &chunk);
+		if (++count < RFS_DCACHE_WALK_CHUNK)
 			continue;
 
-		dir = rfs_dcache_entry_alloc(entry->dentry, dirs);
-		if (IS_ERR(dir))
-			return PTR_ERR(dir);
+		rv = rfs_dcache_walk_queue(walk, NULL, &chunk);
+		if (rv)
+			goto exit;
 
-		rfs_dcache_entry_free(entry);
+		count = 0;
 	}
 
-	return 0;
+	rv = rfs_dcache_walk_sibs(walk, &chunk);
+exit:
+	rfs_dcache_entry_free_list(&chunk);
+	return rv;
 }
 
-int rfs_dcache_walk(struct dentry *root, int (*cb)(struct dentry *, void *),
-		void *data)
+static void rfs_dcache_work_run(struct rfs_dcache_work *rwork)
 {
-	LIST_HEAD(dirs);
+	struct rfs_dcache_walk *walk = rwork->walk;
+	struct dentry *dir = rwork->dentry;
 	LIST_HEAD(sibs);
-	struct rfs_dcache_entry *dir;
-	struct rfs_dcache_entry *sib;
 	int rv = 0;
 
-	dir = rfs_dcache_entry_alloc(root, &dirs);
-	if (IS_ERR(dir))
-		return PTR_ERR(dir);
-
-	while (!list_empty(&dirs)) {
-		dir = list_entry(dirs.next, struct rfs_dcache_entry, list);
+	rfs_dcache_work_begin();
 
-		rv = cb(dir->dentry, data);
-		if (rv < 0)
-			goto exit;
+	if (rfs_dcache_walk_failed(walk))
+		goto exit;
 
-		if (rv > 0 || !dir->dentry->d_inode) {
-			rfs_dcache_entry_free(dir);
-			rv = 0;
-			continue;
-		}
+	if (!dir) {
+		rv = rfs_dcache_walk_sibs(walk, &rwork->sibs);
+		goto exit;
+	}
 
-		rv = rfs_dcache_get_subs_mutex(dir->dentry, &sibs);
-		if (rv)
-			goto exit;
+	rv = walk->cb(dir, walk->data);
+	if (rv < 0)
+		goto exit;
 
-		rv = rfs_dcache_get_dirs(&dirs, &sibs);
-		if (rv)
-			goto exit;
+	rfs_dcache_walk_dir(walk);
 
-		list_for_each_entry(sib, &sibs, list) {
-			rv = cb(sib->dentry, data);
-			if (rv < 0)
-				goto exit;
-		}
-		rfs_dcache_entry_free_list(&sibs);
-		rfs_dcache_entry_free(dir);
+	if (rv > 0 || !dir->d_inode) {
+		rv = 0;
+		goto exit;
 	}
+
+	rv = rfs_dcache_get_subs_mutex(dir, &sibs);
+	if (rv)
+		goto exit;
+
+	rv = rfs_dcache_walk_subs(walk, &sibs);
 exit:
-	list_splice(&sibs, &dirs);
-	rfs_dcache_entry_free_list(&dirs);
+	if (rv)
+		rfs_dcache_walk_error(walk, rv);
+
+	rfs_dcache_entry_free_list(&sibs);
+	rfs_dcache_entry_free_list(&rwork->sibs);
+	dput(dir);
+	kfree(rwork);
+
+	rfs_dcache_work_end();
+
+	if (atomic_dec_and_test(&walk->pending))
+		complete(&walk->done);
+}
+
+/*
+ * The walk is split into works, one per directory, which run in parallel on
+ * the bounded redirfs_walk workqueue. Callbacks therefore have to be safe
+ * against each other as well as against concurrent lookups, which attach
+ * dentries through rfs_dcache_rdentry_add the same way. A callback for a
+ * directory is always called before the callbacks for its children.
+ */
+int rfs_dcache_walk(struct dentry *root, int (*cb)(struct dentry *, void *),
+		void *data)
+{
+	struct rfs_dcache_walk walk;
+	ktime_t start = ktime_set(0, 0);
+	int rv;
+
+	if (rfs_trace_on())
+		start = ktime_get();
+
+	walk.cb = cb;
+	walk.data = data;
+	walk.root = root;
+	walk.rv = 0;
+	walk.progress = rfs_async_progress();
+	spin_lock_init(&walk.lock);
+	atomic_set(&walk.pending, 1);
+	atomic_long_set(&walk.dirs, 0);
+	atomic_long_set(&walk.dentries, 0);
+	init_completion(&walk.done);
+
+	rv = rfs_dcache_walk_queue(&walk, root, NULL);
+	if (rv)
+		rfs_dcache_walk_error(&walk, rv);
+
+	if (!atomic_dec_and_test(&walk.pending))
+		wait_for_completion(&walk.done);
+
+	rv = walk.rv;
+
+	if (rfs_trace_on())
+		trace_redirfs_dcache_walk(root, rv,
+				ktime_to_ns(ktime_sub(ktime_get(), start)));
 
 	return rv;
 }
 
+int rfs_dcache_walk_create(void)
+{
+	int max_active = rfs_walk_threads;
+
+	if (max_active < 1)
+		max_active = 1;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36))
+	rfs_dcache_wq = alloc_workqueue("redirfs_walk", WQ_UNBOUND, max_active);
+#else
+	sema_init(&rfs_dcache_sem, max_active);
+	rfs_dcache_wq = create_workqueue("redirfs_walk");
+#endif
+	if (!rfs_dcache_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void rfs_dcache_walk_destroy(void)
+{
+	destroy_workqueue(rfs_dcache_wq);
+}
+
 static int rfs_dcache_skip(struct dentry *dentry, struct rfs_dcache_data *rdata)
 {
 	struct rfs_dentry *rdentry = NULL;
@@ -336,7 +634,7 @@ int rfs_dcache_rdentry_add(struct dentry *dentry, struct rfs_info *rinfo)
 	if (rv)
 		goto exit;
 
-	rfs_dentry_set_ops(rdentry);
+	rv = rfs_dentry_set_ops(rdentry);
 exit:
 	rfs_dentry_put(rdentry);
 	return rv;
@@ -379,7 +677,7 @@ static int rfs_dcache_rdentry_del(struct dentry *dentry, struct rfs_info *rinfo)
 	if (rv)
 		goto exit;
 
-	rfs_dentry_set_ops(rdentry);
+	rv = rfs_dentry_set_ops(rdentry);
 exit:
 	rfs_dentry_put(rdentry);
 	return rv;
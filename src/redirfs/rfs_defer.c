@@ -0,0 +1,356 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rfs.h"
+
+#define RFS_DEFER_PINS 2
+
+struct rfs_defer {
+	struct work_struct work;
+	struct rfs_flt *rflt;
+	enum redirfs_rv (*rop)(redirfs_context, struct redirfs_args *);
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	struct dentry *dentries[RFS_DEFER_PINS];
+	struct inode *inodes[RFS_DEFER_PINS];
+	struct file *file;
+	struct super_block *sb;
+	struct iattr iattr;
+	char *name;
+	int dentries_nr;
+	int inodes_nr;
+};
+
+static struct workqueue_struct *rfs_defer_wq;
+
+int rfs_defer_supported(enum redirfs_op_id id)
+{
+	switch (id) {
+	case REDIRFS_DIR_IOP_CREATE:
+	case REDIRFS_DIR_IOP_LINK:
+	case REDIRFS_DIR_IOP_UNLINK:
+	case REDIRFS_DIR_IOP_SYMLINK:
+	case REDIRFS_DIR_IOP_MKDIR:
+	case REDIRFS_DIR_IOP_RMDIR:
+	case REDIRFS_DIR_IOP_MKNOD:
+	case REDIRFS_DIR_IOP_RENAME:
+	case REDIRFS_REG_IOP_SETATTR:
+	case REDIRFS_DIR_IOP_SETATTR:
+	case REDIRFS_CHR_IOP_SETATTR:
+	case REDIRFS_BLK_IOP_SETATTR:
+	case REDIRFS_FIFO_IOP_SETATTR:
+	case REDIRFS_LNK_IOP_SETATTR:
+	case REDIRFS_SOCK_IOP_SETATTR:
+	case REDIRFS_REG_FOP_OPEN:
+	case REDIRFS_DIR_FOP_OPEN:
+	case REDIRFS_CHR_FOP_OPEN:
+	case REDIRFS_BLK_FOP_OPEN:
+	case REDIRFS_FIFO_FOP_OPEN:
+	case REDIRFS_LNK_FOP_OPEN:
+	case REDIRFS_REG_FOP_FLUSH:
+	case REDIRFS_DIR_FOP_FLUSH:
+	case REDIRFS_CHR_FOP_FLUSH:
+	case REDIRFS_BLK_FOP_FLUSH:
+	case REDIRFS_FIFO_FOP_FLUSH:
+	case REDIRFS_LNK_FOP_FLUSH:
+	case REDIRFS_REG_FOP_FSYNC:
+	case REDIRFS_DIR_FOP_FSYNC:
+	case REDIRFS_CHR_FOP_FSYNC:
+	case REDIRFS_BLK_FOP_FSYNC:
+	case REDIRFS_FIFO_FOP_FSYNC:
+	case REDIRFS_LNK_FOP_FSYNC:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+static void rfs_defer_dget(struct rfs_defer *rdefer, struct dentry *dentry)
+{
+	rdefer->dentries[rdefer->dentries_nr++] = dget(dentry);
+}
+
+static int rfs_defer_igrab(struct rfs_defer *rdefer, struct inode *inode)
+{
+	if (!igrab(inode))
+		return -ESTALE;
+
+	rdefer->inodes[rdefer->inodes_nr++] = inode;
+	return 0;
+}
+
+/*
+ * Take references to all objects the post callback can see and copy the
+ * arguments which live on the caller's stack. Pointers which cannot be
+ * pinned (nameidata, the flush owner) are cleared.
+ */
+static int rfs_defer_pin(struct rfs_defer *rdefer)
+{
+	union redirfs_op_args *args = &rdefer->rargs.args;
+	int rv;
+
+	switch (rdefer->rargs.type.id) {
+	case REDIRFS_DIR_IOP_CREATE:
+		args->i_create.nd = NULL;
+		rfs_defer_dget(rdefer, args->i_create.dentry);
+		return rfs_defer_igrab(rdefer, args->i_create.dir);
+
+	case REDIRFS_DIR_IOP_LINK:
+		rfs_defer_dget(rdefer, args->i_link.old_dentry);
+		rfs_defer_dget(rdefer, args->i_link.dentry);
+		return rfs_defer_igrab(rdefer, args->i_link.dir);
+
+	case REDIRFS_DIR_IOP_UNLINK:
+		rfs_defer_dget(rdefer, args->i_unlink.dentry);
+		return rfs_defer_igrab(rdefer, args->i_unlink.dir);
+
+	case REDIRFS_DIR_IOP_SYMLINK:
+		rdefer->name = kstrdup(args->i_symlink.oldname, GFP_NOFS);
+		if (!rdefer->name)
+			return -ENOMEM;
+
+		args->i_symlink.oldname = rdefer->name;
+		rfs_defer_dget(rdefer, args->i_symlink.dentry);
+		return rfs_defer_igrab(rdefer, args->i_symlink.dir);
+
+	case REDIRFS_DIR_IOP_MKDIR:
+		rfs_defer_dget(rdefer, args->i_mkdir.dentry);
+		return rfs_defer_igrab(rdefer, args->i_mkdir.dir);
+
+	case REDIRFS_DIR_IOP_RMDIR:
+		rfs_defer_dget(rdefer, args->i_rmdir.dentry);
+		return rfs_defer_igrab(rdefer, args->i_rmdir.dir);
+
+	case REDIRFS_DIR_IOP_MKNOD:
+		rfs_defer_dget(rdefer, args->i_mknod.dentry);
+		return rfs_defer_igrab(rdefer, args->i_mknod.dir);
+
+	case REDIRFS_DIR_IOP_RENAME:
+		rfs_defer_dget(rdefer, args->i_rename.old_dentry);
+		rfs_defer_dget(rdefer, args->i_rename.new_dentry);
+		rv = rfs_defer_igrab(rdefer, args->i_rename.old_dir);
+		if (rv)
+			return rv;
+
+		return rfs_defer_igrab(rdefer, args->i_rename.new_dir);
+
+	case REDIRFS_REG_IOP_SETATTR:
+	case REDIRFS_DIR_IOP_SETATTR:
+	case REDIRFS_CHR_IOP_SETATTR:
+	case REDIRFS_BLK_IOP_SETATTR:
+	case REDIRFS_FIFO_IOP_SETATTR:
+	case REDIRFS_LNK_IOP_SETATTR:
+	case REDIRFS_SOCK_IOP_SETATTR:
+		rdefer->iattr = *args->i_setattr.iattr;
+#ifdef ATTR_FILE
+		rdefer->iattr.ia_valid &= ~ATTR_FILE;
+#endif
+		args->i_setattr.iattr = &rdefer->iattr;
+		rfs_defer_dget(rdefer, args->i_setattr.dentry);
+		return 0;
+
+	case REDIRFS_REG_FOP_OPEN:
+	case REDIRFS_DIR_FOP_OPEN:
+	case REDIRFS_CHR_FOP_OPEN:
+	case REDIRFS_BLK_FOP_OPEN:
+	case REDIRFS_FIFO_FOP_OPEN:
+	case REDIRFS_LNK_FOP_OPEN:
+		/*
+		 * The file of a failed open is released by the caller right
+		 * after the post callbacks. A successful open can be closed
+		 * before the work runs as well, the last reference to the
+		 * file must not be dropped by the worker, so the file is not
+		 * pinned at all.
+		 */
+		if (rdefer->rargs.rv.rv_int)
+			return -EINVAL;
+
+		args->f_open.file = NULL;
+		return rfs_defer_igrab(rdefer, args->f_open.inode);
+
+	case REDIRFS_REG_FOP_FLUSH:
+	case REDIRFS_DIR_FOP_FLUSH:
+	case REDIRFS_CHR_FOP_FLUSH:
+	case REDIRFS_BLK_FOP_FLUSH:
+	case REDIRFS_FIFO_FOP_FLUSH:
+	case REDIRFS_LNK_FOP_FLUSH:
+		/*
+		 * Flush is called on every close. Pinning the last reference
+		 * would move the release of the file to the worker and the
+		 * file system could not be unmounted right after the close.
+		 */
+		if (file_count(args->f_flush.file) <= 1)
+			return -EBUSY;
+
+		args->f_flush.id = NULL;
+		rdefer->file = args->f_flush.file;
+		get_file(rdefer->file);
+		return 0;
+
+	case REDIRFS_REG_FOP_FSYNC:
+	case REDIRFS_DIR_FOP_FSYNC:
+	case REDIRFS_CHR_FOP_FSYNC:
+	case REDIRFS_BLK_FOP_FSYNC:
+	case REDIRFS_FIFO_FOP_FSYNC:
+	case REDIRFS_LNK_FOP_FSYNC:
+		/* see flush, the caller may close the file right after */
+		if (file_count(args->f_fsync.file) <= 1)
+			return -EBUSY;
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35))
+		rfs_defer_dget(rdefer, args->f_fsync.dentry);
+#endif
+		rdefer->file = args->f_fsync.file;
+		get_file(rdefer->file);
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * The dentries and inodes do not pin the mount. An active reference to the
+ * super block keeps it from being shut down while the work is queued,
+ * umount detaches the mount and the last deactivate_super, done by the
+ * worker after the dentries and inodes are released, shuts it down. Files
+ * pin their mount by themselves.
+ */
+static void rfs_defer_sb(struct rfs_defer *rdefer)
+{
+	if (rdefer->dentries_nr)
+		rdefer->sb = rdefer->dentries[0]->d_sb;
+	else if (rdefer->inodes_nr)
+		rdefer->sb = rdefer->inodes[0]->i_sb;
+	else
+		return;
+
+	atomic_inc(&rdefer->sb->s_active);
+}
+
+static void rfs_defer_free(struct rfs_defer *rdefer)
+{
+	int i;
+
+	for (i = 0; i < rdefer->dentries_nr; i++)
+		dput(rdefer->dentries[i]);
+
+	for (i = 0; i < rdefer->inodes_nr; i++)
+		iput(rdefer->inodes[i]);
+
+	if (rdefer->file)
+		fput(rdefer->file);
+
+	if (rdefer->sb)
+		deactivate_super(rdefer->sb);
+
+	rfs_context_deinit(&rdefer->rcont);
+	rfs_flt_put(rdefer->rflt);
+	kfree(rdefer->name);
+	kfree(rdefer);
+}
+
+static void rfs_defer_run(struct rfs_defer *rdefer)
+{
+	rfs_flt_call(rdefer->rflt, rdefer->rop, &rdefer->rcont,
+			&rdefer->rargs);
+	rfs_defer_free(rdefer);
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+
+static void rfs_defer_work(void *data)
+{
+	rfs_defer_run(data);
+}
+
+#define rfs_defer_init_work(rdefer) \
+	INIT_WORK(&(rdefer)->work, rfs_defer_work, rdefer)
+
+#else
+
+static void rfs_defer_work(struct work_struct *work)
+{
+	rfs_defer_run(container_of(work, struct rfs_defer, work));
+}
+
+#define rfs_defer_init_work(rdefer) \
+	INIT_WORK(&(rdefer)->work, rfs_defer_work)
+
+#endif
+
+/*
+ * Queue the post callback on the redirfs_defer worker. The filter's context
+ * data are handed over to the deferred context. A non-zero return value
+ * means the callback could not be deferred and has to be called directly.
+ */
+int rfs_defer_post(struct rfs_flt *rflt,
+		enum redirfs_rv (*rop)(redirfs_context, struct redirfs_args *),
+		struct rfs_context *rcont, struct redirfs_args *rargs)
+{
+	struct rfs_defer *rdefer;
+	int rv;
+
+	rdefer = kzalloc(sizeof(struct rfs_defer), GFP_NOFS);
+	if (!rdefer)
+		return -ENOMEM;
+
+	rdefer->rflt = rfs_flt_get(rflt);
+	rdefer->rop = rop;
+	rdefer->rargs = *rargs;
+	rfs_context_init(&rdefer->rcont, rcont->idx);
+
+	rv = rfs_defer_pin(rdefer);
+	if (rv) {
+		rfs_defer_free(rdefer);
+		return rv;
+	}
+
+	rfs_defer_sb(rdefer);
+	rfs_context_move_data(&rdefer->rcont, rcont, rflt);
+	rfs_defer_init_work(rdefer);
+	queue_work(rfs_defer_wq, &rdefer->work);
+
+	return 0;
+}
+
+void rfs_defer_flush(void)
+{
+	flush_workqueue(rfs_defer_wq);
+}
+
+int rfs_defer_create(void)
+{
+	rfs_defer_wq = create_singlethread_workqueue("redirfs_defer");
+	if (!rfs_defer_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void rfs_defer_destroy(void)
+{
+	destroy_workqueue(rfs_defer_wq);
+}
+
@@ -24,6 +24,7 @@
 #include "rfs.h"
 
 static rfs_kmem_cache_t *rfs_dentry_cache = NULL;
+static struct rfs_hash rfs_dentry_hash;
 
 static struct rfs_dentry *rfs_dentry_alloc(struct dentry *dentry)
 {
@@ -35,21 +36,82 @@ static struct rfs_dentry *rfs_dentry_alloc(struct dentry *dentry)
 
 	INIT_LIST_HEAD(&rdentry->rinode_list);
 	INIT_LIST_HEAD(&rdentry->rfiles);
-	INIT_LIST_HEAD(&rdentry->data);
+	INIT_HLIST_NODE(&rdentry->hash);
+	rfs_data_slots_init(&rdentry->data, 1);
 	rdentry->dentry = dentry;
-	rdentry->op_old = dentry->d_op;
 	spin_lock_init(&rdentry->lock);
 	atomic_set(&rdentry->count, 1);
+	rfs_obj_add(RFS_OBJ_DENTRY, 1);
 
-	if (dentry->d_op)
-		memcpy(&rdentry->op_new, dentry->d_op,
-				sizeof(struct dentry_operations));
+	return rdentry;
+}
+
+struct rfs_dentry *rfs_dentry_find(const struct dentry *dentry)
+{
+	struct rfs_dentry *rdentry = NULL;
+	struct hlist_node *pos;
 
-	rdentry->op_new.d_iput = rfs_d_iput;
+	if (!dentry || !dentry->d_op || dentry->d_op->d_iput != rfs_d_iput)
+		return NULL;
+
+	rcu_read_lock();
+	rfs_hash_for_each_rcu(pos, &rfs_dentry_hash, dentry) {
+		rdentry = hlist_entry(pos, struct rfs_dentry, hash);
+		if (rdentry->dentry == dentry &&
+				atomic_inc_not_zero(&rdentry->count))
+			break;
+
+		rdentry = NULL;
+	}
+	rcu_read_unlock();
 
 	return rdentry;
 }
 
+/*
+ * The dentry can use our operations without having an rdentry, e.g. isofs
+ * copies d_op from the root dentry.
+ */
+static const struct dentry_operations *rfs_dentry_op_old(
+		const struct dentry *dentry)
+{
+	return rfs_optbl_from_ops(dentry->d_op)->op_old;
+}
+
+static void rfs_dentry_init_ops(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
+{
+	if (rdentry->op_old)
+		memcpy(op_new, rdentry->op_old,
+				sizeof(struct dentry_operations));
+	else
+		memset(op_new, 0, sizeof(struct dentry_operations));
+
+	op_new->d_iput = rfs_d_iput;
+}
+
+/*
+ * Switch the dentry to the shared table matching op_new. Called with
+ * rdentry->lock held. If no table can be allocated the dentry keeps its
+ * current operations.
+ */
+static void rfs_dentry_set_optbl(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
+{
+	struct rfs_optbl *optbl;
+
+	if (rdentry->dentry->d_op != rfs_optbl_ops(rdentry->optbl))
+		return;
+
+	optbl = rfs_optbl_add(&rfs_optbl_dops, rdentry->op_old, op_new);
+	if (IS_ERR(optbl))
+		return;
+
+	rdentry->dentry->d_op = rfs_optbl_ops(optbl);
+	rfs_optbl_put(rdentry->optbl);
+	rdentry->optbl = optbl;
+}
+
 struct rfs_dentry *rfs_dentry_get(struct rfs_dentry *rdentry)
 {
 	if (!rdentry || IS_ERR(rdentry))
@@ -61,6 +123,12 @@ struct rfs_dentry *rfs_dentry_get(struct rfs_dentry *rdentry)
 	return rdentry;
 }
 
+static void rfs_dentry_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(rfs_dentry_cache,
+			container_of(head, struct rfs_dentry, rcu));
+}
+
 void rfs_dentry_put(struct rfs_dentry *rdentry)
 {
 	struct rfs_inode *rinode;
@@ -77,14 +145,18 @@ void rfs_dentry_put(struct rfs_dentry *rdentry)
 	rdentry->rinode = NULL;
 	spin_unlock(&rdentry->lock);
 	rfs_inode_put(rinode);
+	rfs_info_obj_add(rdentry->rinfo, RFS_OBJ_DENTRY, -1);
 	rfs_info_put(rdentry->rinfo);
 
-	rfs_data_remove(&rdentry->data);
-	kmem_cache_free(rfs_dentry_cache, rdentry);
+	rfs_data_slots_remove(&rdentry->data);
+	rfs_optbl_put(rdentry->optbl);
+	rfs_obj_add(RFS_OBJ_DENTRY, -1);
+	call_rcu(&rdentry->rcu, rfs_dentry_free_rcu);
 }
 
 struct rfs_dentry *rfs_dentry_add(struct dentry *dentry, struct rfs_info *rinfo)
 {
+	struct dentry_operations op_new;
 	struct rfs_dentry *rd_new;
 	struct rfs_dentry *rd;
 
@@ -98,28 +170,37 @@ struct rfs_dentry *rfs_dentry_add(struct dentry *dentry, struct rfs_info *rinfo)
 	spin_lock(&dentry->d_lock);
 
 	rd = rfs_dentry_find(dentry);
+	if (rd)
+		goto exit;
 
 	/*
 	 * Workaround for the isofs_lookup function. It assigns
 	 * dentry operations for the new dentry from the root dentry.
-	 * This leads to the situation when one rdentry object can be
-	 * found for more dentry objects.
+	 * The original operations are taken from the shared table.
 	 *
 	 * isofs_lookup: dentry->d_op = dir->i_sb->s_root->d_op;
 	 */
-	if (rd && (rd->dentry != dentry)) {
-		rd_new->op_old = rd->op_old;
-		rfs_dentry_put(rd);
-		rd = NULL;
-	}
-
-	if (!rd) {
-		rd_new->rinfo = rfs_info_get(rinfo);
-		dentry->d_op = &rd_new->op_new;
-		rfs_dentry_get(rd_new);
-		rd = rfs_dentry_get(rd_new);
+	if (dentry->d_op && dentry->d_op->d_iput == rfs_d_iput)
+		rd_new->op_old = (void *)rfs_dentry_op_old(dentry);
+	else
+		rd_new->op_old = dentry->d_op;
+
+	rfs_dentry_init_ops(rd_new, &op_new);
+	rd_new->optbl = rfs_optbl_add(&rfs_optbl_dops, rd_new->op_old,
+			&op_new);
+	if (IS_ERR(rd_new->optbl)) {
+		rd = (struct rfs_dentry *)rd_new->optbl;
+		rd_new->optbl = NULL;
+		goto exit;
 	}
 
+	rd_new->rinfo = rfs_info_get(rinfo);
+	rfs_info_obj_add(rinfo, RFS_OBJ_DENTRY, 1);
+	dentry->d_op = rfs_optbl_ops(rd_new->optbl);
+	rfs_hash_add(&rfs_dentry_hash, &rd_new->hash, dentry);
+	rfs_dentry_get(rd_new);
+	rd = rfs_dentry_get(rd_new);
+exit:
 	spin_unlock(&dentry->d_lock);
 
 	rfs_dentry_put(rd_new);
@@ -129,7 +210,11 @@ struct rfs_dentry *rfs_dentry_add(struct dentry *dentry, struct rfs_info *rinfo)
 
 void rfs_dentry_del(struct rfs_dentry *rdentry)
 {
+	spin_lock(&rdentry->lock);
 	rdentry->dentry->d_op = rdentry->op_old;
+	rfs_hash_del_init(&rfs_dentry_hash, &rdentry->hash,
+			rdentry->dentry);
+	spin_unlock(&rdentry->lock);
 	rfs_dentry_put(rdentry);
 }
 
@@ -193,27 +278,36 @@ void rfs_dentry_rem_rinode(struct rfs_dentry *rdentry)
 
 struct rfs_info *rfs_dentry_get_rinfo(struct rfs_dentry *rdentry)
 {
-	struct rfs_info *rinfo;
-
-	spin_lock(&rdentry->lock);
-	rinfo = rfs_info_get(rdentry->rinfo);
-	spin_unlock(&rdentry->lock);
-
-	return rinfo;
+	return rfs_info_get_rcu(&rdentry->rinfo);
 }
 
 void rfs_dentry_set_rinfo(struct rfs_dentry *rdentry, struct rfs_info *rinfo)
 {
+	struct rfs_info *rinfo_old;
+	struct rfs_file *rfile;
+	long rfiles_nr = 0;
+
 	spin_lock(&rdentry->lock);
-	rfs_info_put(rdentry->rinfo);
-	rdentry->rinfo = rfs_info_get(rinfo);
+	rinfo_old = rdentry->rinfo;
+	rcu_assign_pointer(rdentry->rinfo, rfs_info_get(rinfo));
+
+	list_for_each_entry(rfile, &rdentry->rfiles, rdentry_list)
+		rfiles_nr++;
+
+	rfs_info_obj_add(rinfo_old, RFS_OBJ_DENTRY, -1);
+	rfs_info_obj_add(rinfo_old, RFS_OBJ_FILE, -rfiles_nr);
+	rfs_info_obj_add(rinfo, RFS_OBJ_DENTRY, 1);
+	rfs_info_obj_add(rinfo, RFS_OBJ_FILE, rfiles_nr);
 	spin_unlock(&rdentry->lock);
+
+	rfs_info_put(rinfo_old);
 }
 
 void rfs_dentry_add_rfile(struct rfs_dentry *rdentry, struct rfs_file *rfile)
 {
 	spin_lock(&rdentry->lock);
 	list_add_tail(&rfile->rdentry_list, &rdentry->rfiles);
+	rfs_info_obj_add(rdentry->rinfo, RFS_OBJ_FILE, 1);
 	spin_unlock(&rdentry->lock);
 	rfs_file_get(rfile);
 }
@@ -221,6 +315,8 @@ void rfs_dentry_add_rfile(struct rfs_dentry *rdentry, struct rfs_file *rfile)
 void rfs_dentry_rem_rfile(struct rfs_file *rfile)
 {
 	spin_lock(&rfile->rdentry->lock);
+	if (!list_empty(&rfile->rdentry_list))
+		rfs_info_obj_add(rfile->rdentry->rinfo, RFS_OBJ_FILE, -1);
 	list_del_init(&rfile->rdentry_list);
 	spin_unlock(&rfile->rdentry->lock);
 	rfs_file_put(rfile);
@@ -228,28 +324,132 @@ void rfs_dentry_rem_rfile(struct rfs_file *rfile)
 
 int rfs_dentry_cache_create(void)
 {
+	int rv;
+
+	rv = rfs_hash_init(&rfs_dentry_hash, 14);
+	if (rv)
+		return rv;
+
 	rfs_dentry_cache = rfs_kmem_cache_create("rfs_dentry_cache",
 			sizeof(struct rfs_dentry));
 
-	if (!rfs_dentry_cache)
+	if (!rfs_dentry_cache) {
+		rfs_hash_free(&rfs_dentry_hash);
 		return -ENOMEM;
+	}
 
 	return 0;
 }
 
 void rfs_dentry_cache_destory(void)
 {
+	rcu_barrier();
 	kmem_cache_destroy(rfs_dentry_cache);
+	rfs_hash_free(&rfs_dentry_hash);
+}
+
+#define RFS_DENTRY_RECLAIM_BATCH 16
+#define RFS_DENTRY_RECLAIM_SPAN 16
+
+static unsigned int rfs_dentry_reclaim_pos;
+
+/*
+ * The dentry stays alive while its rdentry is hashed, rfs_d_release takes
+ * rdentry->lock to unhash it. The inode is unused when its only dentry is.
+ */
+static int rfs_dentry_reclaim_one(struct rfs_dentry *rdentry)
+{
+	struct redirfs_data *datas[RFS_DATA_SLOTS];
+	struct rfs_inode *rinode = NULL;
+	int nr = 0;
+	int rv;
+
+	spin_lock(&rdentry->lock);
+	if (!hlist_unhashed(&rdentry->hash) &&
+	    !rfs_dentry_count(rdentry->dentry)) {
+		nr = rfs_data_slots_reclaim(&rdentry->data, datas);
+		rinode = rfs_inode_get(rdentry->rinode);
+	}
+	spin_unlock(&rdentry->lock);
+
+	rfs_data_reclaimed(datas, nr);
+	rv = nr;
+
+	if (!rinode)
+		return rv;
+
+	/* rdentries_nr is read without the mutex, it is only a hint. */
+	nr = 0;
+	spin_lock(&rinode->lock);
+	if (rinode->rdentries_nr == 1)
+		nr = rfs_data_slots_reclaim(&rinode->data, datas);
+	spin_unlock(&rinode->lock);
+
+	rfs_data_reclaimed(datas, nr);
+	rfs_inode_put(rinode);
+
+	return rv + nr;
+}
+
+/*
+ * Detach reclaimable data from unused dentries and inodes. The hash is
+ * scanned from the bucket where the previous call stopped and at most
+ * 1/RFS_DENTRY_RECLAIM_SPAN of it is visited per call. Returns the number
+ * of data released.
+ */
+unsigned long rfs_dentry_reclaim(unsigned long nr)
+{
+	struct rfs_dentry *batch[RFS_DENTRY_RECLAIM_BATCH];
+	struct rfs_dentry *rdentry;
+	struct hlist_node *pos;
+	unsigned long freed = 0;
+	unsigned int buckets = 1U << rfs_dentry_hash.bits;
+	unsigned int bucket;
+	unsigned int i;
+	int batch_nr;
+	int j;
+
+	for (i = 0; i < buckets / RFS_DENTRY_RECLAIM_SPAN && freed < nr; i++) {
+		bucket = rfs_dentry_reclaim_pos++ & (buckets - 1);
+		batch_nr = 0;
+
+		rcu_read_lock();
+		pos = rcu_dereference(rfs_dentry_hash.heads[bucket].first);
+		for (; pos && batch_nr < RFS_DENTRY_RECLAIM_BATCH;
+				pos = rcu_dereference(pos->next)) {
+			rdentry = hlist_entry(pos, struct rfs_dentry, hash);
+			if (atomic_inc_not_zero(&rdentry->count))
+				batch[batch_nr++] = rdentry;
+		}
+		rcu_read_unlock();
+
+		for (j = 0; j < batch_nr; j++) {
+			freed += rfs_dentry_reclaim_one(batch[j]);
+			rfs_dentry_put(batch[j]);
+		}
+	}
+
+	return freed;
 }
 
 void rfs_d_iput(struct dentry *dentry, struct inode *inode)
 {
+	const struct dentry_operations *op_old;
 	struct rfs_dentry *rdentry;
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
 
 	rdentry = rfs_dentry_find(dentry);
+	if (!rdentry) {
+		op_old = rfs_dentry_op_old(dentry);
+		if (op_old && op_old->d_iput)
+			op_old->d_iput(dentry, inode);
+		else
+			iput(inode);
+		return;
+	}
+
 	rinfo = rfs_dentry_get_rinfo(rdentry);
 	rfs_context_init(&rcont, 0);
 
@@ -290,12 +490,20 @@ void rfs_d_iput(struct dentry *dentry, struct inode *inode)
 
 static void rfs_d_release(struct dentry *dentry)
 {
+	const struct dentry_operations *op_old;
 	struct rfs_dentry *rdentry;
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
 
 	rdentry = rfs_dentry_find(dentry);
+	if (!rdentry) {
+		op_old = rfs_dentry_op_old(dentry);
+		if (op_old && op_old->d_release)
+			op_old->d_release(dentry);
+		return;
+	}
+
 	rinfo = rfs_dentry_get_rinfo(rdentry);
 	rfs_context_init(&rcont, 0);
 	rargs.type.id = REDIRFS_NONE_DOP_D_RELEASE;
@@ -330,14 +538,22 @@ static inline int rfs_d_compare_default(const struct qstr *name1,
 static int rfs_d_compare(struct dentry *dentry, struct qstr *name1,
 		struct qstr *name2)
 {
+	const struct dentry_operations *op_old;
 	struct rfs_dentry *rdentry;
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
 
 	rdentry = rfs_dentry_find(dentry);
+	if (!rdentry) {
+		op_old = rfs_dentry_op_old(dentry);
+		if (op_old && op_old->d_compare)
+			return op_old->d_compare(dentry, name1, name2);
+
+		return rfs_d_compare_default(name1, name2);
+	}
+
 	rinfo = rfs_dentry_get_rinfo(rdentry);
-	rfs_context_init(&rcont, 0);
 
 	if (dentry->d_inode) {
 		if (S_ISREG(dentry->d_inode->i_mode))
@@ -357,6 +573,17 @@ static int rfs_d_compare(struct dentry *dentry, struct qstr *name1,
 	} else
 		rargs.type.id = REDIRFS_NONE_DOP_D_COMPARE;
 
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		if (rdentry->op_old && rdentry->op_old->d_compare)
+			rargs.rv.rv_int = rdentry->op_old->d_compare(dentry,
+					name1, name2);
+		else
+			rargs.rv.rv_int = rfs_d_compare_default(name1, name2);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
 	rargs.args.d_compare.dentry = dentry;
 	rargs.args.d_compare.name1 = name1;
 	rargs.args.d_compare.name2 = name2;
@@ -375,7 +602,7 @@ static int rfs_d_compare(struct dentry *dentry, struct qstr *name1,
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
+exit:
 	rfs_dentry_put(rdentry);
 	rfs_info_put(rinfo);
 
@@ -389,14 +616,23 @@ static int rfs_d_compare(const struct dentry *parent, const struct inode *inode,
 		unsigned int tlen, const char *tname,
 		const struct qstr *name)
 {
+	const struct dentry_operations *op_old;
 	struct rfs_dentry *rdentry;
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
 
 	rdentry = rfs_dentry_find(dentry);
+	if (!rdentry) {
+		op_old = rfs_dentry_op_old(dentry);
+		if (op_old && op_old->d_compare)
+			return op_old->d_compare(parent, inode, dentry, d_inode,
+					tlen, tname, name);
+
+		return rfs_d_compare_default(&dentry->d_name, name);
+	}
+
 	rinfo = rfs_dentry_get_rinfo(rdentry);
-	rfs_context_init(&rcont, 0);
 
 	if (dentry->d_inode) {
 		if (S_ISREG(dentry->d_inode->i_mode))
@@ -416,6 +652,19 @@ static int rfs_d_compare(const struct dentry *parent, const struct inode *inode,
 	} else
 		rargs.type.id = REDIRFS_NONE_DOP_D_COMPARE;
 
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		if (rdentry->op_old && rdentry->op_old->d_compare)
+			rargs.rv.rv_int = rdentry->op_old->d_compare(parent,
+					inode, dentry, d_inode, tlen, tname,
+					name);
+		else
+			rargs.rv.rv_int = rfs_d_compare_default(
+					&dentry->d_name, name);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
 	rargs.args.d_compare.parent = parent;
 	rargs.args.d_compare.inode = inode;
 	rargs.args.d_compare.dentry = dentry;
@@ -442,7 +691,7 @@ static int rfs_d_compare(const struct dentry *parent, const struct inode *inode,
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
+exit:
 	rfs_dentry_put(rdentry);
 	rfs_info_put(rinfo);
 
@@ -451,16 +700,83 @@ static int rfs_d_compare(const struct dentry *parent, const struct inode *inode,
 
 #endif
 
+/*
+ * File systems which create dentries only through ->lookup, ->create and
+ * the like. Others, e.g. nfs with readdirplus or fuse, instantiate children
+ * in readdir, so they could appear after the first readdir without any rfs
+ * operations and opens on them would bypass the filters. The lazy mode is
+ * ignored on them and every readdir scans the cached children.
+ */
+static const char *rfs_dentry_lazy_fs[] = {
+	"ext2",
+	"ext3",
+	"ext4",
+	"xfs",
+	"btrfs",
+	"jfs",
+	"reiserfs",
+	"vfat",
+	"msdos",
+	"tmpfs",
+	NULL
+};
+
+int rfs_dentry_lazy(struct super_block *sb)
+{
+	int i;
+
+	if (!rfs_lazy_attach)
+		return 0;
+
+	for (i = 0; rfs_dentry_lazy_fs[i]; i++) {
+		if (!strcmp(sb->s_type->name, rfs_dentry_lazy_fs[i]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The dentry got its inode without going through our inode operations, e.g.
+ * the filesystem instantiated it from readdir. Attach the inode now that the
+ * dentry is used.
+ */
+static void rfs_dentry_attach_lazy(struct rfs_dentry *rdentry,
+		struct rfs_info *rinfo, struct nameidata *nd)
+{
+#ifdef LOOKUP_RCU
+	if (nd && nd->flags & LOOKUP_RCU)
+		return;
+#endif
+	if (rinfo == rfs_info_none)
+		return;
+
+	/* On failure the dentry stays without an rinode until the next try. */
+	rfs_dcache_rdentry_add(rdentry->dentry, rinfo);
+}
+
 static int rfs_d_revalidate(struct dentry *dentry, struct nameidata *nd)
 {
+	const struct dentry_operations *op_old;
 	struct rfs_dentry *rdentry;
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
 
 	rdentry = rfs_dentry_find(dentry);
+	if (!rdentry) {
+		op_old = rfs_dentry_op_old(dentry);
+		if (op_old && op_old->d_revalidate)
+			return op_old->d_revalidate(dentry, nd);
+
+		return 1;
+	}
+
 	rinfo = rfs_dentry_get_rinfo(rdentry);
-	rfs_context_init(&rcont, 0);
+
+	if (dentry->d_inode && !rdentry->rinode &&
+			rfs_dentry_lazy(dentry->d_sb))
+		rfs_dentry_attach_lazy(rdentry, rinfo, nd);
 
 	if (dentry->d_inode) {
 		if (S_ISREG(dentry->d_inode->i_mode))
@@ -480,6 +796,17 @@ static int rfs_d_revalidate(struct dentry *dentry, struct nameidata *nd)
 	} else
 		rargs.type.id = REDIRFS_NONE_DOP_D_REVALIDATE;
 
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		if (rdentry->op_old && rdentry->op_old->d_revalidate)
+			rargs.rv.rv_int = rdentry->op_old->d_revalidate(dentry,
+					nd);
+		else
+			rargs.rv.rv_int = 1;
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
 	rargs.args.d_revalidate.dentry = dentry;
 	rargs.args.d_revalidate.nd = nd;
 
@@ -494,105 +821,137 @@ static int rfs_d_revalidate(struct dentry *dentry, struct nameidata *nd)
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
+exit:
 	rfs_dentry_put(rdentry);
 	rfs_info_put(rinfo);
 
 	return rargs.rv.rv_int;
 }
 
-static void rfs_dentry_set_ops_none(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_none(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_NONE_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_NONE_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_NONE_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_NONE_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_reg(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_reg(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_REG_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_REG_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_REG_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_REG_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_dir(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_dir(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_DIR_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_DIR_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_DIR_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_DIR_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_lnk(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_lnk(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_LNK_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_LNK_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_LNK_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_LNK_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_chr(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_chr(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_CHR_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_CHR_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_CHR_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_CHR_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_blk(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_blk(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_BLK_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_BLK_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_BLK_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_BLK_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_fifo(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_fifo(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_FIFO_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_FIFO_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_FIFO_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_FIFO_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_sock(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_sock(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_SOCK_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_SOCK_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_SOCK_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_SOCK_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-void rfs_dentry_set_ops(struct rfs_dentry *rdentry)
+/*
+ * Files whose operations cannot be updated keep their current ones, the
+ * first error is returned.
+ */
+int rfs_dentry_set_ops(struct rfs_dentry *rdentry)
 {
+	struct dentry_operations op_new;
 	struct rfs_file *rfile;
 	umode_t mode;
+	int rv = 0;
+	int err;
 
 	spin_lock(&rdentry->lock);
 
-	rdentry->op_new.d_release = rfs_d_release;
+	rfs_dentry_init_ops(rdentry, &op_new);
+	op_new.d_release = rfs_d_release;
 
 	if (!rdentry->rinode) {
-		rfs_dentry_set_ops_none(rdentry);
+		rfs_dentry_set_ops_none(rdentry, &op_new);
+		if (rfs_dentry_lazy(rdentry->dentry->d_sb))
+			op_new.d_revalidate = rfs_d_revalidate;
+		rfs_dentry_set_optbl(rdentry, &op_new);
 		spin_unlock(&rdentry->lock);
-		return;
+		return 0;
 	}
 
 	list_for_each_entry(rfile, &rdentry->rfiles, rdentry_list) {
-		rfs_file_set_ops(rfile);
+		err = rfs_file_set_ops(rfile);
+		if (err && !rv)
+			rv = err;
 	}
 
 	mode = rdentry->rinode->inode->i_mode;
 
 	if (S_ISREG(mode))
-		rfs_dentry_set_ops_reg(rdentry);
+		rfs_dentry_set_ops_reg(rdentry, &op_new);
 
 	else if (S_ISDIR(mode))
-		rfs_dentry_set_ops_dir(rdentry);
+		rfs_dentry_set_ops_dir(rdentry, &op_new);
 
 	else if (S_ISLNK(mode))
-		rfs_dentry_set_ops_lnk(rdentry);
+		rfs_dentry_set_ops_lnk(rdentry, &op_new);
 
 	else if (S_ISCHR(mode))
-		rfs_dentry_set_ops_chr(rdentry);
+		rfs_dentry_set_ops_chr(rdentry, &op_new);
 
 	else if (S_ISBLK(mode))
-		rfs_dentry_set_ops_blk(rdentry);
+		rfs_dentry_set_ops_blk(rdentry, &op_new);
 
 	else if (S_ISFIFO(mode))
-		rfs_dentry_set_ops_fifo(rdentry);
+		rfs_dentry_set_ops_fifo(rdentry, &op_new);
 
 	else if (S_ISSOCK(mode))
-		rfs_dentry_set_ops_sock(rdentry);
+		rfs_dentry_set_ops_sock(rdentry, &op_new);
 
+	rfs_dentry_set_optbl(rdentry, &op_new);
 	spin_unlock(&rdentry->lock);
 	rfs_inode_set_ops(rdentry->rinode);
+
+	return rv;
 }
 
 void rfs_dentry_rem_data(struct dentry *dentry, struct rfs_flt *rflt)
@@ -613,13 +972,13 @@ void rfs_dentry_rem_data(struct dentry *dentry, struct rfs_flt *rflt)
 	spin_lock(&rdentry->lock);
 
 	list_for_each_entry(rfile, &rdentry->rfiles, rdentry_list) {
-		/* If container_of(rfile->file->f_op, struct rfs_file, op_new) != rfile,
-		 * the file is no longer associated with this rfile. Something is
-		 * seriously wrong - perhaps the file was released but rfs_release
-		 * was not called? */
+		/* If rfile->file->f_op is not the rfile's table, the file is no
+		 * longer associated with this rfile. Something is seriously
+		 * wrong - perhaps the file was released but rfs_release was not
+		 * called? */
 		BUG_ON(rfile->file &&
 		       rfile->file->f_op &&
-		       container_of(rfile->file->f_op, struct rfs_file, op_new) != rfile);
+		       rfile->file->f_op != rfs_optbl_ops(rfile->optbl));
 		data = redirfs_detach_data_file(rflt, rfile->file);
 		if (data && data->detach)
 			data->detach(data);
@@ -24,6 +24,7 @@
 #include "rfs.h"
 
 static rfs_kmem_cache_t *rfs_file_cache = NULL;
+static struct rfs_hash rfs_file_hash;
 
 struct file_operations rfs_file_ops = {
 	.open = rfs_open
@@ -38,21 +39,73 @@ static struct rfs_file *rfs_file_alloc(struct file *file)
 		return ERR_PTR(-ENOMEM);
 
 	INIT_LIST_HEAD(&rfile->rdentry_list);
-	INIT_LIST_HEAD(&rfile->data);
+	INIT_HLIST_NODE(&rfile->hash);
+	rfs_data_slots_init(&rfile->data, 0);
 	rfile->file = file;
 	spin_lock_init(&rfile->lock);
 	atomic_set(&rfile->count, 1);
 	rfile->op_old = fops_get(file->f_op);
+	rfs_obj_add(RFS_OBJ_FILE, 1);
 
-	if (rfile->op_old)
-		memcpy(&rfile->op_new, rfile->op_old,
-				sizeof(struct file_operations));
+	return rfile;
+}
+
+struct rfs_file *rfs_file_find(struct file *file)
+{
+	struct rfs_file *rfile = NULL;
+	struct hlist_node *pos;
+
+	if (!file || !file->f_op || file->f_op->open != rfs_open)
+		return NULL;
+
+	rcu_read_lock();
+	rfs_hash_for_each_rcu(pos, &rfs_file_hash, file) {
+		rfile = hlist_entry(pos, struct rfs_file, hash);
+		if (rfile->file == file && atomic_inc_not_zero(&rfile->count))
+			break;
 
-	rfile->op_new.open = rfs_open;
+		rfile = NULL;
+	}
+	rcu_read_unlock();
 
 	return rfile;
 }
 
+static void rfs_file_init_ops(struct rfs_file *rfile,
+		struct file_operations *op_new)
+{
+	if (rfile->op_old)
+		memcpy(op_new, rfile->op_old, sizeof(struct file_operations));
+	else
+		memset(op_new, 0, sizeof(struct file_operations));
+
+	op_new->open = rfs_open;
+}
+
+/*
+ * Switch the file to the shared table matching op_new. Called with
+ * rdentry->lock held. If no table can be allocated the file keeps its
+ * current operations and the error is returned.
+ */
+static int rfs_file_set_optbl(struct rfs_file *rfile,
+		struct file_operations *op_new)
+{
+	struct rfs_optbl *optbl;
+
+	if (rfile->file->f_op != rfs_optbl_ops(rfile->optbl))
+		return 0;
+
+	optbl = rfs_optbl_add(&rfs_optbl_fops, rfile->op_old, op_new);
+	if (IS_ERR(optbl))
+		return PTR_ERR(optbl);
+
+	rfile->file->f_op = rfs_optbl_ops(optbl);
+	rfs_optbl_put(rfile->optbl);
+	rfile->optbl = optbl;
+
+	return 0;
+}
+
 struct rfs_file *rfs_file_get(struct rfs_file *rfile)
 {
 	if (!rfile || IS_ERR(rfile))
@@ -64,6 +117,12 @@ struct rfs_file *rfs_file_get(struct rfs_file *rfile)
 	return rfile;
 }
 
+static void rfs_file_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(rfs_file_cache,
+			container_of(head, struct rfs_file, rcu));
+}
+
 void rfs_file_put(struct rfs_file *rfile)
 {
 	if (!rfile || IS_ERR(rfile))
@@ -76,60 +135,113 @@ void rfs_file_put(struct rfs_file *rfile)
 	rfs_dentry_put(rfile->rdentry);
 	fops_put(rfile->op_old);
 
-	rfs_data_remove(&rfile->data);
-	kmem_cache_free(rfs_file_cache, rfile);
+	rfs_data_slots_remove(&rfile->data);
+	rfs_optbl_put(rfile->optbl);
+	rfs_obj_add(RFS_OBJ_FILE, -1);
+	call_rcu(&rfile->rcu, rfs_file_free_rcu);
+}
+
+static void rfs_file_del(struct rfs_file *rfile)
+{
+	rfs_dentry_rem_rfile(rfile);
+	rfile->file->f_op = fops_get(rfile->op_old);
+	rfs_hash_del(&rfs_file_hash, &rfile->hash, rfile->file);
+	rfs_file_put(rfile);
 }
 
 static struct rfs_file *rfs_file_add(struct file *file)
 {
+	struct file_operations op_new;
+	struct rfs_optbl *optbl;
 	struct rfs_file *rfile;
+	int rv;
 
 	rfile = rfs_file_alloc(file);
 	if (IS_ERR(rfile))
 		return rfile;
 
+	rfs_file_init_ops(rfile, &op_new);
+	optbl = rfs_optbl_add(&rfs_optbl_fops, rfile->op_old, &op_new);
+	if (IS_ERR(optbl)) {
+		rfs_file_put(rfile);
+		return (struct rfs_file *)optbl;
+	}
+
+	rfile->optbl = optbl;
+
 	rfile->rdentry = rfs_dentry_find(file->f_dentry);
 	fops_put(file->f_op);
-	file->f_op = &rfile->op_new;
+	file->f_op = rfs_optbl_ops(rfile->optbl);
+	rfs_hash_add(&rfs_file_hash, &rfile->hash, file);
 	rfs_file_get(rfile);
 	/* Once the rfile is in the rdentry's list, rfs_dentry_rem_rdata will
-	 * require that file->f_op is set to rfile->op_new. Therefore, file->f_op
-	 * must be set before the call to rfs_dentry_add_rfile.
+	 * require that file->f_op is set to rfile's table. Therefore,
+	 * file->f_op must be set before the call to rfs_dentry_add_rfile.
 	 */
 	rfs_dentry_add_rfile(rfile->rdentry, rfile);
 	spin_lock(&rfile->rdentry->lock);
-	rfs_file_set_ops(rfile);
+	rv = rfs_file_set_ops(rfile);
 	spin_unlock(&rfile->rdentry->lock);
 
+	if (rv) {
+		rfs_file_del(rfile);
+		rfs_file_put(rfile);
+		return ERR_PTR(rv);
+	}
+
 	return rfile;
 }
 
-static void rfs_file_del(struct rfs_file *rfile)
+/*
+ * The file system already opened the file. If it cannot be redirected, it
+ * is released again and the open fails.
+ */
+static int rfs_file_add_opened(struct rfs_inode *rinode, struct inode *inode,
+		struct file *file)
 {
-	rfs_dentry_rem_rfile(rfile);
-	rfile->file->f_op = fops_get(rfile->op_old);
+	struct rfs_file *rfile;
+
+	rfile = rfs_file_add(file);
+	if (IS_ERR(rfile)) {
+		if (rinode->fop_old && rinode->fop_old->release)
+			rinode->fop_old->release(inode, file);
+
+		return PTR_ERR(rfile);
+	}
+
 	rfs_file_put(rfile);
+
+	return 0;
 }
 
 int rfs_file_cache_create(void)
 {
+	int rv;
+
+	rv = rfs_hash_init(&rfs_file_hash, 18);
+	if (rv)
+		return rv;
+
 	rfs_file_cache = rfs_kmem_cache_create("rfs_file_cache",
 			sizeof(struct rfs_file));
 
-	if (!rfs_file_cache)
+	if (!rfs_file_cache) {
+		rfs_hash_free(&rfs_file_hash);
 		return -ENOMEM;
+	}
 
 	return 0;
 }
 
 void rfs_file_cache_destory(void)
 {
+	rcu_barrier();
 	kmem_cache_destroy(rfs_file_cache);
+	rfs_hash_free(&rfs_file_hash);
 }
 
 int rfs_open(struct inode *inode, struct file *file)
 {
-	struct rfs_file *rfile;
 	struct rfs_dentry *rdentry;
 	struct rfs_inode *rinode;
 	struct rfs_info *rinfo;
@@ -151,7 +263,6 @@ int rfs_open(struct inode *inode, struct file *file)
 
 	rinfo = rfs_dentry_get_rinfo(rdentry);
 	rfs_dentry_put(rdentry);
-	rfs_context_init(&rcont, 0);
 
 	if (S_ISREG(inode->i_mode))
 		rargs.type.id = REDIRFS_REG_FOP_OPEN;
@@ -166,6 +277,20 @@ int rfs_open(struct inode *inode, struct file *file)
 	else if (S_ISFIFO(inode->i_mode))
 		rargs.type.id = REDIRFS_FIFO_FOP_OPEN;
 
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		if (rinode->fop_old && rinode->fop_old->open)
+			rargs.rv.rv_int = rinode->fop_old->open(inode, file);
+		else
+			rargs.rv.rv_int = 0;
+
+		if (!rargs.rv.rv_int)
+			rargs.rv.rv_int = rfs_file_add_opened(rinode, inode,
+					file);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
 	rargs.args.f_open.inode = inode;
 	rargs.args.f_open.file = file;
 
@@ -178,16 +303,12 @@ int rfs_open(struct inode *inode, struct file *file)
 			rargs.rv.rv_int = 0;
 	}
 
-	if (!rargs.rv.rv_int) {
-		rfile = rfs_file_add(file);
-		if (IS_ERR(rfile))
-			BUG();
-		rfs_file_put(rfile);
-	}
+	if (!rargs.rv.rv_int)
+		rargs.rv.rv_int = rfs_file_add_opened(rinode, inode, file);
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
+exit:
 	rfs_inode_put(rinode);
 	rfs_info_put(rinfo);
 	return rargs.rv.rv_int;
@@ -274,6 +395,14 @@ static int rfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 	if (rargs.rv.rv_int)
 		goto exit;
 
+	/* In the lazy mode children are attached by rfs_lookup and
+	 * rfs_d_revalidate when they are used. Children which are already in
+	 * the dcache are attached by the first readdir only. */
+	if (rfs_dentry_lazy(file->f_dentry->d_sb) &&
+			test_and_set_bit(RFS_DENTRY_SUBS_WALKED,
+				&rfile->rdentry->flags))
+		goto exit;
+
 	if (rfs_dcache_get_subs(file->f_dentry, &sibs)) {
 		BUG();
 		goto exit;
@@ -306,60 +435,704 @@ exit:
 	return rargs.rv.rv_int;
 }
 
-static void rfs_file_set_ops_reg(struct rfs_file *rfile)
+static loff_t rfs_llseek(struct file *file, loff_t offset, int origin)
 {
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = file->f_dentry->d_inode->i_mode;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_FOP_LLSEEK;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_FOP_LLSEEK;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_FOP_LLSEEK;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_FOP_LLSEEK;
+	else
+		rargs.type.id = REDIRFS_FIFO_FOP_LLSEEK;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_loff = rfile->op_old->llseek(file, offset, origin);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.f_llseek.file = file;
+	rargs.args.f_llseek.offset = offset;
+	rargs.args.f_llseek.origin = origin;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_loff = rfile->op_old->llseek(
+				rargs.args.f_llseek.file,
+				rargs.args.f_llseek.offset,
+				rargs.args.f_llseek.origin);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_loff;
 }
 
-static void rfs_file_set_ops_dir(struct rfs_file *rfile)
+/*
+ * The user buffers and iovecs are handed to the filters and to the original
+ * operation as they are, nothing is copied. A filter which wants to look at
+ * the data has to use copy_from_user/copy_to_user itself.
+ */
+static ssize_t rfs_read(struct file *file, char __user *buf, size_t count,
+		loff_t *pos)
 {
-	rfile->op_new.readdir = rfs_readdir;
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = file->f_dentry->d_inode->i_mode;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_FOP_READ;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_FOP_READ;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_FOP_READ;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_FOP_READ;
+	else
+		rargs.type.id = REDIRFS_FIFO_FOP_READ;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_ssize = rfile->op_old->read(file, buf, count, pos);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.f_read.file = file;
+	rargs.args.f_read.buf = buf;
+	rargs.args.f_read.count = count;
+	rargs.args.f_read.pos = pos;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_ssize = rfile->op_old->read(
+				rargs.args.f_read.file,
+				rargs.args.f_read.buf,
+				rargs.args.f_read.count,
+				rargs.args.f_read.pos);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_ssize;
 }
 
-static void rfs_file_set_ops_lnk(struct rfs_file *rfile)
+static ssize_t rfs_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *pos)
 {
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = file->f_dentry->d_inode->i_mode;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_FOP_WRITE;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_FOP_WRITE;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_FOP_WRITE;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_FOP_WRITE;
+	else
+		rargs.type.id = REDIRFS_FIFO_FOP_WRITE;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_ssize = rfile->op_old->write(file, buf, count, pos);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.f_write.file = file;
+	rargs.args.f_write.buf = buf;
+	rargs.args.f_write.count = count;
+	rargs.args.f_write.pos = pos;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_ssize = rfile->op_old->write(
+				rargs.args.f_write.file,
+				rargs.args.f_write.buf,
+				rargs.args.f_write.count,
+				rargs.args.f_write.pos);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_ssize;
 }
 
-static void rfs_file_set_ops_chr(struct rfs_file *rfile)
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
+
+static ssize_t rfs_aio_read(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
 {
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = iocb->ki_filp->f_dentry->d_inode->i_mode;
+
+	rfile = rfs_file_find(iocb->ki_filp);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_FOP_AIO_READ;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_FOP_AIO_READ;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_FOP_AIO_READ;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_FOP_AIO_READ;
+	else
+		rargs.type.id = REDIRFS_FIFO_FOP_AIO_READ;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_ssize = rfile->op_old->aio_read(iocb, iov, nr_segs,
+				pos);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.f_aio_read.iocb = iocb;
+	rargs.args.f_aio_read.iov = iov;
+	rargs.args.f_aio_read.nr_segs = nr_segs;
+	rargs.args.f_aio_read.pos = pos;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_ssize = rfile->op_old->aio_read(
+				rargs.args.f_aio_read.iocb,
+				rargs.args.f_aio_read.iov,
+				rargs.args.f_aio_read.nr_segs,
+				rargs.args.f_aio_read.pos);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_ssize;
 }
 
-static void rfs_file_set_ops_blk(struct rfs_file *rfile)
+static ssize_t rfs_aio_write(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
 {
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = iocb->ki_filp->f_dentry->d_inode->i_mode;
+
+	rfile = rfs_file_find(iocb->ki_filp);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_FOP_AIO_WRITE;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_FOP_AIO_WRITE;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_FOP_AIO_WRITE;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_FOP_AIO_WRITE;
+	else
+		rargs.type.id = REDIRFS_FIFO_FOP_AIO_WRITE;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_ssize = rfile->op_old->aio_write(iocb, iov,
+				nr_segs, pos);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.f_aio_write.iocb = iocb;
+	rargs.args.f_aio_write.iov = iov;
+	rargs.args.f_aio_write.nr_segs = nr_segs;
+	rargs.args.f_aio_write.pos = pos;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_ssize = rfile->op_old->aio_write(
+				rargs.args.f_aio_write.iocb,
+				rargs.args.f_aio_write.iov,
+				rargs.args.f_aio_write.nr_segs,
+				rargs.args.f_aio_write.pos);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_ssize;
 }
 
-static void rfs_file_set_ops_fifo(struct rfs_file *rfile)
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17))
+
+/*
+ * Only the pipe, the position and the length are passed to the filters, the
+ * pages are moved by the original operation so splice stays zero-copy.
+ */
+static ssize_t rfs_splice_read(struct file *file, loff_t *pos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
 {
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = file->f_dentry->d_inode->i_mode;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_FOP_SPLICE_READ;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_FOP_SPLICE_READ;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_FOP_SPLICE_READ;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_FOP_SPLICE_READ;
+	else
+		rargs.type.id = REDIRFS_FIFO_FOP_SPLICE_READ;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_ssize = rfile->op_old->splice_read(file, pos, pipe,
+				len, flags);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.f_splice_read.file = file;
+	rargs.args.f_splice_read.pos = pos;
+	rargs.args.f_splice_read.pipe = pipe;
+	rargs.args.f_splice_read.len = len;
+	rargs.args.f_splice_read.flags = flags;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_ssize = rfile->op_old->splice_read(
+				rargs.args.f_splice_read.file,
+				rargs.args.f_splice_read.pos,
+				rargs.args.f_splice_read.pipe,
+				rargs.args.f_splice_read.len,
+				rargs.args.f_splice_read.flags);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_ssize;
 }
 
-void rfs_file_set_ops(struct rfs_file *rfile)
+static ssize_t rfs_splice_write(struct pipe_inode_info *pipe,
+		struct file *file, loff_t *pos, size_t len, unsigned int flags)
 {
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = file->f_dentry->d_inode->i_mode;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_FOP_SPLICE_WRITE;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_FOP_SPLICE_WRITE;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_FOP_SPLICE_WRITE;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_FOP_SPLICE_WRITE;
+	else
+		rargs.type.id = REDIRFS_FIFO_FOP_SPLICE_WRITE;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_ssize = rfile->op_old->splice_write(pipe, file, pos,
+				len, flags);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.f_splice_write.pipe = pipe;
+	rargs.args.f_splice_write.file = file;
+	rargs.args.f_splice_write.pos = pos;
+	rargs.args.f_splice_write.len = len;
+	rargs.args.f_splice_write.flags = flags;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_ssize = rfile->op_old->splice_write(
+				rargs.args.f_splice_write.pipe,
+				rargs.args.f_splice_write.file,
+				rargs.args.f_splice_write.pos,
+				rargs.args.f_splice_write.len,
+				rargs.args.f_splice_write.flags);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_ssize;
+}
+
+#endif
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18))
+#define rfs_flush_old(rfile, rargs) \
+	(rfile)->op_old->flush((rargs)->args.f_flush.file)
+#else
+#define rfs_flush_old(rfile, rargs) \
+	(rfile)->op_old->flush((rargs)->args.f_flush.file, \
+			(rargs)->args.f_flush.id)
+#endif
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18))
+static int rfs_flush(struct file *file)
+#else
+static int rfs_flush(struct file *file, fl_owner_t id)
+#endif
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = file->f_dentry->d_inode->i_mode;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_FOP_FLUSH;
+	else if (S_ISDIR(mode))
+		rargs.type.id = REDIRFS_DIR_FOP_FLUSH;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_FOP_FLUSH;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_FOP_FLUSH;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_FOP_FLUSH;
+	else
+		rargs.type.id = REDIRFS_FIFO_FOP_FLUSH;
+
+	rargs.args.f_flush.file = file;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18))
+	rargs.args.f_flush.id = current->files;
+#else
+	rargs.args.f_flush.id = id;
+#endif
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rfs_flush_old(rfile, &rargs);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rfs_flush_old(rfile, &rargs);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35))
+#define rfs_fsync_old(rfile, rargs) \
+	(rfile)->op_old->fsync((rargs)->args.f_fsync.file, \
+			(rargs)->args.f_fsync.dentry, \
+			(rargs)->args.f_fsync.datasync)
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0))
+#define rfs_fsync_old(rfile, rargs) \
+	(rfile)->op_old->fsync((rargs)->args.f_fsync.file, \
+			(rargs)->args.f_fsync.datasync)
+#else
+#define rfs_fsync_old(rfile, rargs) \
+	(rfile)->op_old->fsync((rargs)->args.f_fsync.file, \
+			(rargs)->args.f_fsync.start, \
+			(rargs)->args.f_fsync.end, \
+			(rargs)->args.f_fsync.datasync)
+#endif
+
+/*
+ * fsync and fdatasync share the operation, fdatasync has datasync set.
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35))
+static int rfs_fsync(struct file *file, struct dentry *dentry, int datasync)
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0))
+static int rfs_fsync(struct file *file, int datasync)
+#else
+static int rfs_fsync(struct file *file, loff_t start, loff_t end,
+		int datasync)
+#endif
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = file->f_dentry->d_inode->i_mode;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_FOP_FSYNC;
+	else if (S_ISDIR(mode))
+		rargs.type.id = REDIRFS_DIR_FOP_FSYNC;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_FOP_FSYNC;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_FOP_FSYNC;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_FOP_FSYNC;
+	else
+		rargs.type.id = REDIRFS_FIFO_FOP_FSYNC;
+
+	rargs.args.f_fsync.file = file;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35))
+	rargs.args.f_fsync.dentry = dentry;
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(3,1,0))
+	rargs.args.f_fsync.start = start;
+	rargs.args.f_fsync.end = end;
+#endif
+	rargs.args.f_fsync.datasync = datasync;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rfs_fsync_old(rfile, &rargs);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rfs_fsync_old(rfile, &rargs);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+static int rfs_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rfile = rfs_file_find(file);
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+	rargs.type.id = REDIRFS_REG_FOP_MMAP;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rfile->op_old->mmap(file, vma);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.f_mmap.file = file;
+	rargs.args.f_mmap.vma = vma;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rfile->op_old->mmap(
+				rargs.args.f_mmap.file,
+				rargs.args.f_mmap.vma);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	if (!rargs.rv.rv_int)
+		rfs_vma_set_ops(vma, rinfo);
+
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+static void rfs_file_set_ops_reg(struct rfs_file *rfile,
+		struct file_operations *op_new)
+{
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_REG_FOP_LLSEEK, llseek);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_REG_FOP_READ, read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_REG_FOP_WRITE, write);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_REG_FOP_AIO_READ, aio_read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_REG_FOP_AIO_WRITE, aio_write);
+#endif
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_REG_FOP_FLUSH, flush);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_REG_FOP_FSYNC, fsync);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17))
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_REG_FOP_SPLICE_READ,
+			splice_read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_REG_FOP_SPLICE_WRITE,
+			splice_write);
+#endif
+
+	/* mmap is also needed to redirect the vm operations of the mapping */
+	if (rfile->op_old && rfile->op_old->mmap &&
+			rfs_vma_redirected(rfile->rdentry->rinfo))
+		RFS_ADD_OP((*op_new), mmap);
+	else
+		RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_REG_FOP_MMAP, mmap);
+}
+
+static void rfs_file_set_ops_dir(struct rfs_file *rfile,
+		struct file_operations *op_new)
+{
+	op_new->readdir = rfs_readdir;
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_DIR_FOP_FLUSH, flush);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_DIR_FOP_FSYNC, fsync);
+}
+
+static void rfs_file_set_ops_lnk(struct rfs_file *rfile,
+		struct file_operations *op_new)
+{
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_LNK_FOP_LLSEEK, llseek);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_LNK_FOP_READ, read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_LNK_FOP_WRITE, write);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_LNK_FOP_AIO_READ, aio_read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_LNK_FOP_AIO_WRITE, aio_write);
+#endif
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_LNK_FOP_FLUSH, flush);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_LNK_FOP_FSYNC, fsync);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17))
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_LNK_FOP_SPLICE_READ,
+			splice_read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_LNK_FOP_SPLICE_WRITE,
+			splice_write);
+#endif
+}
+
+static void rfs_file_set_ops_chr(struct rfs_file *rfile,
+		struct file_operations *op_new)
+{
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_CHR_FOP_LLSEEK, llseek);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_CHR_FOP_READ, read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_CHR_FOP_WRITE, write);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_CHR_FOP_AIO_READ, aio_read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_CHR_FOP_AIO_WRITE, aio_write);
+#endif
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_CHR_FOP_FLUSH, flush);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_CHR_FOP_FSYNC, fsync);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17))
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_CHR_FOP_SPLICE_READ,
+			splice_read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_CHR_FOP_SPLICE_WRITE,
+			splice_write);
+#endif
+}
+
+static void rfs_file_set_ops_blk(struct rfs_file *rfile,
+		struct file_operations *op_new)
+{
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_BLK_FOP_LLSEEK, llseek);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_BLK_FOP_READ, read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_BLK_FOP_WRITE, write);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_BLK_FOP_AIO_READ, aio_read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_BLK_FOP_AIO_WRITE, aio_write);
+#endif
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_BLK_FOP_FLUSH, flush);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_BLK_FOP_FSYNC, fsync);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17))
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_BLK_FOP_SPLICE_READ,
+			splice_read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_BLK_FOP_SPLICE_WRITE,
+			splice_write);
+#endif
+}
+
+static void rfs_file_set_ops_fifo(struct rfs_file *rfile,
+		struct file_operations *op_new)
+{
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_FIFO_FOP_LLSEEK, llseek);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_FIFO_FOP_READ, read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_FIFO_FOP_WRITE, write);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_FIFO_FOP_AIO_READ, aio_read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_FIFO_FOP_AIO_WRITE, aio_write);
+#endif
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_FIFO_FOP_FLUSH, flush);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_FIFO_FOP_FSYNC, fsync);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17))
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_FIFO_FOP_SPLICE_READ,
+			splice_read);
+	RFS_SET_FOP_OLD(rfile, op_new, REDIRFS_FIFO_FOP_SPLICE_WRITE,
+			splice_write);
+#endif
+}
+
+int rfs_file_set_ops(struct rfs_file *rfile)
+{
+	struct file_operations op_new;
 	umode_t mode;
 
-	/* Set op_new.release so the rfile is always cleaned up when the file is
+	rfs_file_init_ops(rfile, &op_new);
+
+	/* Set release so the rfile is always cleaned up when the file is
 	 * released. */
-	rfile->op_new.release = rfs_release;
+	op_new.release = rfs_release;
 
 	if (!rfile->rdentry->rinode)
-		return;
+		return rfs_file_set_optbl(rfile, &op_new);
 
 	mode = rfile->rdentry->rinode->inode->i_mode;
 
 	if (S_ISREG(mode))
-		rfs_file_set_ops_reg(rfile);
+		rfs_file_set_ops_reg(rfile, &op_new);
 
 	else if (S_ISDIR(mode))
-		rfs_file_set_ops_dir(rfile);
+		rfs_file_set_ops_dir(rfile, &op_new);
 
 	else if (S_ISLNK(mode))
-		rfs_file_set_ops_lnk(rfile);
+		rfs_file_set_ops_lnk(rfile, &op_new);
 
 	else if (S_ISCHR(mode))
-		rfs_file_set_ops_chr(rfile);
+		rfs_file_set_ops_chr(rfile, &op_new);
 
 	else if (S_ISBLK(mode))
-		rfs_file_set_ops_blk(rfile);
+		rfs_file_set_ops_blk(rfile, &op_new);
 
 	else if (S_ISFIFO(mode))
-		rfs_file_set_ops_fifo(rfile);
+		rfs_file_set_ops_fifo(rfile, &op_new);
+
+	return rfs_file_set_optbl(rfile, &op_new);
 }
 
@@ -25,6 +25,7 @@
 
 static LIST_HEAD(rfs_flt_list);
 RFS_DEFINE_MUTEX(rfs_flt_list_mutex);
+static DECLARE_BITMAP(rfs_flt_slots, RFS_DATA_SLOTS);
 
 struct rfs_flt *rfs_flt_alloc(struct redirfs_filter_info *flt_info)
 {
@@ -45,13 +46,24 @@ struct rfs_flt *rfs_flt_alloc(struct redirfs_filter_info *flt_info)
 		return ERR_PTR(-ENOMEM);
 	}
 
+	rflt->slot = find_first_zero_bit(rfs_flt_slots, RFS_DATA_SLOTS);
+	if (rflt->slot >= RFS_DATA_SLOTS) {
+		kfree(rflt);
+		kfree(name);
+		return ERR_PTR(-ENOSPC);
+	}
+
+	set_bit(rflt->slot, rfs_flt_slots);
+
 	INIT_LIST_HEAD(&rflt->list);
 	rflt->name = name;
 	rflt->priority = flt_info->priority;
 	rflt->owner = flt_info->owner;
 	rflt->ops = flt_info->ops;
-	atomic_set(&rflt->count, 1);
+	rfs_ref_init(&rflt->ref);
 	spin_lock_init(&rflt->lock);
+	atomic_long_set(&rflt->reclaimed, 0);
+	atomic_long_set(&rflt->data_nr, 0);
 	try_module_get(rflt->owner);
 
 	if (flt_info->active)
@@ -67,8 +79,7 @@ struct rfs_flt *rfs_flt_get(struct rfs_flt *rflt)
 	if (!rflt || IS_ERR(rflt))
 		return NULL;
 
-	BUG_ON(!atomic_read(&rflt->count));
-	atomic_inc(&rflt->count);
+	rfs_ref_get(&rflt->ref);
 
 	return rflt;
 }
@@ -78,10 +89,11 @@ void rfs_flt_put(struct rfs_flt *rflt)
 	if (!rflt || IS_ERR(rflt))
 		return;
 
-	BUG_ON(!atomic_read(&rflt->count));
-	if (!atomic_dec_and_test(&rflt->count))
+	if (!rfs_ref_put(&rflt->ref))
 		return;
 
+	rfs_stats_free(rflt->stats);
+	clear_bit(rflt->slot, rfs_flt_slots);
 	kfree(rflt->name);
 	kfree(rflt);
 }
@@ -108,6 +120,26 @@ static int rfs_flt_exist(const char *name, int priority)
 	return 0;
 }
 
+int rfs_flt_get_objs_info(char *buf, int size)
+{
+	struct rfs_flt *rflt;
+	int len = 0;
+
+	rfs_mutex_lock(&rfs_flt_list_mutex);
+
+	list_for_each_entry(rflt, &rfs_flt_list, list) {
+		len += rfs_objs_get_flt_info(rflt, buf + len, size - len);
+		if (len >= size) {
+			len = size;
+			break;
+		}
+	}
+
+	rfs_mutex_unlock(&rfs_flt_list_mutex);
+
+	return len;
+}
+
 redirfs_filter redirfs_register_filter(struct redirfs_filter_info *info)
 {
 	struct rfs_flt *rflt;
@@ -140,6 +172,7 @@ redirfs_filter redirfs_register_filter(struct redirfs_filter_info *info)
 
 	list_add_tail(&rflt->list, &rfs_flt_list);
 	rfs_flt_get(rflt);
+	rfs_ref_percpu(&rflt->ref);
 
 	rfs_mutex_unlock(&rfs_flt_list_mutex);
 
@@ -155,12 +188,30 @@ int redirfs_unregister_filter(redirfs_filter filter)
 	if (!rflt || IS_ERR(rflt))
 		return -EINVAL;
 
+	/*
+	 * Queued path registrations, deferred post callbacks, retired infos
+	 * and data waiting for a grace period hold a filter reference until
+	 * they finish.
+	 */
+	rfs_async_flush(rflt);
+	rfs_defer_flush();
+	rfs_info_retire_flush();
+	rcu_barrier();
+	rfs_data_free_flush();
+
+	/*
+	 * The reference counter has to be exact for the checks below. Once
+	 * switched to atomic mode it stays there even if the filter turns
+	 * out to be busy.
+	 */
+	rfs_ref_atomic(&rflt->ref);
+
 	spin_lock(&rflt->lock);
 
 	/*
 	 * Check if the unregistration is already in progress.
 	 */
-	if (atomic_read(&rflt->count) < 3) {
+	if (rfs_ref_read(&rflt->ref) < 3) {
 		spin_unlock(&rflt->lock);
 		return 0;
 	}
@@ -173,7 +224,7 @@ int redirfs_unregister_filter(redirfs_filter filter)
 	 *    - internal filter list
 	 *    - handler returned to filter after registration
 	 */
-	if (atomic_read(&rflt->count) != 3) {
+	if (rfs_ref_read(&rflt->ref) != 3) {
 		spin_unlock(&rflt->lock);
 		return -EBUSY;
 	}
@@ -185,6 +236,9 @@ int redirfs_unregister_filter(redirfs_filter filter)
 	list_del_init(&rflt->list);
 	rfs_mutex_unlock(&rfs_flt_list_mutex);
 
+	rfs_flt_sysfs_stats_exit(rflt);
+	rfs_stats_disable(rflt);
+
 	module_put(rflt->owner);
 
 	return 0;
@@ -197,7 +251,13 @@ void redirfs_delete_filter(redirfs_filter filter)
 	if (!rflt || IS_ERR(rflt))
 		return;
 
-	BUG_ON(atomic_read(&rflt->count) != 2);
+	/*
+	 * Wait for the data free callbacks, they call into the filter module.
+	 */
+	rcu_barrier();
+	rfs_data_free_flush();
+
+	BUG_ON(rfs_ref_read(&rflt->ref) != 2);
 
 	rfs_flt_sysfs_exit(rflt);
 	rfs_flt_put(rflt);
@@ -223,8 +283,8 @@ static int rfs_flt_set_ops(struct rfs_flt *rflt)
 			return rv;
 		}
 
-		rfs_info_put(rroot->rinfo);
-		rroot->rinfo = rinfo;
+		rfs_root_set_rinfo(rroot, rinfo);
+		rfs_info_put(rinfo);
 	}
 
 	return 0;
@@ -241,12 +301,34 @@ int redirfs_set_operations(redirfs_filter filter, struct redirfs_op_info ops[])
 	if (!rflt || IS_ERR(rflt))
 		return -EINVAL;
 
+	for (i = 0; ops[i].op_id != REDIRFS_OP_END; i++) {
+		if (ops[i].flags & ~REDIRFS_OP_DEFER_POST)
+			return -EINVAL;
+
+		if (!(ops[i].flags & REDIRFS_OP_DEFER_POST))
+			continue;
+
+		if (!rfs_defer_supported(ops[i].op_id))
+			return -EINVAL;
+	}
+
+	rv = rfs_stats_update(rflt, ops);
+	if (rv)
+		return rv;
+
+	i = 0;
+
 	while (ops[i].op_id != REDIRFS_OP_END) {
 		rflt->cbs[ops[i].op_id].pre_cb = ops[i].pre_cb;
 		rflt->cbs[ops[i].op_id].post_cb = ops[i].post_cb;
+		rflt->cbs[ops[i].op_id].flags = ops[i].flags;
 		i++;
 	}
 
+	rfs_chain_update_flt(rflt);
+	rfs_info_join_flush(rflt);
+	rfs_flt_sysfs_stats_update(rflt);
+
 	rfs_mutex_lock(&rfs_path_mutex);
 	rv = rfs_flt_set_ops(rflt);
 	rfs_mutex_unlock(&rfs_path_mutex);
@@ -262,6 +344,7 @@ int redirfs_activate_filter(redirfs_filter filter)
 		return -EINVAL;
 
 	atomic_set(&rflt->active, 1);
+	rfs_chain_update_flt(rflt);
 
 	return 0;
 }
@@ -274,6 +357,7 @@ int redirfs_deactivate_filter(redirfs_filter filter)
 		return -EINVAL;
 
 	atomic_set(&rflt->active, 0);
+	rfs_chain_update_flt(rflt);
 
 	return 0;
 }
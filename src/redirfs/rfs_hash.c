@@ -0,0 +1,87 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include "rfs.h"
+
+#define RFS_HASH_BITS_MIN 8
+#define RFS_HASH_BITS_MAX 20
+
+/*
+ * One bucket per 2^scale bytes of memory, as alloc_large_system_hash does,
+ * unless the hash_bits module parameter sets the size.
+ */
+static unsigned int rfs_hash_bits_scaled(unsigned int scale)
+{
+	struct sysinfo info;
+	unsigned long buckets;
+	unsigned int bits = 0;
+
+	if (rfs_hash_bits > 0)
+		bits = rfs_hash_bits;
+	else {
+		si_meminfo(&info);
+
+		if (scale > PAGE_SHIFT)
+			buckets = info.totalram >> (scale - PAGE_SHIFT);
+		else
+			buckets = info.totalram << (PAGE_SHIFT - scale);
+
+		while (buckets >>= 1)
+			bits++;
+	}
+
+	if (bits < RFS_HASH_BITS_MIN)
+		return RFS_HASH_BITS_MIN;
+
+	if (bits > RFS_HASH_BITS_MAX)
+		return RFS_HASH_BITS_MAX;
+
+	return bits;
+}
+
+int rfs_hash_init(struct rfs_hash *hash, unsigned int scale)
+{
+	unsigned int bits = rfs_hash_bits_scaled(scale);
+	unsigned int i;
+
+	hash->buckets = vmalloc(sizeof(struct rfs_hash_bucket) << bits);
+	if (!hash->buckets)
+		return -ENOMEM;
+
+	for (i = 0; i < (1U << bits); i++) {
+		INIT_HLIST_HEAD(&hash->buckets[i].head);
+		spin_lock_init(&hash->buckets[i].lock);
+	}
+
+	hash->bits = bits;
+
+	return 0;
+}
+
+void rfs_hash_free(struct rfs_hash *hash)
+{
+	vfree(hash->buckets);
+	hash->buckets = NULL;
+}
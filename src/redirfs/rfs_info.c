@@ -23,6 +23,24 @@
 
 #include "rfs.h"
 
+#define RFS_INFO_JOIN_BITS 8
+
+/*
+ * Infos of inodes with several dentries, keyed by their joined chain. The
+ * table does not hold references, an info is removed by its last put.
+ */
+static struct hlist_head rfs_info_join_hash[1 << RFS_INFO_JOIN_BITS];
+static DEFINE_SPINLOCK(rfs_info_join_lock);
+
+/* All infos, walked only to report the object counts. */
+static LIST_HEAD(rfs_info_list);
+static DEFINE_SPINLOCK(rfs_info_list_lock);
+
+/* Infos replaced in roots, switched to atomic mode in one batch. */
+static LIST_HEAD(rfs_info_retired_list);
+static DEFINE_SPINLOCK(rfs_info_retired_lock);
+static RFS_DEFINE_MUTEX(rfs_info_retired_mutex);
+
 static int rfs_info_add_ops(struct rfs_info *rinfo, struct rfs_chain *rchain)
 {
 	struct rfs_ops *rops;
@@ -52,15 +70,29 @@ struct rfs_info *rfs_info_alloc(struct rfs_root *rroot,
 	if (!rinfo)
 		return ERR_PTR(-ENOMEM);
 
+	rinfo->objs = alloc_percpu(struct rfs_objs_pcpu);
+	if (!rinfo->objs) {
+		kfree(rinfo);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	rv = rfs_info_add_ops(rinfo, rchain);
 	if (rv) {
+		free_percpu(rinfo->objs);
 		kfree(rinfo);
 		return ERR_PTR(rv);
 	}
 
 	rinfo->rchain = rfs_chain_get(rchain);
 	rinfo->rroot = rfs_root_get(rroot);
-	atomic_set(&rinfo->count, 1);
+	INIT_HLIST_NODE(&rinfo->join);
+	INIT_LIST_HEAD(&rinfo->retired);
+	rfs_ref_init(&rinfo->ref);
+
+	spin_lock(&rfs_info_list_lock);
+	list_add_tail(&rinfo->list, &rfs_info_list);
+	spin_unlock(&rfs_info_list_lock);
+	rfs_obj_add(RFS_OBJ_INFO, 1);
 
 	return rinfo;
 }
@@ -70,25 +102,251 @@ struct rfs_info *rfs_info_get(struct rfs_info *rinfo)
 	if (!rinfo || IS_ERR(rinfo))
 		return NULL;
 
-	BUG_ON(!atomic_read(&rinfo->count));
-	atomic_inc(&rinfo->count);
+	rfs_ref_get(&rinfo->ref);
 
 	return rinfo;
 }
 
+struct rfs_info *rfs_info_get_rcu(struct rfs_info **prinfo)
+{
+	struct rfs_info *rinfo;
+
+	rcu_read_lock();
+	do {
+		rinfo = rcu_dereference(*prinfo);
+	} while (rinfo && !rfs_ref_get_not_zero(&rinfo->ref));
+	rcu_read_unlock();
+
+	return rinfo;
+}
+
+static void rfs_info_free_rcu(struct rcu_head *head)
+{
+	struct rfs_info *rinfo = container_of(head, struct rfs_info, rcu);
+
+	free_percpu(rinfo->objs);
+	kfree(rinfo);
+}
+
 void rfs_info_put(struct rfs_info *rinfo)
 {
 	if (!rinfo || IS_ERR(rinfo))
 		return;
 
-	BUG_ON(!atomic_read(&rinfo->count));
-	if (!atomic_dec_and_test(&rinfo->count))
+	if (!rfs_ref_put(&rinfo->ref))
 		return;
 
+	spin_lock(&rfs_info_join_lock);
+	if (!hlist_unhashed(&rinfo->join))
+		hlist_del_init(&rinfo->join);
+	spin_unlock(&rfs_info_join_lock);
+
+	spin_lock(&rfs_info_list_lock);
+	list_del(&rinfo->list);
+	spin_unlock(&rfs_info_list_lock);
+	rfs_obj_add(RFS_OBJ_INFO, -1);
+
 	rfs_chain_put(rinfo->rchain);
 	rfs_ops_put(rinfo->rops);
 	rfs_root_put(rinfo->rroot);
-	kfree(rinfo);
+	call_rcu(&rinfo->rcu, rfs_info_free_rcu);
+}
+
+/*
+ * Wait for one grace period for all infos retired so far and drop the
+ * references the roots held.
+ */
+void rfs_info_retire_flush(void)
+{
+	struct rfs_info *rinfo;
+	struct rfs_info *tmp;
+	LIST_HEAD(list);
+
+	rfs_mutex_lock(&rfs_info_retired_mutex);
+
+	spin_lock(&rfs_info_retired_lock);
+	list_splice_init(&rfs_info_retired_list, &list);
+	spin_unlock(&rfs_info_retired_lock);
+
+	if (list_empty(&list)) {
+		rfs_mutex_unlock(&rfs_info_retired_mutex);
+		return;
+	}
+
+	synchronize_sched();
+
+	list_for_each_entry_safe(rinfo, tmp, &list, retired) {
+		list_del_init(&rinfo->retired);
+		rfs_ref_atomic_end(&rinfo->ref, rinfo->retired_pcpu);
+		rinfo->retired_pcpu = NULL;
+		rfs_info_put(rinfo);
+	}
+
+	rfs_mutex_unlock(&rfs_info_retired_mutex);
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+
+static void rfs_info_retire_work(void *data)
+{
+	rfs_info_retire_flush();
+}
+
+static DECLARE_WORK(rfs_info_retire_wq, rfs_info_retire_work, NULL);
+
+#else
+
+static void rfs_info_retire_work(struct work_struct *work)
+{
+	rfs_info_retire_flush();
+}
+
+static DECLARE_WORK(rfs_info_retire_wq, rfs_info_retire_work);
+
+#endif
+
+/*
+ * Switch an info replaced in its root back to atomic mode and drop the
+ * root's reference. The grace period is waited for from a work, shared by
+ * all infos retired in the meantime, so setting up many roots does not
+ * block once per root.
+ */
+void rfs_info_retire(struct rfs_info *rinfo)
+{
+	rinfo->retired_pcpu = rfs_ref_atomic_begin(&rinfo->ref);
+	if (!rinfo->retired_pcpu) {
+		rfs_info_put(rinfo);
+		return;
+	}
+
+	spin_lock(&rfs_info_retired_lock);
+	list_add_tail(&rinfo->retired, &rfs_info_retired_list);
+	spin_unlock(&rfs_info_retired_lock);
+
+	schedule_work(&rfs_info_retire_wq);
+}
+
+/*
+ * Add the objects using the info to objs and count the info in
+ * objs[RFS_OBJ_INFO].
+ */
+void rfs_info_objs_sum(struct rfs_info *rinfo, long *objs)
+{
+	struct rfs_objs_pcpu *cpu_objs;
+	int cpu;
+	int i;
+
+	for_each_possible_cpu(cpu) {
+		cpu_objs = per_cpu_ptr(rinfo->objs, cpu);
+		for (i = 0; i < RFS_OBJ_INFO; i++)
+			objs[i] += cpu_objs->nr[i];
+	}
+
+	objs[RFS_OBJ_INFO]++;
+}
+
+/*
+ * Sum the objects using infos whose chain contains the filter.
+ */
+void rfs_info_objs(struct rfs_flt *rflt, long *objs)
+{
+	struct rfs_info *rinfo;
+
+	spin_lock(&rfs_info_list_lock);
+	list_for_each_entry(rinfo, &rfs_info_list, list) {
+		if (rfs_chain_find(rinfo->rchain, rflt) != -1)
+			rfs_info_objs_sum(rinfo, objs);
+	}
+	spin_unlock(&rfs_info_list_lock);
+}
+
+static struct hlist_head *rfs_info_join_head(struct rfs_chain *rchain)
+{
+	return &rfs_info_join_hash[hash_long((unsigned long)rchain,
+			RFS_INFO_JOIN_BITS)];
+}
+
+static struct rfs_info *rfs_info_join_find(struct rfs_chain *rchain)
+{
+	struct rfs_info *rinfo;
+	struct hlist_node *pos;
+
+	for (pos = rfs_info_join_head(rchain)->first; pos; pos = pos->next) {
+		rinfo = hlist_entry(pos, struct rfs_info, join);
+		if (rinfo->rchain != rchain)
+			continue;
+
+		if (rfs_ref_get_not_zero(&rinfo->ref))
+			return rinfo;
+	}
+
+	return NULL;
+}
+
+/*
+ * The operations of an info are set when it is allocated. Once a filter
+ * changes its operations, infos whose chain contains the filter must not be
+ * handed out by rfs_info_join any more. Infos already in use are replaced
+ * by rfs_info_reset.
+ */
+void rfs_info_join_flush(struct rfs_flt *rflt)
+{
+	struct rfs_info *rinfo;
+	struct hlist_node *pos;
+	struct hlist_node *tmp;
+	int i;
+
+	spin_lock(&rfs_info_join_lock);
+
+	for (i = 0; i < (1 << RFS_INFO_JOIN_BITS); i++) {
+		pos = rfs_info_join_hash[i].first;
+		while (pos) {
+			tmp = pos->next;
+			rinfo = hlist_entry(pos, struct rfs_info, join);
+			if (rfs_chain_find(rinfo->rchain, rflt) != -1)
+				hlist_del_init(&rinfo->join);
+			pos = tmp;
+		}
+	}
+
+	spin_unlock(&rfs_info_join_lock);
+}
+
+/*
+ * Returns the shared info for an inode with several dentries whose chains
+ * joined to rchain. Chains are interned, so the chain pointer identifies
+ * the set of filters and all such inodes share one info.
+ */
+struct rfs_info *rfs_info_join(struct rfs_chain *rchain)
+{
+	struct rfs_info *rinfo;
+	struct rfs_info *rinfo_new;
+
+	if (!rchain)
+		return rfs_info_get(rfs_info_none);
+
+	spin_lock(&rfs_info_join_lock);
+	rinfo = rfs_info_join_find(rchain);
+	spin_unlock(&rfs_info_join_lock);
+	if (rinfo)
+		return rinfo;
+
+	rinfo_new = rfs_info_alloc(NULL, rchain);
+	if (IS_ERR(rinfo_new))
+		return rinfo_new;
+
+	spin_lock(&rfs_info_join_lock);
+	rinfo = rfs_info_join_find(rchain);
+	if (!rinfo) {
+		hlist_add_head(&rinfo_new->join, rfs_info_join_head(rchain));
+		rinfo = rinfo_new;
+		rinfo_new = NULL;
+	}
+	spin_unlock(&rfs_info_join_lock);
+
+	rfs_info_put(rinfo_new);
+
+	return rinfo;
 }
 
 static struct rfs_info *rfs_info_dentry(struct dentry *dentry)
@@ -100,7 +358,7 @@ static struct rfs_info *rfs_info_dentry(struct dentry *dentry)
 	if (!rdentry)
 		return NULL;
 
-	rinfo = rfs_info_get(rdentry->rinfo);
+	rinfo = rfs_dentry_get_rinfo(rdentry);
 
 	rfs_dentry_put(rdentry);
 
@@ -141,11 +399,7 @@ static void rfs_info_rdentry_rem(struct dentry *dentry)
 	if (!rdentry)
 		return;
 
-	spin_lock(&rdentry->lock);
-	rfs_info_put(rdentry->rinfo);
-	rdentry->rinfo = rfs_info_get(rfs_info_none);
-	spin_unlock(&rdentry->lock);
-
+	rfs_dentry_set_rinfo(rdentry, rfs_info_none);
 	rfs_dentry_put(rdentry);
 }
 
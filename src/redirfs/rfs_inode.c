@@ -24,6 +24,7 @@
 #include "rfs.h"
 
 static rfs_kmem_cache_t *rfs_inode_cache = NULL;
+static struct rfs_hash rfs_inode_hash;
 
 static struct rfs_inode *rfs_inode_alloc(struct inode *inode)
 {
@@ -34,16 +35,125 @@ static struct rfs_inode *rfs_inode_alloc(struct inode *inode)
 		return ERR_PTR(-ENOMEM);
 
 	INIT_LIST_HEAD(&rinode->rdentries);
-	INIT_LIST_HEAD(&rinode->data);
+	INIT_HLIST_NODE(&rinode->hash);
+	INIT_LIST_HEAD(&rinode->xattrs);
+	rfs_data_slots_init(&rinode->data, 1);
 	spin_lock_init(&rinode->lock);
 	rfs_mutex_init(&rinode->mutex);
 	atomic_set(&rinode->count, 1);
 	atomic_set(&rinode->nlink, 1);
 	rinode->rdentries_nr = 0;
+	rfs_obj_add(RFS_OBJ_INODE, 1);
 
 	return rinode;
 }
 
+struct rfs_inode *rfs_inode_find(struct inode *inode)
+{
+	struct rfs_inode *rinode = NULL;
+	struct hlist_node *pos;
+
+	if (!inode || !inode->i_op || inode->i_op->rename != rfs_rename)
+		return NULL;
+
+	/* rinode is freed after a grace period, so it is safe to follow the
+	 * hash chain as long as the count has not dropped to zero */
+	rcu_read_lock();
+	rfs_hash_for_each_rcu(pos, &rfs_inode_hash, inode) {
+		rinode = hlist_entry(pos, struct rfs_inode, hash);
+		if (rinode->inode == inode &&
+				atomic_inc_not_zero(&rinode->count))
+			break;
+
+		rinode = NULL;
+	}
+	rcu_read_unlock();
+
+	return rinode;
+}
+
+static void rfs_inode_init_ops(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
+{
+	if (rinode->op_old)
+		memcpy(op_new, rinode->op_old,
+				sizeof(struct inode_operations));
+	else
+		memset(op_new, 0, sizeof(struct inode_operations));
+
+	op_new->rename = rfs_rename;
+}
+
+/*
+ * Switch the inode to the shared table matching op_new. Called with
+ * rinode->lock held. If no table can be allocated the inode keeps its
+ * current operations.
+ */
+static void rfs_inode_set_optbl(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
+{
+	struct rfs_optbl *optbl;
+
+	optbl = rfs_optbl_add(&rfs_optbl_iops, rinode->op_old, op_new);
+	if (IS_ERR(optbl))
+		return;
+
+	spin_lock(&rinode->inode->i_lock);
+
+	if (rinode->inode->i_op != rfs_optbl_ops(rinode->optbl)) {
+		spin_unlock(&rinode->inode->i_lock);
+		rfs_optbl_put(optbl);
+		return;
+	}
+
+	rinode->inode->i_op = rfs_optbl_ops(optbl);
+	spin_unlock(&rinode->inode->i_lock);
+
+	rfs_optbl_put(rinode->optbl);
+	rinode->optbl = optbl;
+}
+
+/*
+ * Switch the inode's mapping to the shared table matching aop_new, or back to
+ * the original operations if nothing is redirected. Called with rinode->lock
+ * held. The table is not touched if the file system replaced it meanwhile.
+ */
+static void rfs_inode_set_aoptbl(struct rfs_inode *rinode,
+		struct address_space_operations *aop_new)
+{
+	struct address_space *mapping = rinode->inode->i_mapping;
+	struct rfs_optbl *aoptbl = NULL;
+	const void *aop_cur;
+
+	if (!rinode->aop_old)
+		return;
+
+	if (memcmp(aop_new, rinode->aop_old,
+				sizeof(struct address_space_operations))) {
+		aoptbl = rfs_optbl_add(&rfs_optbl_aops, rinode->aop_old,
+				aop_new);
+		if (IS_ERR(aoptbl))
+			return;
+	}
+
+	aop_cur = rinode->aoptbl ? rfs_optbl_ops(rinode->aoptbl) :
+		rinode->aop_old;
+
+	spin_lock(&rinode->inode->i_lock);
+
+	if (!atomic_read(&rinode->nlink) || mapping->a_ops != aop_cur) {
+		spin_unlock(&rinode->inode->i_lock);
+		rfs_optbl_put(aoptbl);
+		return;
+	}
+
+	mapping->a_ops = aoptbl ? rfs_optbl_ops(aoptbl) : rinode->aop_old;
+	spin_unlock(&rinode->inode->i_lock);
+
+	rfs_optbl_put(rinode->aoptbl);
+	rinode->aoptbl = aoptbl;
+}
+
 struct rfs_inode *rfs_inode_get(struct rfs_inode *rinode)
 {
 	if (!rinode || IS_ERR(rinode))
@@ -55,6 +165,12 @@ struct rfs_inode *rfs_inode_get(struct rfs_inode *rinode)
 	return rinode;
 }
 
+static void rfs_inode_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(rfs_inode_cache,
+			container_of(head, struct rfs_inode, rcu));
+}
+
 void rfs_inode_put(struct rfs_inode *rinode)
 {
 	if (!rinode || IS_ERR(rinode))
@@ -64,13 +180,19 @@ void rfs_inode_put(struct rfs_inode *rinode)
 	if (!atomic_dec_and_test(&rinode->count))
 		return;
 
+	rfs_info_obj_add(rinode->rinfo, RFS_OBJ_INODE, -1);
 	rfs_info_put(rinode->rinfo);
-	rfs_data_remove(&rinode->data);
-	kmem_cache_free(rfs_inode_cache, rinode);
+	rfs_data_slots_remove(&rinode->data);
+	rfs_optbl_put(rinode->optbl);
+	rfs_optbl_put(rinode->aoptbl);
+	rfs_xattr_free(rinode);
+	rfs_obj_add(RFS_OBJ_INODE, -1);
+	call_rcu(&rinode->rcu, rfs_inode_free_rcu);
 }
 
 struct rfs_inode *rfs_inode_add(struct inode *inode, struct rfs_info *rinfo)
 {
+	struct inode_operations op_new;
 	struct rfs_inode *ri_new;
 	struct rfs_inode *ri;
 
@@ -83,27 +205,36 @@ struct rfs_inode *rfs_inode_add(struct inode *inode, struct rfs_info *rinfo)
 
 	spin_lock(&inode->i_lock);
 
-	ri = rfs_inode_find_locked(inode);
-	if (!ri) {
-		ri_new->inode = inode;
-		ri_new->op_old = inode->i_op;
-		ri_new->fop_old = inode->i_fop;
-		if (inode->i_op)
-			memcpy(&ri_new->op_new, inode->i_op,
-					sizeof(struct inode_operations));
-
-		ri_new->op_new.rename = rfs_rename;
-
-		ri_new->rinfo = rfs_info_get(rinfo);
-		if (!S_ISSOCK(inode->i_mode))
-			inode->i_fop = &rfs_file_ops;
-
-		inode->i_op = &ri_new->op_new;
-		rfs_inode_get(ri_new);
-		ri = rfs_inode_get(ri_new);
-	} else
+	ri = rfs_inode_find(inode);
+	if (ri) {
 		atomic_inc(&ri->nlink);
+		goto exit;
+	}
 
+	ri_new->inode = inode;
+	ri_new->op_old = inode->i_op;
+	ri_new->fop_old = inode->i_fop;
+	ri_new->aop_old = inode->i_mapping->a_ops;
+
+	rfs_inode_init_ops(ri_new, &op_new);
+	ri_new->optbl = rfs_optbl_add(&rfs_optbl_iops, ri_new->op_old,
+			&op_new);
+	if (IS_ERR(ri_new->optbl)) {
+		ri = (struct rfs_inode *)ri_new->optbl;
+		ri_new->optbl = NULL;
+		goto exit;
+	}
+
+	ri_new->rinfo = rfs_info_get(rinfo);
+	rfs_info_obj_add(rinfo, RFS_OBJ_INODE, 1);
+	if (!S_ISSOCK(inode->i_mode))
+		inode->i_fop = &rfs_file_ops;
+
+	inode->i_op = rfs_optbl_ops(ri_new->optbl);
+	rfs_hash_add(&rfs_inode_hash, &ri_new->hash, inode);
+	rfs_inode_get(ri_new);
+	ri = rfs_inode_get(ri_new);
+exit:
 	spin_unlock(&inode->i_lock);
 
 	rfs_inode_put(ri_new);
@@ -122,7 +253,13 @@ void rfs_inode_del(struct rfs_inode *rinode)
 		if (!S_ISSOCK(rinode->inode->i_mode))
 			rinode->inode->i_fop = rinode->fop_old;
 
+		if (rinode->aoptbl && rinode->inode->i_mapping->a_ops ==
+				rfs_optbl_ops(rinode->aoptbl))
+			rinode->inode->i_mapping->a_ops = rinode->aop_old;
+
 		rinode->inode->i_op = rinode->op_old;
+		rfs_hash_del(&rfs_inode_hash, &rinode->hash,
+				rinode->inode);
 		rfs_inode_put(rinode);
 	}
 	spin_unlock(&rinode->inode->i_lock);
@@ -160,9 +297,7 @@ static struct rfs_chain *rfs_inode_join_rchains(struct rfs_inode *rinode)
 	struct rfs_chain *rchain_old = NULL;
 
 	list_for_each_entry(rdentry, &rinode->rdentries, rinode_list) {
-		spin_lock(&rdentry->lock);
-		rinfo = rfs_info_get(rdentry->rinfo);
-		spin_unlock(&rdentry->lock);
+		rinfo = rfs_dentry_get_rinfo(rdentry);
 
 		rchain = rfs_chain_join(rinfo->rchain, rchain_old);
 
@@ -178,6 +313,21 @@ static struct rfs_chain *rfs_inode_join_rchains(struct rfs_inode *rinode)
 	return rchain;
 }
 
+static void rfs_inode_swap_rinfo(struct rfs_inode *rinode,
+		struct rfs_info *rinfo)
+{
+	struct rfs_info *rinfo_old;
+
+	spin_lock(&rinode->lock);
+	rinfo_old = rinode->rinfo;
+	rcu_assign_pointer(rinode->rinfo, rinfo);
+	rfs_info_obj_add(rinfo_old, RFS_OBJ_INODE, -1);
+	rfs_info_obj_add(rinfo, RFS_OBJ_INODE, 1);
+	spin_unlock(&rinode->lock);
+
+	rfs_info_put(rinfo_old);
+}
+
 static int rfs_inode_set_rinfo_fast(struct rfs_inode *rinode)
 {
 	struct rfs_dentry *rdentry;
@@ -190,82 +340,46 @@ static int rfs_inode_set_rinfo_fast(struct rfs_inode *rinode)
 
 	rdentry = list_entry(rinode->rdentries.next, struct rfs_dentry, rinode_list);
 
-	spin_lock(&rdentry->lock);
-	spin_lock(&rinode->lock);
-	rfs_info_put(rinode->rinfo);
-	rinode->rinfo = rfs_info_get(rdentry->rinfo);
-	spin_unlock(&rinode->lock);
-	spin_unlock(&rdentry->lock);
+	rfs_inode_swap_rinfo(rinode, rfs_dentry_get_rinfo(rdentry));
 
 	return 0;
 }
 
 struct rfs_info *rfs_inode_get_rinfo(struct rfs_inode *rinode)
 {
-	struct rfs_info *rinfo;
-
-	spin_lock(&rinode->lock);
-	rinfo = rfs_info_get(rinode->rinfo);
-	spin_unlock(&rinode->lock);
-
-	return rinfo;
+	return rfs_info_get_rcu(&rinode->rinfo);
 }
 
 int rfs_inode_set_rinfo(struct rfs_inode *rinode)
 {
 	struct rfs_chain *rchain;
 	struct rfs_info *rinfo;
-	struct rfs_ops *rops;
 	int rv;
 
 	if (!rinode)
 		return 0;
 
-	rfs_mutex_lock(&rinode->mutex);
-	rv = rfs_inode_set_rinfo_fast(rinode);
-	rfs_mutex_unlock(&rinode->mutex);
-	if (!rv)
-		return 0;
-
-	rinfo = rfs_info_alloc(NULL, NULL);
-	if (IS_ERR(rinfo))
-		return PTR_ERR(rinfo);
-
-	rops = rfs_ops_alloc();
-	if (IS_ERR(rops)) {
-		rfs_info_put(rinfo);
-		return PTR_ERR(rops);
-	}
-
-	rinfo->rops = rops;
-
 	rfs_mutex_lock(&rinode->mutex);
 	rv = rfs_inode_set_rinfo_fast(rinode);
 	if (!rv) {
 		rfs_mutex_unlock(&rinode->mutex);
-		rfs_info_put(rinfo);
 		return 0;
 	}
 
 	rchain = rfs_inode_join_rchains(rinode);
 	if (IS_ERR(rchain)) {
 		rfs_mutex_unlock(&rinode->mutex);
-		rfs_info_put(rinfo);
 		return PTR_ERR(rchain);
 	}
 
-	rinfo->rchain = rchain;
-
-	if (!rinfo->rchain) {
-		rfs_info_put(rinfo);
-		rinfo = rfs_info_get(rfs_info_none);
+	rinfo = rfs_info_join(rchain);
+	rfs_chain_put(rchain);
+	if (IS_ERR(rinfo)) {
+		rfs_mutex_unlock(&rinode->mutex);
+		return PTR_ERR(rinfo);
 	}
 
-	rfs_chain_ops(rinfo->rchain, rinfo->rops);
-	spin_lock(&rinode->lock);
-	rfs_info_put(rinode->rinfo);
-	rinode->rinfo = rinfo;
-	spin_unlock(&rinode->lock);
+	rfs_inode_swap_rinfo(rinode, rinfo);
 	rfs_mutex_unlock(&rinode->mutex);
 
 	return 0;
@@ -273,18 +387,28 @@ int rfs_inode_set_rinfo(struct rfs_inode *rinode)
 
 int rfs_inode_cache_create(void)
 {
+	int rv;
+
+	rv = rfs_hash_init(&rfs_inode_hash, 14);
+	if (rv)
+		return rv;
+
 	rfs_inode_cache = rfs_kmem_cache_create("rfs_inode_cache",
 			sizeof(struct rfs_inode));
 
-	if (!rfs_inode_cache)
+	if (!rfs_inode_cache) {
+		rfs_hash_free(&rfs_inode_hash);
 		return -ENOMEM;
+	}
 
 	return 0;
 }
 
 void rfs_inode_cache_destroy(void)
 {
+	rcu_barrier();
 	kmem_cache_destroy(rfs_inode_cache);
+	rfs_hash_free(&rfs_inode_hash);
 }
 
 static struct dentry *rfs_lookup(struct inode *dir, struct dentry *dentry,
@@ -303,6 +427,16 @@ static struct dentry *rfs_lookup(struct inode *dir, struct dentry *dentry,
 
 	rinode = rfs_inode_find(dir);
 	rinfo = rfs_inode_get_rinfo(rinode);
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		if (rinode->op_old && rinode->op_old->lookup)
+			rargs.rv.rv_dentry = rinode->op_old->lookup(dir,
+					dentry, nd);
+		else
+			rargs.rv.rv_dentry = ERR_PTR(-ENOSYS);
+		goto attach;
+	}
+
 	rfs_context_init(&rcont, 0);
 
 	rargs.args.i_lookup.dir = dir;
@@ -321,7 +455,7 @@ static struct dentry *rfs_lookup(struct inode *dir, struct dentry *dentry,
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
+attach:
 	if (IS_ERR(rargs.rv.rv_dentry))
 		goto exit;
 
@@ -644,7 +778,6 @@ static int rfs_permission(struct inode *inode, int mask, struct nameidata *nd)
 	submask = mask & ~MAY_APPEND;
 	rinode = rfs_inode_find(inode);
 	rinfo = rfs_inode_get_rinfo(rinode);
-	rfs_context_init(&rcont, 0);
 
 	if (S_ISREG(inode->i_mode))
 		rargs.type.id = REDIRFS_REG_IOP_PERMISSION;
@@ -661,6 +794,18 @@ static int rfs_permission(struct inode *inode, int mask, struct nameidata *nd)
 	else 
 		rargs.type.id = REDIRFS_SOCK_IOP_PERMISSION;
 
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		if (rinode->op_old && rinode->op_old->permission)
+			rargs.rv.rv_int = rinode->op_old->permission(inode,
+					mask, nd);
+		else
+			rargs.rv.rv_int = generic_permission(inode, submask,
+					NULL);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
 	rargs.args.i_permission.inode = inode;
 	rargs.args.i_permission.mask = mask;
 	rargs.args.i_permission.nd = nd;
@@ -678,7 +823,7 @@ static int rfs_permission(struct inode *inode, int mask, struct nameidata *nd)
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
+exit:
 	rfs_inode_put(rinode);
 	rfs_info_put(rinfo);
 	return rargs.rv.rv_int;
@@ -697,7 +842,6 @@ static int rfs_permission(struct inode *inode, int mask)
 	submask = mask & ~MAY_APPEND;
 	rinode = rfs_inode_find(inode);
 	rinfo = rfs_inode_get_rinfo(rinode);
-	rfs_context_init(&rcont, 0);
 
 	if (S_ISREG(inode->i_mode))
 		rargs.type.id = REDIRFS_REG_IOP_PERMISSION;
@@ -714,6 +858,17 @@ static int rfs_permission(struct inode *inode, int mask)
 	else 
 		rargs.type.id = REDIRFS_SOCK_IOP_PERMISSION;
 
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		if (rinode->op_old && rinode->op_old->permission)
+			rargs.rv.rv_int = rinode->op_old->permission(inode, mask);
+		else
+			rargs.rv.rv_int = generic_permission(inode, submask,
+					NULL);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
 	rargs.args.i_permission.inode = inode;
 	rargs.args.i_permission.mask = mask;
 
@@ -729,7 +884,7 @@ static int rfs_permission(struct inode *inode, int mask)
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
+exit:
 	rfs_inode_put(rinode);
 	rfs_info_put(rinfo);
 	return rargs.rv.rv_int;
@@ -748,7 +903,6 @@ static int rfs_permission(struct inode *inode, int mask, unsigned int flags)
 	submask = mask & ~MAY_APPEND;
 	rinode = rfs_inode_find(inode);
 	rinfo = rfs_inode_get_rinfo(rinode);
-	rfs_context_init(&rcont, 0);
 
 	if (S_ISREG(inode->i_mode))
 		rargs.type.id = REDIRFS_REG_IOP_PERMISSION;
@@ -765,6 +919,18 @@ static int rfs_permission(struct inode *inode, int mask, unsigned int flags)
 	else 
 		rargs.type.id = REDIRFS_SOCK_IOP_PERMISSION;
 
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		if (rinode->op_old && rinode->op_old->permission)
+			rargs.rv.rv_int = rinode->op_old->permission(inode,
+					mask, flags);
+		else
+			rargs.rv.rv_int = generic_permission(inode, submask,
+					flags, NULL);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
 	rargs.args.i_permission.inode = inode;
 	rargs.args.i_permission.mask = mask;
 	rargs.args.i_permission.flags = flags;
@@ -782,7 +948,7 @@ static int rfs_permission(struct inode *inode, int mask, unsigned int flags)
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
+exit:
 	rfs_inode_put(rinode);
 	rfs_info_put(rinfo);
 	return rargs.rv.rv_int;
@@ -801,7 +967,6 @@ static int rfs_permission(struct inode *inode, int mask)
 	submask = mask & ~MAY_APPEND;
 	rinode = rfs_inode_find(inode);
 	rinfo = rfs_inode_get_rinfo(rinode);
-	rfs_context_init(&rcont, 0);
 
 	if (S_ISREG(inode->i_mode))
 		rargs.type.id = REDIRFS_REG_IOP_PERMISSION;
@@ -818,6 +983,16 @@ static int rfs_permission(struct inode *inode, int mask)
 	else 
 		rargs.type.id = REDIRFS_SOCK_IOP_PERMISSION;
 
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		if (rinode->op_old && rinode->op_old->permission)
+			rargs.rv.rv_int = rinode->op_old->permission(inode, mask);
+		else
+			rargs.rv.rv_int = generic_permission(inode, submask);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
 	rargs.args.i_permission.inode = inode;
 	rargs.args.i_permission.mask = mask;
 
@@ -832,7 +1007,7 @@ static int rfs_permission(struct inode *inode, int mask)
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
+exit:
 	rfs_inode_put(rinode);
 	rfs_info_put(rinfo);
 	return rargs.rv.rv_int;
@@ -906,6 +1081,292 @@ static int rfs_setattr(struct dentry *dentry, struct iattr *iattr)
 	return rargs.rv.rv_int;
 }
 
+/*
+ * getattr is redirected only while a filter registered it, stat calls on
+ * the other inodes go directly to the file system.
+ */
+static int rfs_getattr_old(struct rfs_inode *rinode,
+		struct redirfs_args *rargs)
+{
+	struct dentry *dentry = rargs->args.i_getattr.dentry;
+
+	if (rinode->op_old && rinode->op_old->getattr)
+		return rinode->op_old->getattr(rargs->args.i_getattr.mnt,
+				dentry, rargs->args.i_getattr.stat);
+
+	generic_fillattr(dentry->d_inode, rargs->args.i_getattr.stat);
+	return 0;
+}
+
+static int rfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
+		struct kstat *stat)
+{
+	struct inode *inode = dentry->d_inode;
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rinode = rfs_inode_find(inode);
+	rinfo = rfs_inode_get_rinfo(rinode);
+
+	if (S_ISREG(inode->i_mode))
+		rargs.type.id = REDIRFS_REG_IOP_GETATTR;
+	else if (S_ISDIR(inode->i_mode))
+		rargs.type.id = REDIRFS_DIR_IOP_GETATTR;
+	else if (S_ISLNK(inode->i_mode))
+		rargs.type.id = REDIRFS_LNK_IOP_GETATTR;
+	else if (S_ISCHR(inode->i_mode))
+		rargs.type.id = REDIRFS_CHR_IOP_GETATTR;
+	else if (S_ISBLK(inode->i_mode))
+		rargs.type.id = REDIRFS_BLK_IOP_GETATTR;
+	else if (S_ISFIFO(inode->i_mode))
+		rargs.type.id = REDIRFS_FIFO_IOP_GETATTR;
+	else
+		rargs.type.id = REDIRFS_SOCK_IOP_GETATTR;
+
+	rargs.args.i_getattr.mnt = mnt;
+	rargs.args.i_getattr.dentry = dentry;
+	rargs.args.i_getattr.stat = stat;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rfs_getattr_old(rinode, &rargs);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rfs_getattr_old(rinode, &rargs);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_inode_put(rinode);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+static ssize_t rfs_getxattr(struct dentry *dentry, const char *name,
+		void *buffer, size_t size)
+{
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = dentry->d_inode->i_mode;
+
+	rinode = rfs_inode_find(dentry->d_inode);
+	rinfo = rfs_inode_get_rinfo(rinode);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_IOP_GETXATTR;
+	else if (S_ISDIR(mode))
+		rargs.type.id = REDIRFS_DIR_IOP_GETXATTR;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_IOP_GETXATTR;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_IOP_GETXATTR;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_IOP_GETXATTR;
+	else if (S_ISFIFO(mode))
+		rargs.type.id = REDIRFS_FIFO_IOP_GETXATTR;
+	else
+		rargs.type.id = REDIRFS_SOCK_IOP_GETXATTR;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_ssize = rinode->op_old->getxattr(dentry, name,
+				buffer, size);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.i_getxattr.dentry = dentry;
+	rargs.args.i_getxattr.name = name;
+	rargs.args.i_getxattr.buffer = buffer;
+	rargs.args.i_getxattr.size = size;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_ssize = rinode->op_old->getxattr(
+				rargs.args.i_getxattr.dentry,
+				rargs.args.i_getxattr.name,
+				rargs.args.i_getxattr.buffer,
+				rargs.args.i_getxattr.size);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_inode_put(rinode);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_ssize;
+}
+
+/*
+ * setxattr and removexattr are redirected when a filter registered them or
+ * xattr data is attached, a change of a trusted.redirfs.* attribute drops
+ * its cached value.
+ */
+static int rfs_setxattr(struct dentry *dentry, const char *name,
+		const void *value, size_t size, int flags)
+{
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = dentry->d_inode->i_mode;
+
+	rinode = rfs_inode_find(dentry->d_inode);
+	rinfo = rfs_inode_get_rinfo(rinode);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_IOP_SETXATTR;
+	else if (S_ISDIR(mode))
+		rargs.type.id = REDIRFS_DIR_IOP_SETXATTR;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_IOP_SETXATTR;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_IOP_SETXATTR;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_IOP_SETXATTR;
+	else if (S_ISFIFO(mode))
+		rargs.type.id = REDIRFS_FIFO_IOP_SETXATTR;
+	else
+		rargs.type.id = REDIRFS_SOCK_IOP_SETXATTR;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rinode->op_old->setxattr(dentry, name, value,
+				size, flags);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.i_setxattr.dentry = dentry;
+	rargs.args.i_setxattr.name = name;
+	rargs.args.i_setxattr.value = value;
+	rargs.args.i_setxattr.size = size;
+	rargs.args.i_setxattr.flags = flags;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rinode->op_old->setxattr(
+				rargs.args.i_setxattr.dentry,
+				rargs.args.i_setxattr.name,
+				rargs.args.i_setxattr.value,
+				rargs.args.i_setxattr.size,
+				rargs.args.i_setxattr.flags);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_xattr_invalidate(rinode, name);
+	rfs_inode_put(rinode);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+static ssize_t rfs_listxattr(struct dentry *dentry, char *list, size_t size)
+{
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = dentry->d_inode->i_mode;
+
+	rinode = rfs_inode_find(dentry->d_inode);
+	rinfo = rfs_inode_get_rinfo(rinode);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_IOP_LISTXATTR;
+	else if (S_ISDIR(mode))
+		rargs.type.id = REDIRFS_DIR_IOP_LISTXATTR;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_IOP_LISTXATTR;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_IOP_LISTXATTR;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_IOP_LISTXATTR;
+	else if (S_ISFIFO(mode))
+		rargs.type.id = REDIRFS_FIFO_IOP_LISTXATTR;
+	else
+		rargs.type.id = REDIRFS_SOCK_IOP_LISTXATTR;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_ssize = rinode->op_old->listxattr(dentry, list,
+				size);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.i_listxattr.dentry = dentry;
+	rargs.args.i_listxattr.list = list;
+	rargs.args.i_listxattr.size = size;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_ssize = rinode->op_old->listxattr(
+				rargs.args.i_listxattr.dentry,
+				rargs.args.i_listxattr.list,
+				rargs.args.i_listxattr.size);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_inode_put(rinode);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_ssize;
+}
+
+static int rfs_removexattr(struct dentry *dentry, const char *name)
+{
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	umode_t mode = dentry->d_inode->i_mode;
+
+	rinode = rfs_inode_find(dentry->d_inode);
+	rinfo = rfs_inode_get_rinfo(rinode);
+
+	if (S_ISREG(mode))
+		rargs.type.id = REDIRFS_REG_IOP_REMOVEXATTR;
+	else if (S_ISDIR(mode))
+		rargs.type.id = REDIRFS_DIR_IOP_REMOVEXATTR;
+	else if (S_ISLNK(mode))
+		rargs.type.id = REDIRFS_LNK_IOP_REMOVEXATTR;
+	else if (S_ISCHR(mode))
+		rargs.type.id = REDIRFS_CHR_IOP_REMOVEXATTR;
+	else if (S_ISBLK(mode))
+		rargs.type.id = REDIRFS_BLK_IOP_REMOVEXATTR;
+	else if (S_ISFIFO(mode))
+		rargs.type.id = REDIRFS_FIFO_IOP_REMOVEXATTR;
+	else
+		rargs.type.id = REDIRFS_SOCK_IOP_REMOVEXATTR;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rinode->op_old->removexattr(dentry, name);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.i_removexattr.dentry = dentry;
+	rargs.args.i_removexattr.name = name;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rinode->op_old->removexattr(
+				rargs.args.i_removexattr.dentry,
+				rargs.args.i_removexattr.name);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_xattr_invalidate(rinode, name);
+	rfs_inode_put(rinode);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
 static int rfs_precall_flts_rename(struct rfs_info *rinfo,
 		struct rfs_context *rcont, struct redirfs_args *rargs)
 {
@@ -1042,90 +1503,407 @@ skip:
 }
 
 
-static void rfs_inode_set_ops_reg(struct rfs_inode *rinode)
+/*
+ * setxattr and removexattr are also redirected once a filter attached xattr
+ * data to the inode, so a change of the attribute drops the cached value.
+ */
+#define RFS_SET_IOP_XATTR(ri, ops_new, id, op) \
+	do { \
+		if (!ri->op_old || !ri->op_old->op) \
+			break; \
+		if (ri->xattrs_used) \
+			RFS_ADD_OP((*ops_new), op); \
+		else \
+			RFS_SET_IOP(ri, ops_new, id, op); \
+	} while (0)
+
+static void rfs_inode_set_ops_xattr(struct rfs_inode *rinode,
+		struct inode_operations *op_new, enum redirfs_op_id getxattr_id,
+		enum redirfs_op_id setxattr_id, enum redirfs_op_id listxattr_id,
+		enum redirfs_op_id removexattr_id)
 {
-	RFS_SET_IOP(rinode, REDIRFS_REG_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_REG_IOP_SETATTR, setattr);
+	RFS_SET_IOP_OLD(rinode, op_new, getxattr_id, getxattr);
+	RFS_SET_IOP_OLD(rinode, op_new, listxattr_id, listxattr);
+	RFS_SET_IOP_XATTR(rinode, op_new, setxattr_id, setxattr);
+	RFS_SET_IOP_XATTR(rinode, op_new, removexattr_id, removexattr);
 }
 
-static void rfs_inode_set_ops_dir(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_reg(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_DIR_IOP_UNLINK, unlink);
-	RFS_SET_IOP(rinode, REDIRFS_DIR_IOP_RMDIR, rmdir);
-	RFS_SET_IOP(rinode, REDIRFS_DIR_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_DIR_IOP_SETATTR, setattr);
-
-	RFS_SET_IOP_MGT(rinode, create);
-	RFS_SET_IOP_MGT(rinode, link);
-	RFS_SET_IOP_MGT(rinode, mknod);
-	RFS_SET_IOP_MGT(rinode, symlink);
-
-	rinode->op_new.lookup = rfs_lookup;
-	rinode->op_new.mkdir = rfs_mkdir;
+	RFS_SET_IOP(rinode, op_new, REDIRFS_REG_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_REG_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_REG_IOP_GETATTR, getattr);
+	rfs_inode_set_ops_xattr(rinode, op_new, REDIRFS_REG_IOP_GETXATTR,
+			REDIRFS_REG_IOP_SETXATTR, REDIRFS_REG_IOP_LISTXATTR,
+			REDIRFS_REG_IOP_REMOVEXATTR);
 }
 
-static void rfs_inode_set_ops_lnk(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_dir(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_LNK_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_LNK_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_DIR_IOP_UNLINK, unlink);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_DIR_IOP_RMDIR, rmdir);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_DIR_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_DIR_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_DIR_IOP_GETATTR, getattr);
+	rfs_inode_set_ops_xattr(rinode, op_new, REDIRFS_DIR_IOP_GETXATTR,
+			REDIRFS_DIR_IOP_SETXATTR, REDIRFS_DIR_IOP_LISTXATTR,
+			REDIRFS_DIR_IOP_REMOVEXATTR);
+
+	RFS_SET_IOP_MGT(rinode, op_new, create);
+	RFS_SET_IOP_MGT(rinode, op_new, link);
+	RFS_SET_IOP_MGT(rinode, op_new, mknod);
+	RFS_SET_IOP_MGT(rinode, op_new, symlink);
+
+	op_new->lookup = rfs_lookup;
+	op_new->mkdir = rfs_mkdir;
 }
 
-static void rfs_inode_set_ops_chr(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_lnk(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_CHR_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_CHR_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_LNK_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_LNK_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_LNK_IOP_GETATTR, getattr);
+	rfs_inode_set_ops_xattr(rinode, op_new, REDIRFS_LNK_IOP_GETXATTR,
+			REDIRFS_LNK_IOP_SETXATTR, REDIRFS_LNK_IOP_LISTXATTR,
+			REDIRFS_LNK_IOP_REMOVEXATTR);
 }
 
-static void rfs_inode_set_ops_blk(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_chr(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_BLK_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_BLK_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_CHR_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_CHR_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_CHR_IOP_GETATTR, getattr);
+	rfs_inode_set_ops_xattr(rinode, op_new, REDIRFS_CHR_IOP_GETXATTR,
+			REDIRFS_CHR_IOP_SETXATTR, REDIRFS_CHR_IOP_LISTXATTR,
+			REDIRFS_CHR_IOP_REMOVEXATTR);
 }
 
-static void rfs_inode_set_ops_fifo(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_blk(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_FIFO_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_FIFO_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_BLK_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_BLK_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_BLK_IOP_GETATTR, getattr);
+	rfs_inode_set_ops_xattr(rinode, op_new, REDIRFS_BLK_IOP_GETXATTR,
+			REDIRFS_BLK_IOP_SETXATTR, REDIRFS_BLK_IOP_LISTXATTR,
+			REDIRFS_BLK_IOP_REMOVEXATTR);
 }
 
-static void rfs_inode_set_ops_sock(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_fifo(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_SOCK_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_SOCK_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_FIFO_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_FIFO_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_FIFO_IOP_GETATTR, getattr);
+	rfs_inode_set_ops_xattr(rinode, op_new, REDIRFS_FIFO_IOP_GETXATTR,
+			REDIRFS_FIFO_IOP_SETXATTR, REDIRFS_FIFO_IOP_LISTXATTR,
+			REDIRFS_FIFO_IOP_REMOVEXATTR);
 }
 
-static void rfs_inode_set_aops_reg(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_sock(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
+	RFS_SET_IOP(rinode, op_new, REDIRFS_SOCK_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_SOCK_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_SOCK_IOP_GETATTR, getattr);
+	rfs_inode_set_ops_xattr(rinode, op_new, REDIRFS_SOCK_IOP_GETXATTR,
+			REDIRFS_SOCK_IOP_SETXATTR, REDIRFS_SOCK_IOP_LISTXATTR,
+			REDIRFS_SOCK_IOP_REMOVEXATTR);
 }
 
-void rfs_inode_set_ops(struct rfs_inode *rinode)
+static int rfs_readpage(struct file *file, struct page *page);
+static int rfs_writepage(struct page *page, struct writeback_control *wbc);
+static int rfs_readpages(struct file *file, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages);
+static int rfs_writepages(struct address_space *mapping,
+		struct writeback_control *wbc);
+
+/*
+ * The address space operations can be called from the writeback threads
+ * after the rinode was already detached. The mapping then has either the
+ * original operations again or still our table, in which case the original
+ * operations are taken from the table. A shared table always differs from
+ * the original operations in at least one of our operations.
+ */
+static const struct address_space_operations *rfs_mapping_aop_old(
+		struct address_space *mapping)
+{
+	const struct address_space_operations *a_ops = mapping->a_ops;
+
+	if (a_ops->readpage == rfs_readpage ||
+	    a_ops->writepage == rfs_writepage ||
+	    a_ops->readpages == rfs_readpages ||
+	    a_ops->writepages == rfs_writepages)
+		return rfs_optbl_from_ops(a_ops)->op_old;
+
+	return a_ops;
+}
+
+static int rfs_readpage(struct file *file, struct page *page)
+{
+	struct address_space *mapping = page->mapping;
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rinode = rfs_inode_find(mapping->host);
+	if (!rinode)
+		return rfs_mapping_aop_old(mapping)->readpage(file, page);
+
+	rinfo = rfs_inode_get_rinfo(rinode);
+	rargs.type.id = REDIRFS_REG_AOP_READPAGE;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rinode->aop_old->readpage(file, page);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.a_readpage.file = file;
+	rargs.args.a_readpage.page = page;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rinode->aop_old->readpage(
+				rargs.args.a_readpage.file,
+				rargs.args.a_readpage.page);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_inode_put(rinode);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+static int rfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct address_space *mapping = page->mapping;
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rinode = rfs_inode_find(mapping->host);
+	if (!rinode)
+		return rfs_mapping_aop_old(mapping)->writepage(page, wbc);
+
+	rinfo = rfs_inode_get_rinfo(rinode);
+	rargs.type.id = REDIRFS_REG_AOP_WRITEPAGE;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rinode->aop_old->writepage(page, wbc);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.a_writepage.page = page;
+	rargs.args.a_writepage.wbc = wbc;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rinode->aop_old->writepage(
+				rargs.args.a_writepage.page,
+				rargs.args.a_writepage.wbc);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_inode_put(rinode);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+/*
+ * The whole readahead batch is passed to the filters in one call, pages is
+ * the list of nr_pages pages linked through page->lru.
+ */
+static int rfs_readpages(struct file *file, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages)
 {
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rinode = rfs_inode_find(mapping->host);
+	if (!rinode)
+		return rfs_mapping_aop_old(mapping)->readpages(file, mapping,
+				pages, nr_pages);
+
+	rinfo = rfs_inode_get_rinfo(rinode);
+	rargs.type.id = REDIRFS_REG_AOP_READPAGES;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rinode->aop_old->readpages(file, mapping,
+				pages, nr_pages);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.a_readpages.file = file;
+	rargs.args.a_readpages.mapping = mapping;
+	rargs.args.a_readpages.pages = pages;
+	rargs.args.a_readpages.nr_pages = nr_pages;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rinode->aop_old->readpages(
+				rargs.args.a_readpages.file,
+				rargs.args.a_readpages.mapping,
+				rargs.args.a_readpages.pages,
+				rargs.args.a_readpages.nr_pages);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_inode_put(rinode);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+static int rfs_writepages(struct address_space *mapping,
+		struct writeback_control *wbc)
+{
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rinode = rfs_inode_find(mapping->host);
+	if (!rinode)
+		return rfs_mapping_aop_old(mapping)->writepages(mapping, wbc);
+
+	rinfo = rfs_inode_get_rinfo(rinode);
+	rargs.type.id = REDIRFS_REG_AOP_WRITEPAGES;
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rinode->aop_old->writepages(mapping, wbc);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	rargs.args.a_writepages.mapping = mapping;
+	rargs.args.a_writepages.wbc = wbc;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rinode->aop_old->writepages(
+				rargs.args.a_writepages.mapping,
+				rargs.args.a_writepages.wbc);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_inode_put(rinode);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+static void rfs_inode_set_aops_reg(struct rfs_inode *rinode,
+		struct address_space_operations *aop_new)
+{
+	RFS_SET_AOP(rinode, aop_new, REDIRFS_REG_AOP_READPAGE, readpage);
+	RFS_SET_AOP(rinode, aop_new, REDIRFS_REG_AOP_WRITEPAGE, writepage);
+	RFS_SET_AOP(rinode, aop_new, REDIRFS_REG_AOP_READPAGES, readpages);
+	RFS_SET_AOP(rinode, aop_new, REDIRFS_REG_AOP_WRITEPAGES, writepages);
+}
+
+/*
+ * Some file systems and the mm code tell mappings apart by comparing a_ops
+ * with their own tables, e.g. shmem_mapping or the ext3 and ext4 journalled
+ * data checks. The address space operations are therefore replaced only on
+ * file systems known not to do that.
+ */
+static const char *rfs_inode_aops_fs[] = {
+	"xfs",
+	"btrfs",
+	"jfs",
+	"vfat",
+	"msdos",
+	NULL
+};
+
+static int rfs_inode_aops_supported(struct rfs_inode *rinode)
+{
+	const char *name = rinode->inode->i_sb->s_type->name;
+	int i;
+
+	if (!rinode->aop_old)
+		return 0;
+
+	for (i = 0; rfs_inode_aops_fs[i]; i++) {
+		if (!strcmp(name, rfs_inode_aops_fs[i]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Called with rinode->lock held.
+ */
+static void rfs_inode_set_ops_locked(struct rfs_inode *rinode)
+{
+	struct address_space_operations aop_new;
+	struct inode_operations op_new;
 	umode_t mode = rinode->inode->i_mode;
 
-	spin_lock(&rinode->lock);
+	rfs_inode_init_ops(rinode, &op_new);
 
 	if (S_ISREG(mode)) {
-		rfs_inode_set_ops_reg(rinode);
-		rfs_inode_set_aops_reg(rinode);
+		rfs_inode_set_ops_reg(rinode, &op_new);
+		if (rfs_inode_aops_supported(rinode)) {
+			memcpy(&aop_new, rinode->aop_old,
+				sizeof(struct address_space_operations));
+			rfs_inode_set_aops_reg(rinode, &aop_new);
+			rfs_inode_set_aoptbl(rinode, &aop_new);
+		}
 
 	} else if (S_ISDIR(mode))
-		rfs_inode_set_ops_dir(rinode);
+		rfs_inode_set_ops_dir(rinode, &op_new);
 
 	else if (S_ISLNK(mode))
-		rfs_inode_set_ops_lnk(rinode);
+		rfs_inode_set_ops_lnk(rinode, &op_new);
 
 	else if (S_ISCHR(mode))
-		rfs_inode_set_ops_chr(rinode);
+		rfs_inode_set_ops_chr(rinode, &op_new);
 
 	else if (S_ISBLK(mode))
-		rfs_inode_set_ops_blk(rinode);
+		rfs_inode_set_ops_blk(rinode, &op_new);
 
 	else if (S_ISFIFO(mode))
-		rfs_inode_set_ops_fifo(rinode);
+		rfs_inode_set_ops_fifo(rinode, &op_new);
 
 	else if (S_ISSOCK(mode))
-		rfs_inode_set_ops_sock(rinode);
+		rfs_inode_set_ops_sock(rinode, &op_new);
+
+	rfs_inode_set_optbl(rinode, &op_new);
+}
+
+void rfs_inode_set_ops(struct rfs_inode *rinode)
+{
+	spin_lock(&rinode->lock);
+	rfs_inode_set_ops_locked(rinode);
+	spin_unlock(&rinode->lock);
+}
 
+/*
+ * Redirect setxattr and removexattr before the first value is cached, so
+ * changes done through the VFS invalidate it.
+ */
+void rfs_inode_set_ops_xattrs(struct rfs_inode *rinode)
+{
+	spin_lock(&rinode->lock);
+	if (!rinode->xattrs_used) {
+		rinode->xattrs_used = 1;
+		rfs_inode_set_ops_locked(rinode);
+	}
 	spin_unlock(&rinode->lock);
 }
 
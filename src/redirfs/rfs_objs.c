@@ -0,0 +1,130 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "rfs.h"
+
+/* Live objects of each type. */
+DEFINE_PER_CPU(struct rfs_objs_pcpu, rfs_objs);
+
+/*
+ * Entries are "<dentries>:<inodes>:<files>:<infos>[:<chains>:<data>][:name]"
+ * separated by '\0' like in the paths file.
+ */
+static int rfs_objs_print(char *buf, int size, long *objs, int nr,
+		const char *name)
+{
+	int len = 0;
+	int i;
+
+	for (i = 0; i < nr && len < size; i++)
+		len += snprintf(buf + len, size - len, i ? ":%ld" : "%ld",
+				objs[i]);
+
+	if (name && len < size)
+		len += snprintf(buf + len, size - len, ":%s", name);
+
+	return len + 1;
+}
+
+int rfs_objs_get_info(char *buf, int size)
+{
+	long objs[RFS_OBJ_END];
+	int cpu;
+	int i;
+
+	memset(objs, 0, sizeof(objs));
+
+	for_each_possible_cpu(cpu) {
+		for (i = 0; i < RFS_OBJ_END; i++)
+			objs[i] += per_cpu(rfs_objs, cpu).nr[i];
+	}
+
+	return min(rfs_objs_print(buf, size, objs, RFS_OBJ_END, NULL), size);
+}
+
+/*
+ * Roots are reported by the first of their paths with the objects of their
+ * current info. Objects of infos joined for inodes with dentries in several
+ * roots and of infos replaced in the root are not counted to any root.
+ */
+int rfs_objs_get_roots_info(char *buf, int size)
+{
+	struct rfs_root *rroot;
+	struct rfs_path *rpath;
+	long objs[RFS_OBJ_INFO + 1];
+	char *path;
+	int len = 0;
+	int rv;
+
+	path = kzalloc(sizeof(char) * PAGE_SIZE, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+
+	rfs_mutex_lock(&rfs_path_mutex);
+
+	list_for_each_entry(rroot, &rfs_root_list, list) {
+		if (list_empty(&rroot->rpaths))
+			continue;
+
+		rpath = list_entry(rroot->rpaths.next, struct rfs_path,
+				rroot_list);
+
+		rv = redirfs_get_filename(rpath->mnt, rpath->dentry, path,
+				PAGE_SIZE);
+		if (rv) {
+			rfs_mutex_unlock(&rfs_path_mutex);
+			kfree(path);
+			return rv;
+		}
+
+		memset(objs, 0, sizeof(objs));
+		if (rroot->rinfo)
+			rfs_info_objs_sum(rroot->rinfo, objs);
+
+		len += rfs_objs_print(buf + len, size - len, objs,
+				RFS_OBJ_INFO + 1, path);
+
+		if (len >= size) {
+			len = size;
+			break;
+		}
+	}
+
+	rfs_mutex_unlock(&rfs_path_mutex);
+	kfree(path);
+
+	return len;
+}
+
+int rfs_objs_get_flt_info(struct rfs_flt *rflt, char *buf, int size)
+{
+	long objs[RFS_OBJ_END];
+
+	memset(objs, 0, sizeof(objs));
+	rfs_info_objs(rflt, objs);
+	objs[RFS_OBJ_CHAIN] = rfs_chain_count(rflt);
+	objs[RFS_OBJ_DATA] = atomic_long_read(&rflt->data_nr);
+
+	return rfs_objs_print(buf, size, objs, RFS_OBJ_END, rflt->name);
+}
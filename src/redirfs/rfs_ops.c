@@ -23,6 +23,174 @@
 
 #include "rfs.h"
 
+static const char *rfs_op_names[REDIRFS_OP_END] = {
+	[REDIRFS_NONE_DOP_D_REVALIDATE] = "none_dop_d_revalidate",
+	[REDIRFS_NONE_DOP_D_COMPARE] = "none_dop_d_compare",
+	[REDIRFS_NONE_DOP_D_RELEASE] = "none_dop_d_release",
+	[REDIRFS_NONE_DOP_D_IPUT] = "none_dop_d_iput",
+	[REDIRFS_REG_DOP_D_REVALIDATE] = "reg_dop_d_revalidate",
+	[REDIRFS_REG_DOP_D_COMPARE] = "reg_dop_d_compare",
+	[REDIRFS_REG_DOP_D_RELEASE] = "reg_dop_d_release",
+	[REDIRFS_REG_DOP_D_IPUT] = "reg_dop_d_iput",
+	[REDIRFS_DIR_DOP_D_REVALIDATE] = "dir_dop_d_revalidate",
+	[REDIRFS_DIR_DOP_D_COMPARE] = "dir_dop_d_compare",
+	[REDIRFS_DIR_DOP_D_RELEASE] = "dir_dop_d_release",
+	[REDIRFS_DIR_DOP_D_IPUT] = "dir_dop_d_iput",
+	[REDIRFS_CHR_DOP_D_REVALIDATE] = "chr_dop_d_revalidate",
+	[REDIRFS_CHR_DOP_D_COMPARE] = "chr_dop_d_compare",
+	[REDIRFS_CHR_DOP_D_RELEASE] = "chr_dop_d_release",
+	[REDIRFS_CHR_DOP_D_IPUT] = "chr_dop_d_iput",
+	[REDIRFS_BLK_DOP_D_REVALIDATE] = "blk_dop_d_revalidate",
+	[REDIRFS_BLK_DOP_D_COMPARE] = "blk_dop_d_compare",
+	[REDIRFS_BLK_DOP_D_RELEASE] = "blk_dop_d_release",
+	[REDIRFS_BLK_DOP_D_IPUT] = "blk_dop_d_iput",
+	[REDIRFS_FIFO_DOP_D_REVALIDATE] = "fifo_dop_d_revalidate",
+	[REDIRFS_FIFO_DOP_D_COMPARE] = "fifo_dop_d_compare",
+	[REDIRFS_FIFO_DOP_D_RELEASE] = "fifo_dop_d_release",
+	[REDIRFS_FIFO_DOP_D_IPUT] = "fifo_dop_d_iput",
+	[REDIRFS_LNK_DOP_D_REVALIDATE] = "lnk_dop_d_revalidate",
+	[REDIRFS_LNK_DOP_D_COMPARE] = "lnk_dop_d_compare",
+	[REDIRFS_LNK_DOP_D_RELEASE] = "lnk_dop_d_release",
+	[REDIRFS_LNK_DOP_D_IPUT] = "lnk_dop_d_iput",
+	[REDIRFS_SOCK_DOP_D_REVALIDATE] = "sock_dop_d_revalidate",
+	[REDIRFS_SOCK_DOP_D_COMPARE] = "sock_dop_d_compare",
+	[REDIRFS_SOCK_DOP_D_RELEASE] = "sock_dop_d_release",
+	[REDIRFS_SOCK_DOP_D_IPUT] = "sock_dop_d_iput",
+	[REDIRFS_REG_IOP_PERMISSION] = "reg_iop_permission",
+	[REDIRFS_REG_IOP_SETATTR] = "reg_iop_setattr",
+	[REDIRFS_REG_IOP_GETATTR] = "reg_iop_getattr",
+	[REDIRFS_REG_IOP_GETXATTR] = "reg_iop_getxattr",
+	[REDIRFS_REG_IOP_SETXATTR] = "reg_iop_setxattr",
+	[REDIRFS_REG_IOP_LISTXATTR] = "reg_iop_listxattr",
+	[REDIRFS_REG_IOP_REMOVEXATTR] = "reg_iop_removexattr",
+	[REDIRFS_DIR_IOP_CREATE] = "dir_iop_create",
+	[REDIRFS_DIR_IOP_LOOKUP] = "dir_iop_lookup",
+	[REDIRFS_DIR_IOP_LINK] = "dir_iop_link",
+	[REDIRFS_DIR_IOP_UNLINK] = "dir_iop_unlink",
+	[REDIRFS_DIR_IOP_SYMLINK] = "dir_iop_symlink",
+	[REDIRFS_DIR_IOP_MKDIR] = "dir_iop_mkdir",
+	[REDIRFS_DIR_IOP_RMDIR] = "dir_iop_rmdir",
+	[REDIRFS_DIR_IOP_MKNOD] = "dir_iop_mknod",
+	[REDIRFS_DIR_IOP_RENAME] = "dir_iop_rename",
+	[REDIRFS_DIR_IOP_PERMISSION] = "dir_iop_permission",
+	[REDIRFS_DIR_IOP_SETATTR] = "dir_iop_setattr",
+	[REDIRFS_DIR_IOP_GETATTR] = "dir_iop_getattr",
+	[REDIRFS_DIR_IOP_GETXATTR] = "dir_iop_getxattr",
+	[REDIRFS_DIR_IOP_SETXATTR] = "dir_iop_setxattr",
+	[REDIRFS_DIR_IOP_LISTXATTR] = "dir_iop_listxattr",
+	[REDIRFS_DIR_IOP_REMOVEXATTR] = "dir_iop_removexattr",
+	[REDIRFS_CHR_IOP_PERMISSION] = "chr_iop_permission",
+	[REDIRFS_CHR_IOP_SETATTR] = "chr_iop_setattr",
+	[REDIRFS_CHR_IOP_GETATTR] = "chr_iop_getattr",
+	[REDIRFS_CHR_IOP_GETXATTR] = "chr_iop_getxattr",
+	[REDIRFS_CHR_IOP_SETXATTR] = "chr_iop_setxattr",
+	[REDIRFS_CHR_IOP_LISTXATTR] = "chr_iop_listxattr",
+	[REDIRFS_CHR_IOP_REMOVEXATTR] = "chr_iop_removexattr",
+	[REDIRFS_BLK_IOP_PERMISSION] = "blk_iop_permission",
+	[REDIRFS_BLK_IOP_SETATTR] = "blk_iop_setattr",
+	[REDIRFS_BLK_IOP_GETATTR] = "blk_iop_getattr",
+	[REDIRFS_BLK_IOP_GETXATTR] = "blk_iop_getxattr",
+	[REDIRFS_BLK_IOP_SETXATTR] = "blk_iop_setxattr",
+	[REDIRFS_BLK_IOP_LISTXATTR] = "blk_iop_listxattr",
+	[REDIRFS_BLK_IOP_REMOVEXATTR] = "blk_iop_removexattr",
+	[REDIRFS_FIFO_IOP_PERMISSION] = "fifo_iop_permission",
+	[REDIRFS_FIFO_IOP_SETATTR] = "fifo_iop_setattr",
+	[REDIRFS_FIFO_IOP_GETATTR] = "fifo_iop_getattr",
+	[REDIRFS_FIFO_IOP_GETXATTR] = "fifo_iop_getxattr",
+	[REDIRFS_FIFO_IOP_SETXATTR] = "fifo_iop_setxattr",
+	[REDIRFS_FIFO_IOP_LISTXATTR] = "fifo_iop_listxattr",
+	[REDIRFS_FIFO_IOP_REMOVEXATTR] = "fifo_iop_removexattr",
+	[REDIRFS_LNK_IOP_PERMISSION] = "lnk_iop_permission",
+	[REDIRFS_LNK_IOP_SETATTR] = "lnk_iop_setattr",
+	[REDIRFS_LNK_IOP_GETATTR] = "lnk_iop_getattr",
+	[REDIRFS_LNK_IOP_GETXATTR] = "lnk_iop_getxattr",
+	[REDIRFS_LNK_IOP_SETXATTR] = "lnk_iop_setxattr",
+	[REDIRFS_LNK_IOP_LISTXATTR] = "lnk_iop_listxattr",
+	[REDIRFS_LNK_IOP_REMOVEXATTR] = "lnk_iop_removexattr",
+	[REDIRFS_SOCK_IOP_PERMISSION] = "sock_iop_permission",
+	[REDIRFS_SOCK_IOP_SETATTR] = "sock_iop_setattr",
+	[REDIRFS_SOCK_IOP_GETATTR] = "sock_iop_getattr",
+	[REDIRFS_SOCK_IOP_GETXATTR] = "sock_iop_getxattr",
+	[REDIRFS_SOCK_IOP_SETXATTR] = "sock_iop_setxattr",
+	[REDIRFS_SOCK_IOP_LISTXATTR] = "sock_iop_listxattr",
+	[REDIRFS_SOCK_IOP_REMOVEXATTR] = "sock_iop_removexattr",
+	[REDIRFS_REG_FOP_OPEN] = "reg_fop_open",
+	[REDIRFS_REG_FOP_RELEASE] = "reg_fop_release",
+	[REDIRFS_REG_FOP_LLSEEK] = "reg_fop_llseek",
+	[REDIRFS_REG_FOP_READ] = "reg_fop_read",
+	[REDIRFS_REG_FOP_WRITE] = "reg_fop_write",
+	[REDIRFS_REG_FOP_AIO_READ] = "reg_fop_aio_read",
+	[REDIRFS_REG_FOP_AIO_WRITE] = "reg_fop_aio_write",
+	[REDIRFS_REG_FOP_FLUSH] = "reg_fop_flush",
+	[REDIRFS_REG_FOP_SPLICE_READ] = "reg_fop_splice_read",
+	[REDIRFS_REG_FOP_SPLICE_WRITE] = "reg_fop_splice_write",
+	[REDIRFS_REG_FOP_FSYNC] = "reg_fop_fsync",
+	[REDIRFS_REG_FOP_MMAP] = "reg_fop_mmap",
+	[REDIRFS_DIR_FOP_OPEN] = "dir_fop_open",
+	[REDIRFS_DIR_FOP_RELEASE] = "dir_fop_release",
+	[REDIRFS_DIR_FOP_READDIR] = "dir_fop_readdir",
+	[REDIRFS_DIR_FOP_FLUSH] = "dir_fop_flush",
+	[REDIRFS_DIR_FOP_FSYNC] = "dir_fop_fsync",
+	[REDIRFS_CHR_FOP_OPEN] = "chr_fop_open",
+	[REDIRFS_CHR_FOP_RELEASE] = "chr_fop_release",
+	[REDIRFS_CHR_FOP_LLSEEK] = "chr_fop_llseek",
+	[REDIRFS_CHR_FOP_READ] = "chr_fop_read",
+	[REDIRFS_CHR_FOP_WRITE] = "chr_fop_write",
+	[REDIRFS_CHR_FOP_AIO_READ] = "chr_fop_aio_read",
+	[REDIRFS_CHR_FOP_AIO_WRITE] = "chr_fop_aio_write",
+	[REDIRFS_CHR_FOP_FLUSH] = "chr_fop_flush",
+	[REDIRFS_CHR_FOP_SPLICE_READ] = "chr_fop_splice_read",
+	[REDIRFS_CHR_FOP_SPLICE_WRITE] = "chr_fop_splice_write",
+	[REDIRFS_CHR_FOP_FSYNC] = "chr_fop_fsync",
+	[REDIRFS_BLK_FOP_OPEN] = "blk_fop_open",
+	[REDIRFS_BLK_FOP_RELEASE] = "blk_fop_release",
+	[REDIRFS_BLK_FOP_LLSEEK] = "blk_fop_llseek",
+	[REDIRFS_BLK_FOP_READ] = "blk_fop_read",
+	[REDIRFS_BLK_FOP_WRITE] = "blk_fop_write",
+	[REDIRFS_BLK_FOP_AIO_READ] = "blk_fop_aio_read",
+	[REDIRFS_BLK_FOP_AIO_WRITE] = "blk_fop_aio_write",
+	[REDIRFS_BLK_FOP_FLUSH] = "blk_fop_flush",
+	[REDIRFS_BLK_FOP_SPLICE_READ] = "blk_fop_splice_read",
+	[REDIRFS_BLK_FOP_SPLICE_WRITE] = "blk_fop_splice_write",
+	[REDIRFS_BLK_FOP_FSYNC] = "blk_fop_fsync",
+	[REDIRFS_FIFO_FOP_OPEN] = "fifo_fop_open",
+	[REDIRFS_FIFO_FOP_RELEASE] = "fifo_fop_release",
+	[REDIRFS_FIFO_FOP_LLSEEK] = "fifo_fop_llseek",
+	[REDIRFS_FIFO_FOP_READ] = "fifo_fop_read",
+	[REDIRFS_FIFO_FOP_WRITE] = "fifo_fop_write",
+	[REDIRFS_FIFO_FOP_AIO_READ] = "fifo_fop_aio_read",
+	[REDIRFS_FIFO_FOP_AIO_WRITE] = "fifo_fop_aio_write",
+	[REDIRFS_FIFO_FOP_FLUSH] = "fifo_fop_flush",
+	[REDIRFS_FIFO_FOP_SPLICE_READ] = "fifo_fop_splice_read",
+	[REDIRFS_FIFO_FOP_SPLICE_WRITE] = "fifo_fop_splice_write",
+	[REDIRFS_FIFO_FOP_FSYNC] = "fifo_fop_fsync",
+	[REDIRFS_LNK_FOP_OPEN] = "lnk_fop_open",
+	[REDIRFS_LNK_FOP_RELEASE] = "lnk_fop_release",
+	[REDIRFS_LNK_FOP_LLSEEK] = "lnk_fop_llseek",
+	[REDIRFS_LNK_FOP_READ] = "lnk_fop_read",
+	[REDIRFS_LNK_FOP_WRITE] = "lnk_fop_write",
+	[REDIRFS_LNK_FOP_AIO_READ] = "lnk_fop_aio_read",
+	[REDIRFS_LNK_FOP_AIO_WRITE] = "lnk_fop_aio_write",
+	[REDIRFS_LNK_FOP_FLUSH] = "lnk_fop_flush",
+	[REDIRFS_LNK_FOP_SPLICE_READ] = "lnk_fop_splice_read",
+	[REDIRFS_LNK_FOP_SPLICE_WRITE] = "lnk_fop_splice_write",
+	[REDIRFS_LNK_FOP_FSYNC] = "lnk_fop_fsync",
+	[REDIRFS_REG_AOP_READPAGE] = "reg_aop_readpage",
+	[REDIRFS_REG_AOP_WRITEPAGE] = "reg_aop_writepage",
+	[REDIRFS_REG_AOP_READPAGES] = "reg_aop_readpages",
+	[REDIRFS_REG_AOP_WRITEPAGES] = "reg_aop_writepages",
+	[REDIRFS_REG_VMOP_FAULT] = "reg_vmop_fault",
+	[REDIRFS_REG_VMOP_PAGE_MKWRITE] = "reg_vmop_page_mkwrite",
+};
+
+const char *rfs_op_name(enum redirfs_op_id id)
+{
+	if ((unsigned int)id >= REDIRFS_OP_END || !rfs_op_names[id])
+		return "unknown";
+
+	return rfs_op_names[id];
+}
+
 struct rfs_ops *rfs_ops_alloc(void)
 {
 	struct rfs_ops *rops;
@@ -0,0 +1,220 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/jhash.h>
+#include "rfs.h"
+
+#define RFS_OPTBL_HASH_BITS 8
+#define RFS_OPTBL_HASH_SIZE (1 << RFS_OPTBL_HASH_BITS)
+
+static struct hlist_head rfs_optbl_dops_hash[RFS_OPTBL_HASH_SIZE];
+static struct hlist_head rfs_optbl_iops_hash[RFS_OPTBL_HASH_SIZE];
+static struct hlist_head rfs_optbl_fops_hash[RFS_OPTBL_HASH_SIZE];
+static struct hlist_head rfs_optbl_aops_hash[RFS_OPTBL_HASH_SIZE];
+static struct hlist_head rfs_optbl_vmops_hash[RFS_OPTBL_HASH_SIZE];
+
+struct rfs_optbl_type rfs_optbl_dops = {
+	.name = "rfs_dops_cache",
+	.size = sizeof(struct dentry_operations),
+	.hash = rfs_optbl_dops_hash
+};
+
+struct rfs_optbl_type rfs_optbl_iops = {
+	.name = "rfs_iops_cache",
+	.size = sizeof(struct inode_operations),
+	.hash = rfs_optbl_iops_hash
+};
+
+struct rfs_optbl_type rfs_optbl_fops = {
+	.name = "rfs_fops_cache",
+	.size = sizeof(struct file_operations),
+	.hash = rfs_optbl_fops_hash
+};
+
+/*
+ * The VFS reads mapping->a_ops once and keeps using it across sleeping calls
+ * like write_begin without RCU protection, so a table can be used long
+ * after the mapping was switched. The aops tables are never freed, there is
+ * one per original table and set of redirected operations.
+ */
+struct rfs_optbl_type rfs_optbl_aops = {
+	.name = "rfs_aops_cache",
+	.size = sizeof(struct address_space_operations),
+	.hash = rfs_optbl_aops_hash,
+	.pinned = 1
+};
+
+struct rfs_optbl_type rfs_optbl_vmops = {
+	.name = "rfs_vmops_cache",
+	.size = sizeof(struct vm_operations_struct),
+	.hash = rfs_optbl_vmops_hash
+};
+
+static struct rfs_optbl_type *rfs_optbl_types[] = {
+	&rfs_optbl_dops,
+	&rfs_optbl_iops,
+	&rfs_optbl_fops,
+	&rfs_optbl_aops,
+	&rfs_optbl_vmops,
+	NULL
+};
+
+static u32 rfs_optbl_key(struct rfs_optbl_type *type, const void *op_old,
+		const void *ops)
+{
+	return jhash(ops, type->size, (u32)(unsigned long)op_old);
+}
+
+static struct rfs_optbl *rfs_optbl_find(struct rfs_optbl_type *type,
+		const void *op_old, const void *ops, u32 key)
+{
+	struct rfs_optbl *optbl;
+	struct hlist_node *pos;
+
+	for (pos = type->hash[hash_long(key, RFS_OPTBL_HASH_BITS)].first; pos;
+			pos = pos->next) {
+		optbl = hlist_entry(pos, struct rfs_optbl, list);
+		if (optbl->key != key || optbl->op_old != op_old)
+			continue;
+
+		if (!memcmp(optbl->ops, ops, type->size))
+			return rfs_optbl_get(optbl);
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns a shared table with the same content as ops. Called with spinlocks
+ * held by the rfs objects.
+ */
+struct rfs_optbl *rfs_optbl_add(struct rfs_optbl_type *type,
+		const void *op_old, const void *ops)
+{
+	struct rfs_optbl *optbl;
+	u32 key;
+
+	key = rfs_optbl_key(type, op_old, ops);
+
+	spin_lock(&type->lock);
+
+	optbl = rfs_optbl_find(type, op_old, ops, key);
+	if (optbl) {
+		spin_unlock(&type->lock);
+		return optbl;
+	}
+
+	optbl = kmem_cache_alloc(type->cache, GFP_ATOMIC);
+	if (!optbl) {
+		spin_unlock(&type->lock);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	INIT_HLIST_NODE(&optbl->list);
+	optbl->type = type;
+	optbl->op_old = op_old;
+	optbl->key = key;
+	/* the extra reference of a pinned table is never dropped */
+	atomic_set(&optbl->count, type->pinned ? 2 : 1);
+	memcpy(optbl->ops, ops, type->size);
+
+	hlist_add_head(&optbl->list, &type->hash[hash_long(key,
+				RFS_OPTBL_HASH_BITS)]);
+
+	spin_unlock(&type->lock);
+
+	return optbl;
+}
+
+struct rfs_optbl *rfs_optbl_get(struct rfs_optbl *optbl)
+{
+	if (!optbl || IS_ERR(optbl))
+		return NULL;
+
+	BUG_ON(!atomic_read(&optbl->count));
+	atomic_inc(&optbl->count);
+
+	return optbl;
+}
+
+static void rfs_optbl_free_rcu(struct rcu_head *head)
+{
+	struct rfs_optbl *optbl = container_of(head, struct rfs_optbl, rcu);
+
+	kmem_cache_free(optbl->type->cache, optbl);
+}
+
+/*
+ * The VFS can still call through the table after the object was switched to
+ * a different one, the table is freed after a grace period.
+ */
+void rfs_optbl_put(struct rfs_optbl *optbl)
+{
+	struct rfs_optbl_type *type;
+
+	if (!optbl || IS_ERR(optbl))
+		return;
+
+	type = optbl->type;
+
+	BUG_ON(!atomic_read(&optbl->count));
+	if (!atomic_dec_and_lock(&optbl->count, &type->lock))
+		return;
+
+	hlist_del(&optbl->list);
+	spin_unlock(&type->lock);
+
+	call_rcu(&optbl->rcu, rfs_optbl_free_rcu);
+}
+
+int rfs_optbl_cache_create(void)
+{
+	struct rfs_optbl_type **type;
+
+	for (type = rfs_optbl_types; *type; type++) {
+		spin_lock_init(&(*type)->lock);
+		(*type)->cache = rfs_kmem_cache_create((*type)->name,
+				sizeof(struct rfs_optbl) + (*type)->size);
+		if (!(*type)->cache) {
+			rfs_optbl_cache_destroy();
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+void rfs_optbl_cache_destroy(void)
+{
+	struct rfs_optbl_type **type;
+
+	rcu_barrier();
+
+	for (type = rfs_optbl_types; *type; type++) {
+		if ((*type)->cache)
+			kmem_cache_destroy((*type)->cache);
+
+		(*type)->cache = NULL;
+	}
+}
+
@@ -21,9 +21,19 @@
  * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <linux/idr.h>
+#include <linux/sort.h>
 #include "rfs.h"
+#include "rfs_trace.h"
 
-static LIST_HEAD(rfs_path_list);
+#define RFS_PATH_HASH_BITS 10
+
+/*
+ * Paths are indexed by (mnt, dentry) and by id. All indexes are protected
+ * by rfs_path_mutex.
+ */
+static struct hlist_head rfs_path_hash[1 << RFS_PATH_HASH_BITS];
+static DEFINE_IDR(rfs_path_idr);
 RFS_DEFINE_MUTEX(rfs_path_mutex);
 
 static struct rfs_path *rfs_path_alloc(struct vfsmount *mnt,
@@ -35,8 +45,8 @@ static struct rfs_path *rfs_path_alloc(struct vfsmount *mnt,
 	if (!rpath)
 		return ERR_PTR(-ENOMEM);
 
-	INIT_LIST_HEAD(&rpath->list);
 	INIT_LIST_HEAD(&rpath->rroot_list);
+	INIT_HLIST_NODE(&rpath->hash);
 	rpath->mnt = mntget(mnt);
 	rpath->dentry = dget(dentry);
 	atomic_set(&rpath->count, 1);
@@ -69,40 +79,40 @@ void rfs_path_put(struct rfs_path *rpath)
 	kfree(rpath);
 }
 
+static struct hlist_head *rfs_path_head(struct vfsmount *mnt,
+		struct dentry *dentry)
+{
+	unsigned long key = (unsigned long)mnt ^ (unsigned long)dentry;
+
+	return &rfs_path_hash[hash_long(key, RFS_PATH_HASH_BITS)];
+}
+
 struct rfs_path *rfs_path_find(struct vfsmount *mnt,
 		struct dentry *dentry)
 {
 	struct rfs_path *rpath = NULL;
-	struct rfs_path *found = NULL;
+	struct hlist_node *pos;
 
-	list_for_each_entry(rpath, &rfs_path_list, list) {
+	for (pos = rfs_path_head(mnt, dentry)->first; pos; pos = pos->next) {
+		rpath = hlist_entry(pos, struct rfs_path, hash);
 		if (rpath->mnt != mnt) 
 			continue;
 
 		if (rpath->dentry != dentry)
 			continue;
 
-		found = rfs_path_get(rpath);
-		break;
+		return rfs_path_get(rpath);
 	}
 
-	return found;
+	return NULL;
 }
 
 struct rfs_path *rfs_path_find_id(int id)
 {
-	struct rfs_path *rpath = NULL;
-	struct rfs_path *found = NULL;
-
-	list_for_each_entry(rpath, &rfs_path_list, list) {
-		if (rpath->id != id)
-			continue;
-
-		found = rfs_path_get(rpath);
-		break;
-	}
+	if (id < 0)
+		return NULL;
 
-	return found;
+	return rfs_path_get(idr_find(&rfs_path_idr, id));
 }
 
 static int rfs_path_add_rroot(struct rfs_path *rpath)
@@ -128,35 +138,58 @@ static void rfs_path_rem_rroot(struct rfs_path *rpath)
 
 static void rfs_path_list_add(struct rfs_path *rpath)
 {
-	list_add_tail(&rpath->list, &rfs_path_list);
+	hlist_add_head(&rpath->hash, rfs_path_head(rpath->mnt, rpath->dentry));
 	rfs_path_get(rpath);
 }
 
 static void rfs_path_list_rem(struct rfs_path *rpath)
 {
-	list_del_init(&rpath->list);
+	hlist_del_init(&rpath->hash);
+	idr_remove(&rfs_path_idr, rpath->id);
 	rfs_path_put(rpath);
 }
 
-static int rfs_path_get_id(void)
+/*
+ * The IDR holds every path, also the ones reserved by an asynchronous
+ * registration without a filter yet, and walks over all paths iterate it.
+ */
+void rfs_path_destroy(void)
 {
-	struct rfs_path *rpath = NULL;
-	int i = 0;
+	idr_destroy(&rfs_path_idr);
+}
 
-mainloop:
-	while (i < INT_MAX) {
-		list_for_each_entry(rpath, &rfs_path_list, list) {
-			if (rpath->id == i) {
-				i++;
-				goto mainloop;
-			}
-		}
-		return i;
-	}
+/*
+ * Returns the lowest free id, the same as the former linear search.
+ */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0))
 
-	return -1;
+static int rfs_path_get_id(struct rfs_path *rpath)
+{
+	return idr_alloc(&rfs_path_idr, rpath, 0, 0, GFP_KERNEL);
 }
 
+#else
+
+static int rfs_path_get_id(struct rfs_path *rpath)
+{
+	int id;
+	int rv;
+
+	do {
+		if (!idr_pre_get(&rfs_path_idr, GFP_KERNEL))
+			return -ENOMEM;
+
+		rv = idr_get_new(&rfs_path_idr, rpath, &id);
+	} while (rv == -EAGAIN);
+
+	if (rv)
+		return rv;
+
+	return id;
+}
+
+#endif
+
 static struct rfs_path *rfs_path_add(struct vfsmount *mnt,
 		struct dentry *dentry)
 {
@@ -168,18 +201,21 @@ static struct rfs_path *rfs_path_add(struct vfsmount *mnt,
 	if (rpath)
 		return rpath;
 
-	id = rfs_path_get_id();
-	if (id < 0)
-		return ERR_PTR(-EBUSY);
-
 	rpath = rfs_path_alloc(mnt, dentry);
 	if (IS_ERR(rpath))
 		return rpath;
 
+	id = rfs_path_get_id(rpath);
+	if (id < 0) {
+		rfs_path_put(rpath);
+		return ERR_PTR(id);
+	}
+
 	rpath->id = id;
 
 	rv = rfs_path_add_rroot(rpath);
 	if (rv) {
+		idr_remove(&rfs_path_idr, id);
 		rfs_path_put(rpath);
 		return ERR_PTR(rv);
 	}
@@ -191,13 +227,43 @@ static struct rfs_path *rfs_path_add(struct vfsmount *mnt,
 
 static void rfs_path_rem(struct rfs_path *rpath)
 {
-	if (rpath->rinch || rpath->rexch)
+	if (rpath->rinch || rpath->rexch || rpath->reserved)
+		return;
+
+	if (hlist_unhashed(&rpath->hash))
 		return;
 
 	rfs_path_rem_rroot(rpath);
 	rfs_path_list_rem(rpath);
 }
 
+/*
+ * Allocate the path and its id without attaching any filter. Used by the
+ * asynchronous registration which reports the id before the dcache walk.
+ * The path is not removed while it is reserved, even if it has no filters.
+ */
+struct rfs_path *rfs_path_reserve(struct vfsmount *mnt, struct dentry *dentry)
+{
+	struct rfs_path *rpath;
+
+	rfs_mutex_lock(&rfs_path_mutex);
+	rpath = rfs_path_add(mnt, dentry);
+	if (!IS_ERR(rpath))
+		rpath->reserved++;
+	rfs_mutex_unlock(&rfs_path_mutex);
+
+	return rpath;
+}
+
+void rfs_path_release(struct rfs_path *rpath)
+{
+	rfs_mutex_lock(&rfs_path_mutex);
+	rpath->reserved--;
+	rfs_path_rem(rpath);
+	rfs_mutex_unlock(&rfs_path_mutex);
+	rfs_path_put(rpath);
+}
+
 static int rfs_path_add_dirs(struct dentry *dentry)
 {
 	struct rfs_inode *rinode;
@@ -378,6 +444,226 @@ exit:
 	return rpath;
 }
 
+struct rfs_path_batch {
+	struct redirfs_path_info *info;
+	struct rfs_path *rpath;
+	int depth;
+	int added; /* the filter was attached by this batch */
+};
+
+static int rfs_path_batch_cmp_sb(const void *a, const void *b)
+{
+	const struct rfs_path_batch *b1 = a;
+	const struct rfs_path_batch *b2 = b;
+	unsigned long sb1 = (unsigned long)b1->info->dentry->d_sb;
+	unsigned long sb2 = (unsigned long)b2->info->dentry->d_sb;
+
+	if (sb1 < sb2)
+		return -1;
+
+	if (sb1 > sb2)
+		return 1;
+
+	return 0;
+}
+
+static int rfs_path_batch_cmp_depth(const void *a, const void *b)
+{
+	const struct rfs_path_batch *b1 = a;
+	const struct rfs_path_batch *b2 = b;
+
+	return b2->depth - b1->depth;
+}
+
+static int rfs_path_depth(struct dentry *dentry)
+{
+	int depth = 0;
+
+	while (!IS_ROOT(dentry)) {
+		dentry = dentry->d_parent;
+		depth++;
+	}
+
+	return depth;
+}
+
+/*
+ * Add paths which are all on the same super block. Called with the rename
+ * lock and rfs_path_mutex held.
+ *
+ * All roots are created first and the paths are then added from the deepest
+ * one. A root walk stops at the roots below it and the subroots already
+ * carry the filter, so each cached dentry is walked once for the whole
+ * batch instead of once for every path above it. The paths keep their
+ * references in the batch, see rfs_path_put_batch.
+ */
+static int rfs_path_add_batch(struct rfs_flt *rflt,
+		struct rfs_path_batch *batch, int nr)
+{
+	struct redirfs_path_info *info;
+	struct rfs_path *rpath;
+	int added;
+	int rv;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		batch[i].depth = rfs_path_depth(batch[i].info->dentry);
+
+	sort(batch, nr, sizeof(struct rfs_path_batch),
+			rfs_path_batch_cmp_depth, NULL);
+
+	for (i = 0; i < nr; i++) {
+		info = batch[i].info;
+		rpath = rfs_path_add(info->mnt, info->dentry);
+		if (IS_ERR(rpath))
+			return PTR_ERR(rpath);
+
+		batch[i].rpath = rpath;
+	}
+
+	for (i = 0; i < nr; i++) {
+		rpath = batch[i].rpath;
+		added = rfs_chain_find(rpath->rinch, rflt) == -1 &&
+			rfs_chain_find(rpath->rexch, rflt) == -1;
+
+		if (batch[i].info->flags == REDIRFS_PATH_INCLUDE)
+			rv = rfs_path_add_include(rpath, rflt);
+
+		else
+			rv = rfs_path_add_exclude(rpath, rflt);
+
+		if (rv)
+			return rv;
+
+		batch[i].added = added;
+	}
+
+	return 0;
+}
+
+/*
+ * Detach the filter from the paths attached by the batch, the shallowest
+ * first. Called with the rename lock and rfs_path_mutex held. A path which
+ * cannot be detached (out of memory) stays registered.
+ */
+static void rfs_path_undo_batch(struct rfs_flt *rflt,
+		struct rfs_path_batch *batch, int nr)
+{
+	int i;
+
+	for (i = nr - 1; i >= 0; i--) {
+		if (!batch[i].added)
+			continue;
+
+		if (batch[i].info->flags == REDIRFS_PATH_INCLUDE)
+			rfs_path_rem_include(batch[i].rpath, rflt);
+
+		else
+			rfs_path_rem_exclude(batch[i].rpath, rflt);
+
+		batch[i].added = 0;
+	}
+}
+
+/*
+ * Drop the paths which ended up without any filter. Called with the rename
+ * lock and rfs_path_mutex held, the references are put by the caller.
+ */
+static void rfs_path_put_batch(struct rfs_path_batch *batch, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (batch[i].rpath)
+			rfs_path_rem(batch[i].rpath);
+	}
+}
+
+/*
+ * Add a NULL terminated array of paths. Paths are grouped by super block
+ * and every group is added under one rename lock and one rfs_path_mutex
+ * section. If a path fails, the filter is detached again from all paths
+ * the call attached it to and the error is returned. Paths which were
+ * already registered for the filter before the call are left as they were.
+ */
+int redirfs_add_paths(redirfs_filter filter, struct redirfs_path_info **infos)
+{
+	struct rfs_path_batch *batch;
+	struct super_block *sb;
+	int rv = 0;
+	int nr = 0;
+	int i, j, k;
+
+	might_sleep();
+
+	if (!filter || IS_ERR(filter) || !infos)
+		return -EINVAL;
+
+	for (nr = 0; infos[nr]; nr++) {
+		if (!infos[nr]->mnt || !infos[nr]->dentry)
+			return -EINVAL;
+
+		if (infos[nr]->flags != REDIRFS_PATH_INCLUDE &&
+		    infos[nr]->flags != REDIRFS_PATH_EXCLUDE)
+			return -EINVAL;
+
+		if (rfs_path_check_fs(infos[nr]->dentry->d_sb->s_type))
+			return -EPERM;
+	}
+
+	if (!nr)
+		return 0;
+
+	batch = kzalloc(sizeof(struct rfs_path_batch) * nr, GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++)
+		batch[i].info = infos[i];
+
+	sort(batch, nr, sizeof(struct rfs_path_batch), rfs_path_batch_cmp_sb,
+			NULL);
+
+	for (i = 0; i < nr; i = j) {
+		sb = batch[i].info->dentry->d_sb;
+		for (j = i; j < nr && batch[j].info->dentry->d_sb == sb; j++)
+			;
+
+		rfs_rename_lock(sb);
+		rfs_mutex_lock(&rfs_path_mutex);
+		rv = rfs_path_add_batch(filter, batch + i, j - i);
+		if (rv)
+			rfs_path_undo_batch(filter, batch + i, j - i);
+		rfs_path_put_batch(batch + i, j - i);
+		rfs_mutex_unlock(&rfs_path_mutex);
+		rfs_rename_unlock(sb);
+
+		if (rv)
+			break;
+	}
+
+	/* roll back the groups added before the failing one */
+	for (k = 0; rv && k < i; k = j) {
+		sb = batch[k].info->dentry->d_sb;
+		for (j = k; j < i && batch[j].info->dentry->d_sb == sb; j++)
+			;
+
+		rfs_rename_lock(sb);
+		rfs_mutex_lock(&rfs_path_mutex);
+		rfs_path_undo_batch(filter, batch + k, j - k);
+		rfs_path_put_batch(batch + k, j - k);
+		rfs_mutex_unlock(&rfs_path_mutex);
+		rfs_rename_unlock(sb);
+	}
+
+	for (i = 0; i < nr; i++)
+		rfs_path_put(batch[i].rpath);
+
+	kfree(batch);
+
+	return rv;
+}
+
 int redirfs_rem_path(redirfs_filter filter, redirfs_path path)
 {
 	struct rfs_path *rpath = (struct rfs_path *)path;
@@ -474,12 +760,31 @@ redirfs_path* redirfs_get_paths_root(redirfs_filter filter, redirfs_root root)
 	return paths;
 }
 
+struct rfs_path_paths {
+	struct rfs_flt *rflt;
+	redirfs_path *paths;
+	int nr;
+};
+
+static int rfs_path_paths_add(int id, void *p, void *data)
+{
+	struct rfs_path *rpath = p;
+	struct rfs_path_paths *rpaths = data;
+
+	if (rfs_chain_find(rpath->rinch, rpaths->rflt) != -1)
+		rpaths->paths[rpaths->nr++] = rfs_path_get(rpath);
+
+	else if (rfs_chain_find(rpath->rexch, rpaths->rflt) != -1)
+		rpaths->paths[rpaths->nr++] = rfs_path_get(rpath);
+
+	return 0;
+}
+
 redirfs_path* redirfs_get_paths(redirfs_filter filter)
 {
 	struct rfs_flt *rflt = filter;
-	struct rfs_path *rpath;
+	struct rfs_path_paths rpaths;
 	redirfs_path *paths;
-	int i = 0;
 
 	might_sleep();
 
@@ -495,16 +800,13 @@ redirfs_path* redirfs_get_paths(redirfs_filter filter)
 		return ERR_PTR(-ENOMEM);
 	}
 
-	list_for_each_entry(rpath, &rfs_path_list, list) {
-		if (rfs_chain_find(rpath->rinch, filter) != -1)
-			paths[i++] = rfs_path_get(rpath);
-
-		else if (rfs_chain_find(rpath->rexch, filter) != -1)
-			paths[i++] = rfs_path_get(rpath);
-	}
+	rpaths.rflt = rflt;
+	rpaths.paths = paths;
+	rpaths.nr = 0;
+	idr_for_each(&rfs_path_idr, rfs_path_paths_add, &rpaths);
 
 	rfs_mutex_unlock(&rfs_path_mutex);
-	paths[i] = NULL;
+	paths[rpaths.nr] = NULL;
 
 	return paths;
 }
@@ -595,52 +897,72 @@ int redirfs_rem_paths(redirfs_filter filter)
 	return rv;
 }
 
-int rfs_path_get_info(struct rfs_flt *rflt, char *buf, int size)
-{
-	struct rfs_path *rpath;
+struct rfs_path_buf {
+	struct rfs_flt *rflt;
 	char *path;
+	char *buf;
+	int size;
+	int len;
+};
+
+static int rfs_path_buf_add(int id, void *p, void *data)
+{
+	struct rfs_path *rpath = p;
+	struct rfs_path_buf *rbuf = data;
 	char type;
-	int len = 0;
 	int rv;
 
-	path = kzalloc(sizeof(char) * PAGE_SIZE, GFP_KERNEL);
-	if (!path)
-		return -ENOMEM;
+	if (rfs_chain_find(rpath->rinch, rbuf->rflt) != -1)
+		type = 'i';
 
-	rfs_mutex_lock(&rfs_path_mutex);
+	else if (rfs_chain_find(rpath->rexch, rbuf->rflt) != -1)
+		type = 'e';
 
-	list_for_each_entry(rpath, &rfs_path_list, list) {
-		if (rfs_chain_find(rpath->rinch, rflt) != -1)
-			type = 'i';
+	else
+		return 0;
 
-		else if (rfs_chain_find(rpath->rexch, rflt) != -1)
-			type = 'e';
+	rv = redirfs_get_filename(rpath->mnt, rpath->dentry, rbuf->path,
+			PAGE_SIZE);
 
-		else
-			continue;
+	if (rv)
+		return rv;
 
-		rv = redirfs_get_filename(rpath->mnt, rpath->dentry, path,
-				PAGE_SIZE);
+	rbuf->len += snprintf(rbuf->buf + rbuf->len,
+			rbuf->size - rbuf->len, "%c:%d:%s", type, rpath->id,
+			rbuf->path) + 1;
 
-		if (rv) {
-			rfs_mutex_unlock(&rfs_path_mutex);
-			kfree(path);
-			return rv;
-		}
+	if (rbuf->len >= rbuf->size) {
+		rbuf->len = rbuf->size;
+		return 1;
+	}
 
-		len += snprintf(buf + len, size - len,"%c:%d:%s",
-				type, rpath->id, path) + 1;
+	return 0;
+}
 
-		if (len >= size) {
-			len = size;
-			break;
-		}
-	}
+int rfs_path_get_info(struct rfs_flt *rflt, char *buf, int size)
+{
+	struct rfs_path_buf rbuf;
+	int rv;
 
+	rbuf.path = kzalloc(sizeof(char) * PAGE_SIZE, GFP_KERNEL);
+	if (!rbuf.path)
+		return -ENOMEM;
+
+	rbuf.rflt = rflt;
+	rbuf.buf = buf;
+	rbuf.size = size;
+	rbuf.len = 0;
+
+	rfs_mutex_lock(&rfs_path_mutex);
+	rv = idr_for_each(&rfs_path_idr, rfs_path_buf_add, &rbuf);
 	rfs_mutex_unlock(&rfs_path_mutex);
-	kfree(path);
 
-	return len;
+	kfree(rbuf.path);
+
+	if (rv < 0)
+		return rv;
+
+	return rbuf.len;
 }
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25))
@@ -916,11 +1238,15 @@ int rfs_fsrename(struct inode *old_dir, struct dentry *old_dentry,
 	struct rfs_root *rroot_dst = NULL;
 	struct rfs_inode *rinode = NULL;
 	struct rfs_dentry *rdentry = NULL;
+	ktime_t start = ktime_set(0, 0);
 	int rv = 0;
 
 	if (old_dir == new_dir)
 		return 0;
 
+	if (rfs_trace_on())
+		start = ktime_get();
+
 	rfs_mutex_lock(&rfs_path_mutex);
 
 	rinode = rfs_inode_find(new_dir);
@@ -953,6 +1279,11 @@ exit:
 	rfs_root_put(rroot_dst);
 	rfs_inode_put(rinode);
 	rfs_dentry_put(rdentry);
+
+	if (rfs_trace_on())
+		trace_redirfs_fsrename(old_dentry, rv,
+				ktime_to_ns(ktime_sub(ktime_get(), start)));
+
 	return rv;
 }
 
@@ -964,6 +1295,7 @@ EXPORT_SYMBOL(redirfs_put_paths);
 EXPORT_SYMBOL(redirfs_get_path_info);
 EXPORT_SYMBOL(redirfs_put_path_info);
 EXPORT_SYMBOL(redirfs_add_path);
+EXPORT_SYMBOL(redirfs_add_paths);
 EXPORT_SYMBOL(redirfs_rem_path);
 EXPORT_SYMBOL(redirfs_rem_paths);
 EXPORT_SYMBOL(redirfs_get_filename);
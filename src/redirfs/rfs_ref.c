@@ -0,0 +1,111 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rfs.h"
+
+static RFS_DEFINE_MUTEX(rfs_ref_mutex);
+
+/*
+ * The caller's reference has to be dropped only after rfs_ref_atomic, the
+ * count cannot reach zero while the per-cpu counters are in use.
+ */
+void rfs_ref_percpu(struct rfs_ref *ref)
+{
+	long __percpu *pcpu;
+
+	pcpu = alloc_percpu(long);
+	if (!pcpu)
+		return;
+
+	rfs_mutex_lock(&rfs_ref_mutex);
+
+	if (ref->pcpu) {
+		rfs_mutex_unlock(&rfs_ref_mutex);
+		free_percpu(pcpu);
+		return;
+	}
+
+	rcu_assign_pointer(ref->pcpu, pcpu);
+
+	rfs_mutex_unlock(&rfs_ref_mutex);
+}
+
+/*
+ * Switching to atomic mode is split in two steps so that several counters
+ * can share one grace period. The bias keeps the atomic count above zero
+ * while puts still land in the per-cpu counters, the caller's reference is
+ * not enough since those puts are not visible in the atomic count yet.
+ */
+long __percpu *rfs_ref_atomic_begin(struct rfs_ref *ref)
+{
+	long __percpu *pcpu;
+
+	rfs_mutex_lock(&rfs_ref_mutex);
+
+	pcpu = ref->pcpu;
+	if (pcpu) {
+		atomic_add(RFS_REF_BIAS, &ref->count);
+		rcu_assign_pointer(ref->pcpu, NULL);
+	}
+
+	rfs_mutex_unlock(&rfs_ref_mutex);
+
+	return pcpu;
+}
+
+/*
+ * Has to be called after a sched RCU grace period following
+ * rfs_ref_atomic_begin.
+ */
+void rfs_ref_atomic_end(struct rfs_ref *ref, long __percpu *pcpu)
+{
+	long sum = 0;
+	int cpu;
+
+	if (!pcpu)
+		return;
+
+	for_each_possible_cpu(cpu)
+		sum += *per_cpu_ptr(pcpu, cpu);
+
+	free_percpu(pcpu);
+
+	/*
+	 * The caller still holds its reference.
+	 */
+	BUG_ON(atomic_sub_return(RFS_REF_BIAS - sum, &ref->count) <= 0);
+}
+
+void rfs_ref_atomic(struct rfs_ref *ref)
+{
+	long __percpu *pcpu;
+
+	might_sleep();
+
+	pcpu = rfs_ref_atomic_begin(ref);
+	if (!pcpu)
+		return;
+
+	synchronize_sched();
+	rfs_ref_atomic_end(ref, pcpu);
+}
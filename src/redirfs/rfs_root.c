@@ -23,8 +23,14 @@
 
 #include "rfs.h"
 
+#define RFS_ROOT_HASH_BITS 10
+
 LIST_HEAD(rfs_root_list);
 LIST_HEAD(rfs_root_walk_list);
+/* roots indexed by dentry, protected by rfs_path_mutex */
+static struct hlist_head rfs_root_hash[1 << RFS_ROOT_HASH_BITS];
+/* rfs_root_add_walk is called from the parallel dcache walk */
+static DEFINE_SPINLOCK(rfs_root_walk_lock);
 
 static struct rfs_root *rfs_root_alloc(struct dentry *dentry)
 {
@@ -35,9 +41,10 @@ static struct rfs_root *rfs_root_alloc(struct dentry *dentry)
 		return ERR_PTR(-ENOMEM);
 
 	INIT_LIST_HEAD(&rroot->list);
+	INIT_HLIST_NODE(&rroot->hash);
 	INIT_LIST_HEAD(&rroot->walk_list);
 	INIT_LIST_HEAD(&rroot->rpaths);
-	INIT_LIST_HEAD(&rroot->data);
+	rfs_data_slots_init(&rroot->data, 0);
 	rroot->dentry = dentry;
 	rroot->paths_nr = 0;
 	spin_lock_init(&rroot->lock);
@@ -68,35 +75,43 @@ void rfs_root_put(struct rfs_root *rroot)
 
 	rfs_chain_put(rroot->rinch);
 	rfs_chain_put(rroot->rexch);
-	rfs_data_remove(&rroot->data);
+	rfs_data_slots_remove(&rroot->data);
 	kfree(rroot);
 }
 
+static struct hlist_head *rfs_root_head(struct dentry *dentry)
+{
+	return &rfs_root_hash[hash_long((unsigned long)dentry,
+			RFS_ROOT_HASH_BITS)];
+}
+
 static struct rfs_root *rfs_root_find(struct dentry *dentry)
 {
 	struct rfs_root *rroot = NULL;
-	struct rfs_root *found = NULL;
+	struct hlist_node *pos;
 
-	list_for_each_entry(rroot, &rfs_root_list, list) {
+	for (pos = rfs_root_head(dentry)->first; pos; pos = pos->next) {
+		rroot = hlist_entry(pos, struct rfs_root, hash);
 		if (rroot->dentry != dentry)
 			continue;
 
-		found = rfs_root_get(rroot);
-		break;
+		return rfs_root_get(rroot);
 	}
 
-	return found;
+	return NULL;
 }
 
 static void rfs_root_list_add(struct rfs_root *rroot)
 {
 	list_add_tail(&rroot->list, &rfs_root_list);
+	hlist_add_head(&rroot->hash, rfs_root_head(rroot->dentry));
 	rfs_root_get(rroot);
 }
 
 static void rfs_root_list_rem(struct rfs_root *rroot)
 {
 	list_del_init(&rroot->list);
+	hlist_del_init(&rroot->hash);
 	rfs_root_put(rroot);
 }
 
@@ -401,7 +416,9 @@ void rfs_root_add_walk(struct dentry *dentry)
 	if (rdentry->rinfo->rroot->dentry != dentry)
 		goto error;
 
+	spin_lock(&rfs_root_walk_lock);
 	list_add_tail(&rdentry->rinfo->rroot->walk_list, &rfs_root_walk_list);
+	spin_unlock(&rfs_root_walk_lock);
 
 error:
 	rfs_dentry_put(rdentry);
@@ -534,8 +551,19 @@ void redirfs_put_root(redirfs_root root)
 
 void rfs_root_set_rinfo(struct rfs_root *rroot, struct rfs_info *rinfo)
 {
-	rfs_info_put(rroot->rinfo);
+	struct rfs_info *rinfo_old = rroot->rinfo;
+
+	if (rinfo_old == rinfo)
+		return;
+
 	rroot->rinfo = rfs_info_get(rinfo);
+	if (rinfo)
+		rfs_ref_percpu(&rinfo->ref);
+
+	if (!rinfo_old)
+		return;
+
+	rfs_info_retire(rinfo_old);
 }
 
 EXPORT_SYMBOL(redirfs_get_root_file);
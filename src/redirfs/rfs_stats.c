@@ -0,0 +1,270 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rfs.h"
+
+static RFS_DEFINE_MUTEX(rfs_stats_mutex);
+
+static int rfs_stats_want(struct rfs_flt *rflt, int id)
+{
+	return rflt->cbs[id].pre_cb || rflt->cbs[id].post_cb;
+}
+
+static int rfs_stats_alloc_ops(struct rfs_flt *rflt,
+		struct rfs_flt_stats *stats)
+{
+	struct rfs_op_stats *ops;
+	int i;
+
+	for (i = 0; i < REDIRFS_OP_END; i++) {
+		if (stats->ops[i] || !rfs_stats_want(rflt, i))
+			continue;
+
+		ops = alloc_percpu(struct rfs_op_stats);
+		if (!ops)
+			return -ENOMEM;
+
+		rcu_assign_pointer(stats->ops[i], ops);
+	}
+
+	return 0;
+}
+
+void rfs_stats_free(struct rfs_flt_stats *stats)
+{
+	int i;
+
+	if (!stats)
+		return;
+
+	for (i = 0; i < REDIRFS_OP_END; i++) {
+		if (stats->ops[i])
+			free_percpu(stats->ops[i]);
+	}
+
+	kfree(stats);
+}
+
+int rfs_stats_enable(struct rfs_flt *rflt)
+{
+	struct rfs_flt_stats *stats;
+	int rv;
+
+	rfs_mutex_lock(&rfs_stats_mutex);
+
+	if (rflt->stats) {
+		rfs_mutex_unlock(&rfs_stats_mutex);
+		return 0;
+	}
+
+	stats = kzalloc(sizeof(struct rfs_flt_stats), GFP_KERNEL);
+	if (!stats) {
+		rfs_mutex_unlock(&rfs_stats_mutex);
+		return -ENOMEM;
+	}
+
+	rv = rfs_stats_alloc_ops(rflt, stats);
+	if (rv) {
+		rfs_mutex_unlock(&rfs_stats_mutex);
+		rfs_stats_free(stats);
+		return rv;
+	}
+
+	rcu_assign_pointer(rflt->stats, stats);
+
+	rfs_mutex_unlock(&rfs_stats_mutex);
+
+	return 0;
+}
+
+void rfs_stats_disable(struct rfs_flt *rflt)
+{
+	struct rfs_flt_stats *stats;
+
+	rfs_mutex_lock(&rfs_stats_mutex);
+	stats = rflt->stats;
+	rcu_assign_pointer(rflt->stats, NULL);
+	rfs_mutex_unlock(&rfs_stats_mutex);
+
+	if (!stats)
+		return;
+
+	synchronize_rcu();
+	rfs_stats_free(stats);
+}
+
+void rfs_stats_reset(struct rfs_flt *rflt)
+{
+	struct rfs_flt_stats *stats;
+	int cpu;
+	int i;
+
+	rfs_mutex_lock(&rfs_stats_mutex);
+
+	stats = rflt->stats;
+	if (!stats) {
+		rfs_mutex_unlock(&rfs_stats_mutex);
+		return;
+	}
+
+	for (i = 0; i < REDIRFS_OP_END; i++) {
+		if (!stats->ops[i])
+			continue;
+
+		for_each_possible_cpu(cpu)
+			memset(per_cpu_ptr(stats->ops[i], cpu), 0,
+					sizeof(struct rfs_op_stats));
+	}
+
+	rfs_mutex_unlock(&rfs_stats_mutex);
+}
+
+/*
+ * Called with the new operations before they are set, so a failure leaves
+ * the filter untouched. Counters allocated for a failed update are kept
+ * and freed together with the rest of the filter's statistics.
+ */
+int rfs_stats_update(struct rfs_flt *rflt, struct redirfs_op_info ops[])
+{
+	struct rfs_op_stats *op_stats;
+	int rv = 0;
+	int id;
+	int i;
+
+	rfs_mutex_lock(&rfs_stats_mutex);
+
+	if (!rflt->stats)
+		goto exit;
+
+	for (i = 0; ops[i].op_id != REDIRFS_OP_END; i++) {
+		id = ops[i].op_id;
+		if (rflt->stats->ops[id])
+			continue;
+
+		if (!ops[i].pre_cb && !ops[i].post_cb)
+			continue;
+
+		op_stats = alloc_percpu(struct rfs_op_stats);
+		if (!op_stats) {
+			rv = -ENOMEM;
+			break;
+		}
+
+		rcu_assign_pointer(rflt->stats->ops[id], op_stats);
+	}
+exit:
+	rfs_mutex_unlock(&rfs_stats_mutex);
+
+	return rv;
+}
+
+static int rfs_stats_bucket(s64 ns)
+{
+	int bucket;
+
+	if (ns <= 0)
+		return 0;
+
+	bucket = fls64(ns) - 1;
+	if (bucket >= RFS_STATS_BUCKETS)
+		bucket = RFS_STATS_BUCKETS - 1;
+
+	return bucket;
+}
+
+void rfs_stats_record(struct rfs_flt *rflt, enum redirfs_op_id id,
+		enum redirfs_op_call call, s64 ns)
+{
+	struct rfs_flt_stats *stats;
+	struct rfs_op_stats *ops;
+
+	rcu_read_lock();
+
+	stats = rcu_dereference(rflt->stats);
+	if (!stats)
+		goto exit;
+
+	ops = rcu_dereference(stats->ops[id]);
+	if (!ops)
+		goto exit;
+
+	ops = per_cpu_ptr(ops, get_cpu());
+	ops->calls[call]++;
+	ops->hist[call][rfs_stats_bucket(ns)]++;
+	put_cpu();
+exit:
+	rcu_read_unlock();
+}
+
+int rfs_stats_get_info(struct rfs_flt *rflt, enum redirfs_op_id id,
+		char *buf, int size)
+{
+	static const char *calls[2] = {"pre", "post"};
+	struct rfs_flt_stats *stats;
+	struct rfs_op_stats *cpu_ops;
+	struct rfs_op_stats *ops;
+	struct rfs_op_stats *sum;
+	int len = 0;
+	int cpu;
+	int i, j;
+
+	sum = kzalloc(sizeof(struct rfs_op_stats), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	rcu_read_lock();
+
+	stats = rcu_dereference(rflt->stats);
+	ops = stats ? rcu_dereference(stats->ops[id]) : NULL;
+	if (ops) {
+		for_each_possible_cpu(cpu) {
+			cpu_ops = per_cpu_ptr(ops, cpu);
+			for (i = 0; i < 2; i++) {
+				sum->calls[i] += cpu_ops->calls[i];
+				for (j = 0; j < RFS_STATS_BUCKETS; j++)
+					sum->hist[i][j] += cpu_ops->hist[i][j];
+			}
+		}
+	}
+
+	rcu_read_unlock();
+
+	for (i = 0; i < 2 && len < size; i++) {
+		len += snprintf(buf + len, size - len, "%s %lu", calls[i],
+				sum->calls[i]);
+
+		for (j = 0; j < RFS_STATS_BUCKETS && len < size; j++)
+			len += snprintf(buf + len, size - len, " %lu",
+					sum->hist[i][j]);
+
+		if (len < size)
+			len += snprintf(buf + len, size - len, "\n");
+	}
+
+	kfree(sum);
+
+	if (len >= size)
+		len = size;
+
+	return len;
+}
@@ -30,7 +30,7 @@ static struct rfs_flt *rfs_sysfs_flt_get(struct rfs_flt *rflt)
 {
 	spin_lock(&rflt->lock);
 
-	if (atomic_read(&rflt->count) < 3) {
+	if (!rfs_ref_is_percpu(&rflt->ref) && rfs_ref_read(&rflt->ref) < 3) {
 		spin_unlock(&rflt->lock);
 		return ERR_PTR(-ENOENT);
 	}
@@ -145,13 +145,14 @@ static int rfs_flt_paths_add(redirfs_filter filter, const char *buf,
 	struct nameidata nd;
 	char *path;
 	char type;
+	char cmd;
 	int rv;
 
 	path = kzalloc(sizeof(char) * PAGE_SIZE, GFP_KERNEL);
 	if (!path)
 		return -ENOMEM;
 
-	if (sscanf(buf, "a:%c:%s", &type, path) != 2) {
+	if (sscanf(buf, "%c:%c:%s", &cmd, &type, path) != 3) {
 		kfree(path);
 		return -EINVAL;
 	}
@@ -176,7 +177,10 @@ static int rfs_flt_paths_add(redirfs_filter filter, const char *buf,
 	info.dentry = rfs_nameidata_dentry(&nd);
 	info.mnt = rfs_nameidata_mnt(&nd);
 
-	if (!rflt->ops || !rflt->ops->add_path) {
+	if (cmd == 'A')
+		rv = rfs_async_add_path(rflt, &info);
+
+	else if (!rflt->ops || !rflt->ops->add_path) {
 		rpath = redirfs_add_path(filter, &info);
 		if (IS_ERR(rpath))
 			rv = PTR_ERR(rpath);
@@ -191,6 +195,111 @@ static int rfs_flt_paths_add(redirfs_filter filter, const char *buf,
 	return rv;
 }
 
+/*
+ * "b\n<i|e>:<path>\n<i|e>:<path>..." adds all paths in one batch. Paths are
+ * resolved one at a time, the infos hold their own dentry and mnt references.
+ */
+static int rfs_flt_paths_add_batch(redirfs_filter filter, const char *buf,
+		size_t count)
+{
+	struct rfs_flt *rflt = filter;
+	struct redirfs_path_info **infos = NULL;
+	struct redirfs_path_info *info = NULL;
+	struct nameidata nd;
+	char *str = NULL;
+	char *path = NULL;
+	char *line;
+	char *next;
+	char type;
+	int max = 0;
+	int nr = 0;
+	int rv = -ENOMEM;
+	int i;
+
+	str = kzalloc(sizeof(char) * (count + 1), GFP_KERNEL);
+	path = kzalloc(sizeof(char) * PAGE_SIZE, GFP_KERNEL);
+	if (!str || !path)
+		goto exit;
+
+	memcpy(str, buf, count);
+	next = str;
+	line = strsep(&next, "\n");
+	if (strcmp(line, "b")) {
+		rv = -EINVAL;
+		goto exit;
+	}
+
+	for (i = 0; next && next[i]; i++) {
+		if (next[i] == '\n')
+			max++;
+	}
+	max++;
+
+	infos = kzalloc(sizeof(struct redirfs_path_info *) * (max + 1),
+			GFP_KERNEL);
+	info = kzalloc(sizeof(struct redirfs_path_info) * max, GFP_KERNEL);
+	if (!infos || !info)
+		goto exit;
+
+	rv = 0;
+	while ((line = strsep(&next, "\n"))) {
+		if (!*line)
+			continue;
+
+		if (nr == max || sscanf(line, "%c:%s", &type, path) != 2) {
+			rv = -EINVAL;
+			goto exit;
+		}
+
+		if (type == 'i')
+			info[nr].flags = REDIRFS_PATH_INCLUDE;
+
+		else if (type == 'e')
+			info[nr].flags = REDIRFS_PATH_EXCLUDE;
+
+		else {
+			rv = -EINVAL;
+			goto exit;
+		}
+
+		rv = rfs_path_lookup(path, &nd);
+		if (rv)
+			goto exit;
+
+		info[nr].dentry = dget(rfs_nameidata_dentry(&nd));
+		info[nr].mnt = mntget(rfs_nameidata_mnt(&nd));
+		rfs_nameidata_put(&nd);
+		infos[nr] = &info[nr];
+		nr++;
+	}
+
+	/*
+	 * A filter with its own add_path but without add_paths gets the paths
+	 * one by one, the batch is then neither walked once nor rolled back.
+	 */
+	if (rflt->ops && rflt->ops->add_paths)
+		rv = rflt->ops->add_paths(infos);
+
+	else if (rflt->ops && rflt->ops->add_path) {
+		for (i = 0; i < nr && !rv; i++)
+			rv = rflt->ops->add_path(infos[i]);
+
+	} else
+		rv = redirfs_add_paths(filter, infos);
+exit:
+	for (i = 0; i < nr; i++) {
+		dput(info[i].dentry);
+		mntput(info[i].mnt);
+	}
+
+	kfree(info);
+	kfree(infos);
+	kfree(path);
+	kfree(str);
+
+	return rv;
+}
+
 static int rfs_flt_paths_rem(redirfs_filter filter, const char *buf,
 		size_t count)
 {
@@ -293,6 +402,17 @@ static int rfs_flt_paths_clean(redirfs_filter filter, const char *buf,
 	return rv;
 }
 
+static int rfs_flt_paths_cancel(redirfs_filter filter, const char *buf,
+		size_t count)
+{
+	int id;
+
+	if (sscanf(buf, "C:%d", &id) != 1)
+		return -EINVAL;
+
+	return rfs_async_cancel(filter, id);
+}
+
 static ssize_t rfs_flt_paths_store(redirfs_filter filter,
 		struct redirfs_filter_attribute *attr, const char *buf,
 		size_t count)
@@ -302,9 +422,12 @@ static ssize_t rfs_flt_paths_store(redirfs_filter filter,
 	if (count < 2)
 		return -EINVAL;
 
-	if (*buf == 'a')
+	if (*buf == 'a' || *buf == 'A')
 		rv = rfs_flt_paths_add(filter, buf, count);
 
+	else if (*buf == 'b')
+		rv = rfs_flt_paths_add_batch(filter, buf, count);
+
 	else if (*buf == 'r')
 		rv = rfs_flt_paths_rem(filter, buf, count);
 
@@ -314,6 +437,9 @@ static ssize_t rfs_flt_paths_store(redirfs_filter filter,
 	else if (*buf == 'c')
 		rv = rfs_flt_paths_clean(filter, buf, count);
 
+	else if (*buf == 'C')
+		rv = rfs_flt_paths_cancel(filter, buf, count);
+
 	else
 		rv = -EINVAL;
 
@@ -323,6 +449,23 @@ static ssize_t rfs_flt_paths_store(redirfs_filter filter,
 	return count;
 }
 
+static ssize_t rfs_flt_paths_state_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct rfs_flt *rflt = filter;
+
+	return rfs_async_get_info(rflt, buf, PAGE_SIZE);
+}
+
+static ssize_t rfs_flt_reclaimed_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct rfs_flt *rflt = filter;
+
+	return snprintf(buf, PAGE_SIZE, "%ld",
+			atomic_long_read(&rflt->reclaimed));
+}
+
 static ssize_t rfs_flt_unregister_store(redirfs_filter filter,
 		struct redirfs_filter_attribute *attr, const char *buf,
 		size_t count)
@@ -359,6 +502,14 @@ static struct redirfs_filter_attribute rfs_flt_paths_attr =
 	REDIRFS_FILTER_ATTRIBUTE(paths, 0644, rfs_flt_paths_show,
 			rfs_flt_paths_store);
 
+static struct redirfs_filter_attribute rfs_flt_paths_state_attr =
+	REDIRFS_FILTER_ATTRIBUTE(paths_state, 0444, rfs_flt_paths_state_show,
+			NULL);
+
+static struct redirfs_filter_attribute rfs_flt_reclaimed_attr =
+	REDIRFS_FILTER_ATTRIBUTE(reclaimed, 0444, rfs_flt_reclaimed_show,
+			NULL);
+
 static struct redirfs_filter_attribute rfs_flt_unregister_attr = 
 	REDIRFS_FILTER_ATTRIBUTE(unregister, 0200, NULL,
 			rfs_flt_unregister_store);
@@ -367,10 +518,170 @@ static struct attribute *rfs_flt_attrs[] = {
 	&rfs_flt_priority_attr.attr,
 	&rfs_flt_active_attr.attr,
 	&rfs_flt_paths_attr.attr,
+	&rfs_flt_paths_state_attr.attr,
+	&rfs_flt_reclaimed_attr.attr,
 	&rfs_flt_unregister_attr.attr,
 	NULL
 };
 
+static ssize_t rfs_flt_stats_enable_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct rfs_flt *rflt = filter;
+
+	return snprintf(buf, PAGE_SIZE, "%d", rflt->stats ? 1 : 0);
+}
+
+static ssize_t rfs_flt_stats_enable_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct rfs_flt *rflt = filter;
+	int enable;
+	int rv = 0;
+
+	if (sscanf(buf, "%d", &enable) != 1)
+		return -EINVAL;
+
+	if (enable)
+		rv = rfs_stats_enable(rflt);
+	else
+		rfs_stats_disable(rflt);
+
+	if (rv)
+		return rv;
+
+	return count;
+}
+
+static ssize_t rfs_flt_stats_reset_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct rfs_flt *rflt = filter;
+	int reset;
+
+	if (sscanf(buf, "%d", &reset) != 1)
+		return -EINVAL;
+
+	if (reset != 1)
+		return -EINVAL;
+
+	rfs_stats_reset(rflt);
+
+	return count;
+}
+
+static struct redirfs_filter_attribute rfs_flt_stats_enable_attr =
+	REDIRFS_FILTER_ATTRIBUTE(enable, 0644, rfs_flt_stats_enable_show,
+			rfs_flt_stats_enable_store);
+
+static struct redirfs_filter_attribute rfs_flt_stats_reset_attr =
+	REDIRFS_FILTER_ATTRIBUTE(reset, 0200, NULL,
+			rfs_flt_stats_reset_store);
+
+static struct attribute *rfs_flt_stats_attrs[] = {
+	&rfs_flt_stats_enable_attr.attr,
+	&rfs_flt_stats_reset_attr.attr,
+	NULL
+};
+
+static struct attribute_group rfs_flt_stats_group = {
+	.name = "stats",
+	.attrs = rfs_flt_stats_attrs
+};
+
+static struct redirfs_filter_attribute rfs_flt_stats_op_attrs[REDIRFS_OP_END];
+
+static ssize_t rfs_flt_stats_op_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct rfs_flt *rflt = filter;
+
+	return rfs_stats_get_info(rflt, attr - rfs_flt_stats_op_attrs, buf,
+			PAGE_SIZE);
+}
+
+static void rfs_sysfs_stats_init(void)
+{
+	int i;
+
+	for (i = 0; i < REDIRFS_OP_END; i++) {
+		rfs_flt_stats_op_attrs[i].attr.name = rfs_op_name(i);
+		rfs_flt_stats_op_attrs[i].attr.mode = 0444;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,34))
+		rfs_flt_stats_op_attrs[i].attr.owner = THIS_MODULE;
+#endif
+		rfs_flt_stats_op_attrs[i].show = rfs_flt_stats_op_show;
+	}
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22))
+void rfs_flt_sysfs_stats_update(struct rfs_flt *rflt)
+{
+	int i;
+
+	if (!rflt->stats_group)
+		return;
+
+	for (i = 0; i < REDIRFS_OP_END; i++) {
+		if (!rflt->cbs[i].pre_cb && !rflt->cbs[i].post_cb) {
+			if (test_and_clear_bit(i, rflt->stats_files))
+				sysfs_remove_file_from_group(&rflt->kobj,
+					&rfs_flt_stats_op_attrs[i].attr,
+					rfs_flt_stats_group.name);
+			continue;
+		}
+
+		if (test_bit(i, rflt->stats_files))
+			continue;
+
+		if (sysfs_add_file_to_group(&rflt->kobj,
+					&rfs_flt_stats_op_attrs[i].attr,
+					rfs_flt_stats_group.name))
+			continue;
+
+		set_bit(i, rflt->stats_files);
+	}
+}
+
+/*
+ * Called when the filter is unregistered and again when it is deleted.
+ */
+void rfs_flt_sysfs_stats_exit(struct rfs_flt *rflt)
+{
+	int i;
+
+	if (!rflt->stats_group)
+		return;
+
+	for (i = 0; i < REDIRFS_OP_END; i++) {
+		if (!test_and_clear_bit(i, rflt->stats_files))
+			continue;
+
+		sysfs_remove_file_from_group(&rflt->kobj,
+				&rfs_flt_stats_op_attrs[i].attr,
+				rfs_flt_stats_group.name);
+	}
+
+	sysfs_remove_group(&rflt->kobj, &rfs_flt_stats_group);
+	rflt->stats_group = 0;
+}
+#else
+void rfs_flt_sysfs_stats_update(struct rfs_flt *rflt)
+{
+}
+
+void rfs_flt_sysfs_stats_exit(struct rfs_flt *rflt)
+{
+	if (!rflt->stats_group)
+		return;
+
+	sysfs_remove_group(&rflt->kobj, &rfs_flt_stats_group);
+	rflt->stats_group = 0;
+}
+#endif
+
 static struct kset *rfs_flt_kset;
 
 static struct sysfs_ops rfs_sysfs_ops = {
@@ -384,6 +695,118 @@ struct kobj_type rfs_flt_ktype = {
 	.default_attrs = rfs_flt_attrs
 };
 
+/*
+ * /sys/fs/redirfs/stats with the numbers of live redirfs objects.
+ */
+struct rfs_objs_attribute {
+	struct attribute attr;
+	int (*get_info)(char *buf, int size);
+};
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,34))
+#define RFS_OBJS_ATTRIBUTE(__name, __get_info) { \
+	.attr = { \
+		.name = __stringify(__name), \
+		.mode = 0444, \
+		.owner = THIS_MODULE \
+	}, \
+	.get_info = __get_info \
+}
+#else
+#define RFS_OBJS_ATTRIBUTE(__name, __get_info) { \
+	.attr = { \
+		.name = __stringify(__name), \
+		.mode = 0444 \
+	}, \
+	.get_info = __get_info \
+}
+#endif
+
+static ssize_t rfs_objs_show(struct kobject *kobj, struct attribute *attr,
+		char *buf)
+{
+	struct rfs_objs_attribute *oattr;
+
+	oattr = container_of(attr, struct rfs_objs_attribute, attr);
+
+	return oattr->get_info(buf, PAGE_SIZE);
+}
+
+static struct rfs_objs_attribute rfs_objs_attr =
+	RFS_OBJS_ATTRIBUTE(objects, rfs_objs_get_info);
+
+static struct rfs_objs_attribute rfs_objs_roots_attr =
+	RFS_OBJS_ATTRIBUTE(roots, rfs_objs_get_roots_info);
+
+static struct rfs_objs_attribute rfs_objs_filters_attr =
+	RFS_OBJS_ATTRIBUTE(filters, rfs_flt_get_objs_info);
+
+static struct attribute *rfs_objs_attrs[] = {
+	&rfs_objs_attr.attr,
+	&rfs_objs_roots_attr.attr,
+	&rfs_objs_filters_attr.attr,
+	NULL
+};
+
+static struct sysfs_ops rfs_objs_sysfs_ops = {
+	.show = rfs_objs_show
+};
+
+static void rfs_objs_release(struct kobject *kobj)
+{
+	kfree(kobj);
+}
+
+static struct kobj_type rfs_objs_ktype = {
+	.sysfs_ops = &rfs_objs_sysfs_ops,
+	.release = rfs_objs_release,
+	.default_attrs = rfs_objs_attrs
+};
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25))
+static int rfs_sysfs_objs_create(struct kobject *parent)
+{
+	struct kobject *kobj;
+	int rv;
+
+	kobj = kzalloc(sizeof(struct kobject), GFP_KERNEL);
+	if (!kobj)
+		return -ENOMEM;
+
+	kobject_init(kobj);
+	kobj->ktype = &rfs_objs_ktype;
+	kobj->parent = parent;
+	rv = kobject_set_name(kobj, "%s", "stats");
+	if (rv) {
+		kobject_put(kobj);
+		return rv;
+	}
+
+	rv = kobject_register(kobj);
+	if (rv)
+		kobject_put(kobj);
+
+	return rv;
+}
+#else
+static int rfs_sysfs_objs_create(struct kobject *parent)
+{
+	struct kobject *kobj;
+	int rv;
+
+	kobj = kzalloc(sizeof(struct kobject), GFP_KERNEL);
+	if (!kobj)
+		return -ENOMEM;
+
+	kobject_init(kobj, &rfs_objs_ktype);
+	rv = kobject_add(kobj, parent, "%s", "stats");
+	if (rv)
+		kobject_put(kobj);
+
+	return rv;
+}
+#endif
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16))
 static struct kobject *rfs_fs_kobj;
 static struct kobject *rfs_kobj;
@@ -401,6 +824,8 @@ int rfs_sysfs_create(void)
 {
 	int rv;
 
+	rfs_sysfs_stats_init();
+
 	rfs_fs_kobj = kzalloc(sizeof(struct kobject), GFP_KERNEL);
 	if (!rfs_fs_kobj)
 		return -ENOMEM;
@@ -455,6 +880,12 @@ int rfs_sysfs_create(void)
 	if (rv)
 		goto err_kset;
 
+	rv = rfs_sysfs_objs_create(rfs_kobj);
+	if (rv) {
+		kset_unregister(rfs_flt_kset);
+		goto err_rfs_kobj;
+	}
+
 	return 0;
 
 err_kset:
@@ -481,6 +912,8 @@ int rfs_sysfs_create(void)
 {
 	int rv;
 
+	rfs_sysfs_stats_init();
+
 	rfs_kobj = kzalloc(sizeof(struct kobject), GFP_KERNEL);
 	if (!rfs_kobj)
 		return -ENOMEM;
@@ -516,6 +949,12 @@ int rfs_sysfs_create(void)
 	if (rv)
 		goto err_kset;
 
+	rv = rfs_sysfs_objs_create(rfs_kobj);
+	if (rv) {
+		kset_unregister(rfs_flt_kset);
+		goto err_kobj;
+	}
+
 	return 0;
 
 err_kset:
@@ -540,6 +979,8 @@ int rfs_sysfs_create(void)
 {
 	int rv;
 
+	rfs_sysfs_stats_init();
+
 	rfs_kobj = kzalloc(sizeof(struct kobject), GFP_KERNEL);
 	if (!rfs_kobj)
 		return -ENOMEM;
@@ -575,6 +1016,12 @@ int rfs_sysfs_create(void)
 	if (rv)
 		goto err_kset;
 
+	rv = rfs_sysfs_objs_create(rfs_kobj);
+	if (rv) {
+		kset_unregister(rfs_flt_kset);
+		goto err_kobj;
+	}
+
 	return 0;
 
 err_kset:
@@ -588,6 +1035,10 @@ static struct kobject *rfs_kobj;
 
 int rfs_sysfs_create(void)
 {
+	int rv;
+
+	rfs_sysfs_stats_init();
+
 	rfs_kobj = kobject_create_and_add("redirfs", fs_kobj);
 	if (!rfs_kobj)
 		return -ENOMEM;
@@ -598,6 +1049,13 @@ int rfs_sysfs_create(void)
 		return -ENOMEM;
 	}
 
+	rv = rfs_sysfs_objs_create(rfs_kobj);
+	if (rv) {
+		kset_unregister(rfs_flt_kset);
+		kobject_put(rfs_kobj);
+		return rv;
+	}
+
 	return 0;
 }
 #endif
@@ -653,6 +1111,14 @@ int rfs_flt_sysfs_init(struct rfs_flt *rflt)
 	if (rv)
 		return rv;
 
+	rv = sysfs_create_group(&rflt->kobj, &rfs_flt_stats_group);
+	if (rv) {
+		kobject_del(&rflt->kobj);
+		return rv;
+	}
+
+	rflt->stats_group = 1;
+
 	kobject_uevent(&rflt->kobj, KOBJ_ADD, NULL);
 
 	rfs_flt_get(rflt);
@@ -676,6 +1142,14 @@ int rfs_flt_sysfs_init(struct rfs_flt *rflt)
 	if (rv)
 		return rv;
 
+	rv = sysfs_create_group(&rflt->kobj, &rfs_flt_stats_group);
+	if (rv) {
+		kobject_del(&rflt->kobj);
+		return rv;
+	}
+
+	rflt->stats_group = 1;
+
 	kobject_uevent(&rflt->kobj, KOBJ_ADD);
 
 	rfs_flt_get(rflt);
@@ -694,6 +1168,14 @@ int rfs_flt_sysfs_init(struct rfs_flt *rflt)
 	if (rv)
 		return rv;
 
+	rv = sysfs_create_group(&rflt->kobj, &rfs_flt_stats_group);
+	if (rv) {
+		kobject_del(&rflt->kobj);
+		return rv;
+	}
+
+	rflt->stats_group = 1;
+
 	kobject_uevent(&rflt->kobj, KOBJ_ADD);
 
 	rfs_flt_get(rflt);
@@ -704,6 +1186,7 @@ int rfs_flt_sysfs_init(struct rfs_flt *rflt)
 
 void rfs_flt_sysfs_exit(struct rfs_flt *rflt)
 {
+	rfs_flt_sysfs_stats_exit(rflt);
 	kobject_del(&rflt->kobj);
 }
 
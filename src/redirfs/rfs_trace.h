@@ -0,0 +1,183 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM redirfs
+
+#if !defined(_RFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RFS_TRACE_H
+
+#include "rfs.h"
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32))
+
+#define rfs_trace_on() 0
+
+static inline void trace_redirfs_flt_call(struct rfs_flt *rflt,
+		struct redirfs_args *rargs, enum redirfs_rv rv, s64 ns)
+{
+}
+
+static inline void trace_redirfs_dcache_walk(struct dentry *root, int rv,
+		s64 ns)
+{
+}
+
+static inline void trace_redirfs_dcache_walk_progress(struct dentry *root,
+		long dirs, long dentries)
+{
+}
+
+static inline void trace_redirfs_fsrename(struct dentry *dentry, int rv,
+		s64 ns)
+{
+}
+
+#else
+
+#include <linux/tracepoint.h>
+
+extern atomic_t rfs_trace_users;
+
+#define rfs_trace_on() atomic_read(&rfs_trace_users)
+
+void rfs_trace_reg(void);
+void rfs_trace_unreg(void);
+
+TRACE_EVENT_FN(redirfs_flt_call,
+
+	TP_PROTO(struct rfs_flt *rflt, struct redirfs_args *rargs,
+		enum redirfs_rv rv, s64 ns),
+
+	TP_ARGS(rflt, rargs, rv, ns),
+
+	TP_STRUCT__entry(
+		__string(filter, rflt->name)
+		__string(op, rfs_op_name(rargs->type.id))
+		__field(int, id)
+		__field(int, call)
+		__field(int, rv)
+		__field(s64, ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(filter, rflt->name);
+		__assign_str(op, rfs_op_name(rargs->type.id));
+		__entry->id = rargs->type.id;
+		__entry->call = rargs->type.call;
+		__entry->rv = rv;
+		__entry->ns = ns;
+	),
+
+	TP_printk("filter=%s op=%s(%d) call=%s rv=%s duration=%lldns",
+		__get_str(filter), __get_str(op), __entry->id,
+		__entry->call == REDIRFS_PRECALL ? "pre" : "post",
+		__entry->rv == REDIRFS_STOP ? "stop" : "continue",
+		(long long)__entry->ns),
+
+	rfs_trace_reg, rfs_trace_unreg
+);
+
+TRACE_EVENT_FN(redirfs_dcache_walk,
+
+	TP_PROTO(struct dentry *root, int rv, s64 ns),
+
+	TP_ARGS(root, rv, ns),
+
+	TP_STRUCT__entry(
+		__string(root, (const char *)root->d_name.name)
+		__field(int, rv)
+		__field(s64, ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(root, (const char *)root->d_name.name);
+		__entry->rv = rv;
+		__entry->ns = ns;
+	),
+
+	TP_printk("root=%s rv=%d duration=%lldns", __get_str(root),
+		__entry->rv, (long long)__entry->ns),
+
+	rfs_trace_reg, rfs_trace_unreg
+);
+
+TRACE_EVENT_FN(redirfs_dcache_walk_progress,
+
+	TP_PROTO(struct dentry *root, long dirs, long dentries),
+
+	TP_ARGS(root, dirs, dentries),
+
+	TP_STRUCT__entry(
+		__string(root, (const char *)root->d_name.name)
+		__field(long, dirs)
+		__field(long, dentries)
+	),
+
+	TP_fast_assign(
+		__assign_str(root, (const char *)root->d_name.name);
+		__entry->dirs = dirs;
+		__entry->dentries = dentries;
+	),
+
+	TP_printk("root=%s dirs=%ld dentries=%ld", __get_str(root),
+		__entry->dirs, __entry->dentries),
+
+	rfs_trace_reg, rfs_trace_unreg
+);
+
+TRACE_EVENT_FN(redirfs_fsrename,
+
+	TP_PROTO(struct dentry *dentry, int rv, s64 ns),
+
+	TP_ARGS(dentry, rv, ns),
+
+	TP_STRUCT__entry(
+		__string(dentry, (const char *)dentry->d_name.name)
+		__field(int, rv)
+		__field(s64, ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(dentry, (const char *)dentry->d_name.name);
+		__entry->rv = rv;
+		__entry->ns = ns;
+	),
+
+	TP_printk("dentry=%s rv=%d duration=%lldns", __get_str(dentry),
+		__entry->rv, (long long)__entry->ns),
+
+	rfs_trace_reg, rfs_trace_unreg
+);
+
+#endif
+
+#endif /* _RFS_TRACE_H */
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32))
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rfs_trace
+#include <trace/define_trace.h>
+#endif
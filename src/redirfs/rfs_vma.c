@@ -0,0 +1,190 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "rfs.h"
+
+/*
+ * The vm operations of a mapping are replaced by a shared table only if a
+ * filter registered the fault or page_mkwrite operation. The original
+ * operations are kept in the table's op_old. Every vma using the table
+ * holds a reference to it, so the table stays valid until the vma is
+ * unmapped even if the file is not redirected anymore.
+ */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30))
+
+#define rfs_vma_ops_old(vma) \
+	((const struct vm_operations_struct *) \
+	 rfs_optbl_from_ops((vma)->vm_ops)->op_old)
+
+static void rfs_vm_open(struct vm_area_struct *vma)
+{
+	const struct vm_operations_struct *op_old = rfs_vma_ops_old(vma);
+
+	rfs_optbl_get(rfs_optbl_from_ops(vma->vm_ops));
+
+	if (op_old->open)
+		op_old->open(vma);
+}
+
+static void rfs_vm_close(struct vm_area_struct *vma)
+{
+	const struct vm_operations_struct *op_old = rfs_vma_ops_old(vma);
+
+	if (op_old->close)
+		op_old->close(vma);
+
+	rfs_optbl_put(rfs_optbl_from_ops(vma->vm_ops));
+}
+
+static int rfs_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	const struct vm_operations_struct *op_old = rfs_vma_ops_old(vma);
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rargs.type.id = REDIRFS_REG_VMOP_FAULT;
+	rargs.args.v_fault.vma = vma;
+	rargs.args.v_fault.vmf = vmf;
+
+	rfile = rfs_file_find(vma->vm_file);
+	if (!rfile)
+		return op_old->fault(vma, vmf);
+
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = op_old->fault(vma, vmf);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = op_old->fault(rargs.args.v_fault.vma,
+				rargs.args.v_fault.vmf);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+static int rfs_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	const struct vm_operations_struct *op_old = rfs_vma_ops_old(vma);
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+
+	rargs.type.id = REDIRFS_REG_VMOP_PAGE_MKWRITE;
+	rargs.args.v_page_mkwrite.vma = vma;
+	rargs.args.v_page_mkwrite.vmf = vmf;
+
+	rfile = rfs_file_find(vma->vm_file);
+	if (!rfile)
+		return op_old->page_mkwrite(vma, vmf);
+
+	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+
+	if (rfs_chain_idle(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = op_old->page_mkwrite(vma, vmf);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = op_old->page_mkwrite(rargs.args.v_page_mkwrite.vma,
+				rargs.args.v_page_mkwrite.vmf);
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+exit:
+	rfs_file_put(rfile);
+	rfs_info_put(rinfo);
+	return rargs.rv.rv_int;
+}
+
+int rfs_vma_redirected(struct rfs_info *rinfo)
+{
+	if (!rinfo->rops)
+		return 0;
+
+	return rinfo->rops->arr[REDIRFS_REG_VMOP_FAULT] ||
+		rinfo->rops->arr[REDIRFS_REG_VMOP_PAGE_MKWRITE];
+}
+
+/*
+ * Called after the original mmap set up vma->vm_ops. If no table can be
+ * allocated the vma keeps its original operations.
+ */
+void rfs_vma_set_ops(struct vm_area_struct *vma, struct rfs_info *rinfo)
+{
+	const struct vm_operations_struct *op_old = vma->vm_ops;
+	struct vm_operations_struct op_new;
+	struct rfs_optbl *optbl;
+
+	if (!op_old || !rfs_vma_redirected(rinfo))
+		return;
+
+	memcpy(&op_new, op_old, sizeof(struct vm_operations_struct));
+
+	if (op_old->fault && rinfo->rops->arr[REDIRFS_REG_VMOP_FAULT])
+		op_new.fault = rfs_fault;
+
+	if (op_old->page_mkwrite &&
+			rinfo->rops->arr[REDIRFS_REG_VMOP_PAGE_MKWRITE])
+		op_new.page_mkwrite = rfs_page_mkwrite;
+
+	if (op_new.fault == op_old->fault &&
+			op_new.page_mkwrite == op_old->page_mkwrite)
+		return;
+
+	op_new.open = rfs_vm_open;
+	op_new.close = rfs_vm_close;
+
+	optbl = rfs_optbl_add(&rfs_optbl_vmops, op_old, &op_new);
+	if (IS_ERR(optbl))
+		return;
+
+	vma->vm_ops = rfs_optbl_ops(optbl);
+}
+
+#else
+
+int rfs_vma_redirected(struct rfs_info *rinfo)
+{
+	return 0;
+}
+
+void rfs_vma_set_ops(struct vm_area_struct *vma, struct rfs_info *rinfo)
+{
+}
+
+#endif
@@ -0,0 +1,340 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "rfs.h"
+
+/*
+ * Filters can keep a small blob per inode in the trusted.redirfs.<filter>
+ * extended attribute. The value is read on the first request and cached in
+ * the rinode until the rinode goes away. Negative answers are cached too.
+ * xattrs_gen is bumped on every change, so a value read from the disk before
+ * the change is not cached. setxattr and removexattr of the inode are
+ * redirected before the first value is cached and stay redirected until the
+ * rinode goes away.
+ */
+struct rfs_xattr {
+	struct list_head list;
+	char *name;
+	int rv; /* size of the value or a negative error */
+	char value[0];
+};
+
+static struct rfs_xattr *rfs_xattr_alloc(const char *name, size_t size)
+{
+	struct rfs_xattr *rxattr;
+
+	rxattr = kmalloc(sizeof(struct rfs_xattr) + size + strlen(name) + 1,
+			GFP_NOFS);
+	if (!rxattr)
+		return NULL;
+
+	INIT_LIST_HEAD(&rxattr->list);
+	rxattr->name = rxattr->value + size;
+	strcpy(rxattr->name, name);
+	rxattr->rv = -ENODATA;
+
+	return rxattr;
+}
+
+static struct rfs_xattr *rfs_xattr_find(struct rfs_inode *rinode,
+		const char *name)
+{
+	struct rfs_xattr *rxattr;
+
+	list_for_each_entry(rxattr, &rinode->xattrs, list) {
+		if (!strcmp(rxattr->name, name))
+			return rxattr;
+	}
+
+	return NULL;
+}
+
+/*
+ * Replace the cached value. Called with rinode->lock held, rxattr may be
+ * NULL to just drop the value.
+ */
+static void rfs_xattr_replace(struct rfs_inode *rinode, const char *name,
+		struct rfs_xattr *rxattr)
+{
+	struct rfs_xattr *old;
+
+	old = rfs_xattr_find(rinode, name);
+	if (old) {
+		list_del(&old->list);
+		kfree(old);
+	}
+
+	if (rxattr)
+		list_add(&rxattr->list, &rinode->xattrs);
+}
+
+void rfs_xattr_invalidate(struct rfs_inode *rinode, const char *name)
+{
+	if (strncmp(name, RFS_XATTR_PREFIX, RFS_XATTR_PREFIX_LEN))
+		return;
+
+	spin_lock(&rinode->lock);
+	rinode->xattrs_gen++;
+	rfs_xattr_replace(rinode, name, NULL);
+	spin_unlock(&rinode->lock);
+}
+
+void rfs_xattr_free(struct rfs_inode *rinode)
+{
+	struct rfs_xattr *rxattr;
+	struct rfs_xattr *tmp;
+
+	list_for_each_entry_safe(rxattr, tmp, &rinode->xattrs, list) {
+		list_del(&rxattr->list);
+		kfree(rxattr);
+	}
+}
+
+static int rfs_xattr_copy_value(const void *value, int rv, void *buf,
+		size_t size)
+{
+	if (rv < 0 || !size)
+		return rv;
+
+	if (size < rv)
+		return -ERANGE;
+
+	memcpy(buf, value, rv);
+	return rv;
+}
+
+static int rfs_xattr_copy(struct rfs_xattr *rxattr, void *buf, size_t size)
+{
+	return rfs_xattr_copy_value(rxattr->value, rxattr->rv, buf, size);
+}
+
+static char *rfs_xattr_name(redirfs_filter filter)
+{
+	struct rfs_flt *rflt = filter;
+	char *name;
+
+	if (!rflt || IS_ERR(rflt))
+		return ERR_PTR(-EINVAL);
+
+	name = kmalloc(RFS_XATTR_PREFIX_LEN + strlen(rflt->name) + 1,
+			GFP_NOFS);
+	if (!name)
+		return ERR_PTR(-ENOMEM);
+
+	sprintf(name, "%s%s", RFS_XATTR_PREFIX, rflt->name);
+	return name;
+}
+
+/*
+ * The attribute is accessed through the original inode operations, so
+ * neither the filters nor the xattr permission checks are involved.
+ */
+#define rfs_xattr_ops(inode, rinode) \
+	((rinode) ? (rinode)->op_old : (inode)->i_op)
+
+int redirfs_get_xattr_data(redirfs_filter filter, struct dentry *dentry,
+		void *buf, size_t size)
+{
+	struct inode *inode = dentry->d_inode;
+	struct rfs_inode *rinode;
+	const struct inode_operations *op;
+	struct rfs_xattr *rxattr;
+	unsigned long gen = 0;
+	char *value;
+	char *name;
+	int rv;
+
+	if (!inode)
+		return -EINVAL;
+
+	name = rfs_xattr_name(filter);
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+
+	rinode = rfs_inode_find(inode);
+	if (rinode) {
+		rfs_inode_set_ops_xattrs(rinode);
+		spin_lock(&rinode->lock);
+		rxattr = rfs_xattr_find(rinode, name);
+		if (rxattr) {
+			rv = rfs_xattr_copy(rxattr, buf, size);
+			spin_unlock(&rinode->lock);
+			goto exit;
+		}
+		gen = rinode->xattrs_gen;
+		spin_unlock(&rinode->lock);
+	}
+
+	/*
+	 * The value is read into a temporary buffer, so the cached copy
+	 * takes only its real size and negative answers carry no value.
+	 */
+	value = kmalloc(REDIRFS_XATTR_DATA_MAX, GFP_NOFS);
+	if (!value) {
+		rv = -ENOMEM;
+		goto exit;
+	}
+
+	op = rfs_xattr_ops(inode, rinode);
+	if (op && op->getxattr)
+		rv = op->getxattr(dentry, name, value, REDIRFS_XATTR_DATA_MAX);
+	else
+		rv = -EOPNOTSUPP;
+
+	rxattr = NULL;
+	if (rinode && (rv >= 0 || rv == -ENODATA || rv == -EOPNOTSUPP))
+		rxattr = rfs_xattr_alloc(name, rv > 0 ? rv : 0);
+
+	if (rxattr) {
+		if (rv > 0)
+			memcpy(rxattr->value, value, rv);
+		rxattr->rv = rv;
+	}
+
+	rv = rfs_xattr_copy_value(value, rv, buf, size);
+	kfree(value);
+
+	if (!rxattr)
+		goto exit;
+
+	spin_lock(&rinode->lock);
+	if (gen == rinode->xattrs_gen)
+		rfs_xattr_replace(rinode, name, rxattr);
+	else
+		kfree(rxattr);
+	spin_unlock(&rinode->lock);
+exit:
+	rfs_inode_put(rinode);
+	kfree(name);
+	return rv;
+}
+
+/*
+ * Store the filter's blob, size can be at most REDIRFS_XATTR_DATA_MAX. Takes
+ * the inode's mutex, so it must not be called from callbacks of operations
+ * which already hold it.
+ */
+int redirfs_set_xattr_data(redirfs_filter filter, struct dentry *dentry,
+		const void *buf, size_t size)
+{
+	struct inode *inode = dentry->d_inode;
+	struct rfs_inode *rinode;
+	const struct inode_operations *op;
+	struct rfs_xattr *rxattr = NULL;
+	char *name;
+	int rv;
+
+	if (!inode || size > REDIRFS_XATTR_DATA_MAX)
+		return -EINVAL;
+
+	name = rfs_xattr_name(filter);
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+
+	rinode = rfs_inode_find(inode);
+	if (rinode) {
+		rfs_inode_set_ops_xattrs(rinode);
+		rxattr = rfs_xattr_alloc(name, size);
+		if (!rxattr) {
+			rv = -ENOMEM;
+			goto exit;
+		}
+		memcpy(rxattr->value, buf, size);
+		rxattr->rv = size;
+	}
+
+	op = rfs_xattr_ops(inode, rinode);
+	rfs_inode_mutex_lock(inode);
+	if (op && op->setxattr)
+		rv = op->setxattr(dentry, name, buf, size, 0);
+	else
+		rv = -EOPNOTSUPP;
+
+	if (rinode) {
+		spin_lock(&rinode->lock);
+		rinode->xattrs_gen++;
+		rfs_xattr_replace(rinode, name, rv ? NULL : rxattr);
+		spin_unlock(&rinode->lock);
+		if (rv)
+			kfree(rxattr);
+	}
+	rfs_inode_mutex_unlock(inode);
+exit:
+	rfs_inode_put(rinode);
+	kfree(name);
+	return rv;
+}
+
+int redirfs_remove_xattr_data(redirfs_filter filter, struct dentry *dentry)
+{
+	struct inode *inode = dentry->d_inode;
+	struct rfs_inode *rinode;
+	const struct inode_operations *op;
+	struct rfs_xattr *rxattr = NULL;
+	char *name;
+	int rv;
+
+	if (!inode)
+		return -EINVAL;
+
+	name = rfs_xattr_name(filter);
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+
+	rinode = rfs_inode_find(inode);
+	if (rinode) {
+		rfs_inode_set_ops_xattrs(rinode);
+		rxattr = rfs_xattr_alloc(name, 0);
+		if (!rxattr) {
+			rv = -ENOMEM;
+			goto exit;
+		}
+	}
+
+	op = rfs_xattr_ops(inode, rinode);
+	rfs_inode_mutex_lock(inode);
+	if (op && op->removexattr)
+		rv = op->removexattr(dentry, name);
+	else
+		rv = -EOPNOTSUPP;
+
+	if (rinode) {
+		spin_lock(&rinode->lock);
+		rinode->xattrs_gen++;
+		rfs_xattr_replace(rinode, name,
+				(!rv || rv == -ENODATA) ? rxattr : NULL);
+		spin_unlock(&rinode->lock);
+		if (rv && rv != -ENODATA)
+			kfree(rxattr);
+	}
+	rfs_inode_mutex_unlock(inode);
+exit:
+	rfs_inode_put(rinode);
+	kfree(name);
+	return rv;
+}
+
+EXPORT_SYMBOL(redirfs_get_xattr_data);
+EXPORT_SYMBOL(redirfs_set_xattr_data);
+EXPORT_SYMBOL(redirfs_remove_xattr_data);